@@ -4,15 +4,18 @@
 #include <SDL_main.h>                   // only include this one in the source file with main()!
 #include <stdio.h>
 #include <windows.h>
+#include <winsock2.h>
 #include <mathimf.h>
 #include <c-hashmap.h>
 #include <stdlib.h>
+#include <time.h>
 #include <winhttp.h>
 #include <turbojpeg.h>
 #include <miniLZO.h>
 #include <direct.h>
 
 #pragma warning( disable : 4996 4244 )  // "safe" print functions, int-float-double conversion
+#pragma comment( lib, "Ws2_32.lib" )    // mock map service
 
 
 //#define DEBUG
@@ -30,7 +33,8 @@
 int WIDTH = 720;
 int HEIGHT = 720;
 
-const int rasterTileSize = 256;
+int rasterTileSize = 256;                       // 512 for sources configured with @2x or detected from the first decoded map part
+int zoomOffset = 0;                             // zoom levels map parts larger than 256 pixels are ahead in detail of their zoom level
 const char idFormat[] = "%d/%d/%d";
 const unsigned char zero3[] = { '\0', '\0', '\0' };
 
@@ -38,6 +42,8 @@ const long double PI = 3.141592653589793238462643383279L;
 const long double PIHalf = 1.570796326794896619231321691639L;
 const long double PIDouble = 6.28318530717958647692528676655L;
 
+const long double cutoffLatitude = 1.484422229745332366961L;            // for web mercator projection
+
 // approximations, within 1 period length, precision is not bad but it is not good enough for the sizes and calculations involved here
 /*
 long double sinl(long double t) {
@@ -221,6 +227,9 @@ void determineZoom() {
         newZoom = log2l((WIDTH / deltaP) * PIDouble / rasterTileSize);
         newStepSize = deltaP / 16.0L;
     }
+    if (zoomOffset > 0 && newZoom < 0.0F && newZoom > -zoomOffset - 1.0F) {
+        newZoom = 0.0F;                                 // map parts larger than 256 pixels cover small globes at zoom 0
+    }
     if (newZoom >= 0.0F && newZoom <= 30.0F) {
         zoomF = newZoom;
         zoom = (int)ceilf(newZoom);
@@ -324,48 +333,271 @@ ptD atD(int x, int y)
 const float PIF = 3.141592653589793238462643383279F;
 const float PIHalfF = 1.570796326794896619231321691639F;
 const float PIDoubleF = 6.28318530717958647692528676655F;
-/*
-float sinf(float t) {
-    float s = t < 0.0F ? -1.0F : 1.0F;
-    t = fabsf(t);
-    return s * (t < 0.4292F ?
-        t : (
-            t < (PIF - 0.4292F) ?
-            (1.0F - (PIF / 4.74701335F) * (PIF / 4.74701335F) * (t - PIHalfF) * (t - PIHalfF)) : (
-                t < (PIF + 0.4292F) ?
-                (PIF - t) : (
-                    t < (PIDoubleF - 0.4292F) ?
-                    -(1.0F - (PIF / 4.74701335F) * (PIF / 4.74701335F) * (t - (3.0F * PIHalfF)) * (t - (3.0F * PIHalfF))) :
-                    (-PIDoubleF + t)
-                    )
-                )
-            )
-        );
+
+// fast math: minimax polynomials for the per pixel trigonometry, without tables and branching only on the tier, so loops
+// over pixels can be vectorized; the tier is chosen once per frame as the cheapest one whose error stays below half a texel
+// maximum errors against libm, measured with Globe --check-math:
+//                  coarse      medium      fine
+//  sin, cos        1.9e-3      1.0e-5      1.4e-7         absolute
+//  asin, acos      7.7e-4      3.3e-5      3.8e-7         absolute
+//  atan2           1.6e-3      3.1e-5      2.5e-7         relative
+//  atanh           2.1e-3      5.9e-6      1.7e-7         relative
+//  stretch         3.8e-3      2.7e-5      8.7e-7         relative, see stretchWebMercator
+
+typedef enum FastMathTier {
+    COARSE, MEDIUM, FINE, EXACT
+} fastMathTier;
+
+const char* fastMathTierNames[] = { "coarse", "medium", "fine", "exact" };
+const float fastMathError[] = { 4e-3F, 4e-5F, 1e-6F, 3e-7F };              // largest error of the table above per tier, exact: of libm in float
+
+// cheapest tier with an error of at most tolerance
+fastMathTier fastMathTierFor(float tolerance) {
+    fastMathTier tier = COARSE;
+    while (tier < EXACT && fastMathError[tier] > tolerance) {
+        ++tier;
+    }
+    return tier;
 }
 
-float cosf(float t) {
-    t = fabsf(t);
-    return t < (PIHalfF - 0.4292F) ?
-        (1.0F - (PIF / 4.74701335F) * (PIF / 4.74701335F) * t * t) : (
-            t < (PIHalfF + 0.4292F) ?
-            (PIHalfF - t) : (
-                t < (3.0F * PIHalfF - 0.4292F) ?
-                -(1.0F - (PIF / 4.74701335F) * (PIF / 4.74701335F) * (t - PIF) * (t - PIF)) : (
-                    t < (3.0F * PIHalfF + 0.4292F) ?
-                    (-3.0F * PIHalfF + t) : (1.0F - (PIF / 4.74701335F) * (PIF / 4.74701335F) * (t - PIDoubleF) * (t - PIDoubleF))
-                    )
-                )
-            );
+// sin(r) / r and cos(r) for r * r = w, |r| <= pi/4
+float sinPolynomial(float w, fastMathTier tier) {
+    switch (tier) {
+        case COARSE:
+            return 0.999591574F - 0.161535099F * w;
+        case MEDIUM:
+            return 0.999998493F + w * (-0.166623823F + w * 0.00815005656F);
+        default:
+            return 0.999999997F + w * (-0.166666502F + w * (0.00833201645F + w * -0.00019501822F));
+    }
+}
+
+float cosPolynomial(float w, fastMathTier tier) {
+    switch (tier) {
+        case COARSE:
+            return 0.998078499F - 0.474820602F * w;
+        case MEDIUM:
+            return 0.999990035F + w * (-0.49970814F + w * 0.040398536F);
+        default:
+            return 0.999999972F + w * (-0.499998567F + w * (0.0416550269F + w * -0.00135859085F));
+    }
+}
+
+// atan(a) / a for a * a = w, |a| <= 1
+float atanPolynomial(float w, fastMathTier tier) {
+    switch (tier) {
+        case COARSE:
+            return 0.998424083F + w * (-0.30103868F + w * 0.0892504824F);
+        case MEDIUM:
+            return 0.999970034F + w * (-0.33170084F + w * (0.185215676F + w * (-0.091926579F + w * 0.0238634075F)));
+        default:
+            return 0.999999901F + w * (-0.333319907F + w * (0.199697239F + w * (-0.140194809F + w * (0.0991429286F + w * (-0.0594863935F + w * (0.0242524033F + w * -0.00469327606F))))));
+    }
 }
 
-float asinf(float s) {
-    return s < -0.4292F ? -PIHalfF + 1.511F * sqrtf(1.0F + s) : (s < 0.4292F ? s : (PIHalfF - 1.511F * sqrtf(1.0F - s)));
+// atanh(a) / a for a * a = w, |a| <= 1/2
+float atanhPolynomial(float w, fastMathTier tier) {
+    switch (tier) {
+        case COARSE:
+            return 0.997990641F + 0.393656565F * w;
+        case MEDIUM:
+            return 0.999994284F + w * (0.334039071F + w * (0.186629521F + w * 0.220007178F));
+        default:
+            return 0.99999998F + w * (0.333339042F + w * (0.199742063F + w * (0.147063383F + w * (0.0809361038F + w * 0.183936095F))));
+    }
 }
 
-float acosf(float s) {
-    return s < -0.4292F ? PIF - 1.511F * sqrtf(1.0F + s) : (s < 0.4292F ? PIHalfF - s : (1.511F * sqrtf(1.0F - s)));
+// asin(a) / a for a * a = w, |a| <= 1/2
+float asinPolynomial(float w, fastMathTier tier) {
+    switch (tier) {
+        case COARSE:
+            return 0.999266939F + 0.18865181F * w;
+        case MEDIUM:
+            return 1.00003106F + w * (0.164538808F + w * 0.0959882288F);
+        default:
+            return 1.00000008F + w * (0.166651302F + w * (0.0754715332F + w * (0.0396778925F + w * 0.0505920254F)));
+    }
 }
-*/
+
+float fastSin(float t, fastMathTier tier) {
+    if (tier == EXACT) {
+        return sinf(t);
+    }
+    float k = floorf(t * (2.0F / PIF) + .5F);
+    float r = (t - k * 1.5703125F) - k * 4.83826794897e-4F;                     // pi/2 split so k * its first part is exact
+    int quadrant = (int)k & 3;
+    float s = r * sinPolynomial(r * r, tier);
+    float c = cosPolynomial(r * r, tier);
+    float value = quadrant & 1 ? c : s;
+    return quadrant & 2 ? -value : value;
+}
+
+float fastCos(float t, fastMathTier tier) {
+    if (tier == EXACT) {
+        return cosf(t);
+    }
+    float k = floorf(t * (2.0F / PIF) + .5F);
+    float r = (t - k * 1.5703125F) - k * 4.83826794897e-4F;
+    int quadrant = (int)k & 3;
+    float s = r * sinPolynomial(r * r, tier);
+    float c = cosPolynomial(r * r, tier);
+    float value = quadrant & 1 ? s : c;
+    return (quadrant + 1) & 2 ? -value : value;
+}
+
+float fastAsin(float s, fastMathTier tier) {
+    if (tier == EXACT) {
+        return asinf(s);
+    }
+    float a = fabsf(s);
+    float w = .5F * (1.0F - a);
+    float r = sqrtf(w);
+    float value = a <= .5F ? a * asinPolynomial(a * a, tier) : PIHalfF - 2.0F * r * asinPolynomial(w, tier);       // asin(a) == pi/2 - 2 asin(sqrt((1 - a) / 2))
+    return copysignf(value, s);
+}
+
+float fastAcos(float s, fastMathTier tier) {
+    if (tier == EXACT) {
+        return acosf(s);
+    }
+    return PIHalfF - fastAsin(s, tier);
+}
+
+float fastAtan2(float y, float x, fastMathTier tier) {
+    if (tier == EXACT) {
+        return atan2f(y, x);
+    }
+    float ay = fabsf(y);
+    float ax = fabsf(x);
+    float larger = fmaxf(ax, ay);
+    float a = larger > 0.0F ? fminf(ax, ay) / larger : 0.0F;
+    float value = a * atanPolynomial(a * a, tier);
+    value = ay > ax ? PIHalfF - value : value;
+    value = x < 0.0F ? PIF - value : value;
+    return copysignf(value, y);
+}
+
+// ln(x) for positive normal x, from x == m 2^e, |m - 1| <= 0.42, ln(m) == 2 atanh((m - 1) / (m + 1))
+float fastLog(float x, fastMathTier tier) {
+    uint32_t bits;
+    memcpy(&bits, &x, 4);
+    int e = (int)(bits >> 23) - 127;
+    bits = (bits & 0x007FFFFF) | 0x3F800000;
+    float m;
+    memcpy(&m, &bits, 4);
+    e = m > 1.41421356F ? e + 1 : e;
+    m = m > 1.41421356F ? .5F * m : m;
+    float z = (m - 1.0F) / (m + 1.0F);
+    return e * 0.693147181F + 2.0F * z * atanhPolynomial(z * z, tier);
+}
+
+// for |a| < 1
+float fastAtanh(float a, fastMathTier tier) {
+    if (tier == EXACT) {
+        return atanhf(a);
+    }
+    float b = fabsf(a);
+    float value = b <= .5F ? b * atanhPolynomial(b * b, tier) : .5F * fastLog((1.0F + b) / (1.0F - b), tier);
+    return copysignf(value, a);
+}
+
+const float cutoffLatitudeF = 1.484422229745332366961F;            // for web mercator projection
+
+// stretchWebMercator in float
+float fastStretch(float t, fastMathTier tier) {
+    float r = .5F * fminf(fmaxf(t, -cutoffLatitudeF), cutoffLatitudeF);
+    float tangent = tier == EXACT ? tanf(r) : r * sinPolynomial(r * r, tier) / cosPolynomial(r * r, tier);
+    return 2.0F * cutoffLatitudeF / PIF * fastAtanh(tangent, tier);
+}
+
+// error of the fast math tiers against libm in double, printed per function and tier, 1 if one exceeds its fastMathError
+int checkMath() {
+    const int samples = 1000000;
+    const char* names[] = { "sin", "cos", "asin", "acos", "atan2", "atanh", "stretch" };
+    int failed = 0;
+    printf("%-10s", "");
+    for (fastMathTier tier = COARSE; tier <= EXACT; ++tier) {
+        printf("%12s", fastMathTierNames[tier]);
+    }
+    printf("\n");
+    for (int function = 0; function < 7; ++function) {
+        printf("%-10s", names[function]);
+        for (fastMathTier tier = COARSE; tier <= EXACT; ++tier) {
+            double maxError = 0.0;
+            for (int i = 0; i <= samples; ++i) {
+                double f = (double)i / samples;                                 // [0, 1]
+                double value, reference;
+                switch (function) {
+                    case 0: {
+                        float t = (float)((2.0 * f - 1.0) * PIDoubleD);
+                        value = fastSin(t, tier);
+                        reference = sin(t);
+                        break;
+                    }
+                    case 1: {
+                        float t = (float)((2.0 * f - 1.0) * PIDoubleD);
+                        value = fastCos(t, tier);
+                        reference = cos(t);
+                        break;
+                    }
+                    case 2: {
+                        float s = (float)(2.0 * f - 1.0);
+                        value = fastAsin(s, tier);
+                        reference = asin(s);
+                        break;
+                    }
+                    case 3: {
+                        float s = (float)(2.0 * f - 1.0);
+                        value = fastAcos(s, tier);
+                        reference = acos(s);
+                        break;
+                    }
+                    case 4: {
+                        double angle = (2.0 * f - 1.0) * PID;
+                        double radius = i % 3 == 0 ? 1e-3 : (i % 3 == 1 ? 1.0 : 1e3);
+                        float y = (float)(radius * sin(angle));
+                        float x = (float)(radius * cos(angle));
+                        value = fastAtan2(y, x, tier);
+                        reference = atan2(y, x);
+                        break;
+                    }
+                    case 5: {
+                        float a = (float)((2.0 * f - 1.0) * .9999);
+                        value = fastAtanh(a, tier);
+                        reference = atanh(a);
+                        break;
+                    }
+                    default: {
+                        float t = (float)((2.0 * f - 1.0) * cutoffLatitude);
+                        value = fastStretch(t, tier);
+                        reference = 2.0 * atanh(tan(.5 * t)) * cutoffLatitude / PID;
+                        break;
+                    }
+                }
+                double error = fabs(value - reference);
+                if (function >= 4) {
+                    error = reference != 0.0 ? error / fabs(reference) : error;
+                }
+                maxError = fmax(maxError, error);
+            }
+            if (maxError > fastMathError[tier]) {
+                failed = 1;
+            }
+            printf("%12.3g", maxError);
+        }
+        printf("\n");
+    }
+    printf("%s\n", failed ? "errors exceed the documented maximum" : "errors within the documented maximum");
+    return failed;
+}
+
+fastMathTier projectionTier = EXACT;            // of atF, atFWithoutOffsets and the rasterizer with lighting
+
+// half a texel is 1 / (2^zoom rasterTileSize) of the map, of the angles less by the stretching towards the poles
+void determineProjectionTier() {
+    projectionTier = fastMathTierFor(.25F / (powf(2, zoom) * rasterTileSize));
+}
+
 float rScaleF;
 float rScaleSqrF;
 
@@ -389,13 +621,13 @@ ptF atF(int x, int y)
         {
             float r2Sqrt = sqrtf(r2Sqr);
             float yC2 = yC / r2Sqrt;
-            float cAT = cosf(axisTiltF);
+            float cAT = cosf(axisTiltF);                                                                    // exact, its sine is taken as sqrtf(1 - cAT * cAT), amplifying errors
             float ySpace = r2Sqrt * (yC2 * cAT - copysignf(sqrtf((1.0F - yC2 * yC2) * (1.0F - cAT * cAT)), axisTiltF));                     // == r2Sqrt * sinf(asinf(yC / r2Sqrt) - axisTiltF);
             float r2ScAT = r2Sqrt * cAT;
             float r3Sqr = rScaleSqrF - ySpace * ySpace;
             ptF value;
-            value.p = fmodf(phiLeftF + (((axisTiltF > 0.0F && -yC > r2ScAT) || (axisTiltF < 0.0F && yC > r2ScAT)) ? -1.0F : 1.0F) * (r3Sqr > 0.0F ? sqrtf(r3Sqr) > abs(xC) ? acosf(-xC / sqrtf(r3Sqr)) : (PIHalfF + copysignf(PIHalfF, xC)) : PIHalfF) + PIDoubleF, PIDoubleF);
-            value.t = asinf(ySpace / rScaleF);
+            value.p = fmodf(phiLeftF + (((axisTiltF > 0.0F && -yC > r2ScAT) || (axisTiltF < 0.0F && yC > r2ScAT)) ? -1.0F : 1.0F) * (r3Sqr > 0.0F ? sqrtf(r3Sqr) > abs(xC) ? fastAcos(-xC / sqrtf(r3Sqr), projectionTier) : (PIHalfF + copysignf(PIHalfF, xC)) : PIHalfF) + PIDoubleF, PIDoubleF);
+            value.t = fastAsin(ySpace / rScaleF, projectionTier);
             return value;
         }
         else
@@ -424,8 +656,8 @@ ptF atFWithoutOffsets(float x, float y)
         {
             float r3Sqr = rScaleSqrF - yC2;
             ptF value;
-            value.p = r3Sqr > 0.0F ? sqrtf(r3Sqr) > fabsf(xC) ? acosf(-xC / sqrtf(r3Sqr)) : (PIHalfF + copysignf(PIHalfF, xC)) : PIHalfF;
-            value.t = asinf(yC / rScaleF);
+            value.p = r3Sqr > 0.0F ? sqrtf(r3Sqr) > fabsf(xC) ? fastAcos(-xC / sqrtf(r3Sqr), projectionTier) : (PIHalfF + copysignf(PIHalfF, xC)) : PIHalfF;
+            value.t = fastAsin(yC / rScaleF, projectionTier);
             return value;
         }
         else
@@ -459,6 +691,9 @@ void determineZoomF() {
         newZoom = log2f((WIDTH / deltaP) * PIDoubleF / rasterTileSize);
         newStepSize = deltaP / 16.0F;
     }
+    if (zoomOffset > 0 && newZoom < 0.0F && newZoom > -zoomOffset - 1.0F) {
+        newZoom = 0.0F;                                         // map parts larger than 256 pixels cover small globes at zoom 0
+    }
     if (newZoom >= 0.0F && newZoom <= 30.0F) {
         zoomF = newZoom;
         zoom = (int)ceilf(newZoom);
@@ -467,12 +702,52 @@ void determineZoomF() {
 }
 
 
-typedef struct QueueFillLevel {
-    unsigned long long count;
-} queueFillLevel;
+// memory by subsystem: bytes in use and their high-water mark, shown with H and by --benchmark, what is left on exit is reported
+
+typedef enum MemoryCategory {
+    MEMORY_MAP_PARTS,                           // chunks of the tile storage
+    MEMORY_REQUESTS,                            // asyncId of map parts loading
+    MEMORY_QUEUED_PIXELS,                       // pixel and link of the pixels waiting for their map parts
+    MEMORY_REQUEST_CHAINS,                      // idData of the map parts the threads request from the collector, reused, never shrunk
+    MEMORY_QUEUES,                              // imgQueue maps, estimated, see hashmapBytes
+    MEMORY_QUEUE_KEYS,                          // ids keying them
+    MEMORY_CATEGORIES
+} memoryCategory;
+
+const char* memoryCategoryNames[] = { "map parts", "requests", "queued pixels", "request chains", "queues", "queue keys" };
+
+typedef struct MemoryAccount {
+    LONGLONG volatile bytes;
+    LONGLONG volatile highWater;
+    char padding[48];                           // noted by several threads, keeps accounts on cache lines of their own
+} memoryAccount;
+
+memoryAccount memoryAccounts[MEMORY_CATEGORIES];
+
+void noteAllocated(memoryCategory category, long long bytes) {
+    memoryAccount* account = &(memoryAccounts[category]);
+    LONGLONG inUse = InterlockedExchangeAdd64(&(account->bytes), bytes) + bytes;
+    LONGLONG highWater = account->highWater;
+    while (inUse > highWater) {
+        LONGLONG seen = InterlockedCompareExchange64(&(account->highWater), inUse, highWater);
+        if (seen == highWater) {
+            break;
+        }
+        highWater = seen;
+    }
+}
 
-void measurePresence(void* key, size_t ksize, uintptr_t value, void* usr) {
-    ((queueFillLevel*)usr)->count += (unsigned long long)value;
+void noteFreed(memoryCategory category, long long bytes) {
+    InterlockedExchangeAdd64(&(memoryAccounts[category].bytes), -bytes);
+}
+
+// estimated bytes of a map of count entries, c-hashmap allocates buckets of 40 bytes, 20 at first, doubled beyond a load of 3/4
+long long hashmapBytes(long long count) {
+    long long capacity = 20;
+    while (count > capacity * 3 / 4) {
+        capacity *= 2;
+    }
+    return 64 + capacity * 40;
 }
 
 _Atomic int allImagesRequestedPresent;
@@ -485,1032 +760,3667 @@ typedef struct AsyncId {
     HINTERNET hRequest, hConnect, hSession;
     unsigned char* buffer;
     int bytesRead;
+    int capacity;                               // of buffer while downloading, sized by the map part size when the request was sent
+    int prefetch;
+    int speculative;                            // requested by a prediction only, not awaited by the view unless claimed, see requestValue
+    int scale;                                  // decode at 1 / 2^scale
+    int upgrade;                                // replaces a present one decoded at a larger scale, id is a copy of the key
+    int mapped;                                 // buffer is a slice of a packed cache, not to be freed
+    int decoded;                                // buffer holds LZO-compressed pixels of the decoded tier
+    int promote;                                // keep it in the decoded tier once decoded
+    struct Pack* pack;                          // to read it from when queued for reading, NULL for a file of its own
+    unsigned long long offset;
+    long long sent;                             // performance counter when the request was sent, when benchmarking
+    struct AsyncId* next;
 } asyncId;
 
+void freeAsyncId(asyncId* aId) {
+    noteFreed(MEMORY_REQUESTS, sizeof(asyncId));
+    free(aId);
+}
+
+#define SPECULATIVE_REQUEST 1                   // tags the value of a speculative request in imgRequested
+
+// value of a pending map part in imgRequested, others only read its tag, the request may be done and freed by its owner meanwhile
+uintptr_t requestValue(asyncId* aId) {
+    return (uintptr_t)aId | (aId->speculative ? SPECULATIVE_REQUEST : 0);
+}
+
+LONG volatile prefetchesClaimed;                // the view waits for a map part a prediction requested, speculative ones count as awaited
+
+typedef struct QueueFillLevel {
+    unsigned long long count;                   // awaited by the view
+    LONG pending;
+} queueFillLevel;
+
+void measurePresence(void* key, size_t ksize, uintptr_t value, void* usr) {
+    ((queueFillLevel*)usr)->count += value != 0 && (prefetchesClaimed || !(value & SPECULATIVE_REQUEST));
+    ((queueFillLevel*)usr)->pending += value != 0;
+}
+
 _Atomic int notquitrequested;
 
+LONG volatile prefetchesInFlight;
+LONG volatile downloadsInFlight;                // requests sent to the map service and not closed yet, prefetches included
+LONG volatile requestsPending;                  // map parts requested and not done, recounted whenever one is done
+const int maxPrefetchesInFlight = 8;            // budget of concurrent prefetch downloads, keeps the ones of the current view going first
+
+// the main thread blocks for events and the collector for its event, both are woken when state they wait for changed
+
+Uint32 wakeEvent;                               // SDL user event type, pushed at most once until handled
+LONG volatile wakePending;
+HANDLE hCollectorWake;                          // auto-reset
+const DWORD collectorWaitTimeout = 100;         // milliseconds, only bound a missed wake up
+const int idleWaitTimeout = 100;                // milliseconds, only bound a missed wake up
+
+void wakeCollector() {
+    SetEvent(hCollectorWake);
+}
+
+void signalProgress() {
+    wakeCollector();
+    if (InterlockedExchange(&wakePending, 1) == 0) {
+        SDL_Event event;
+        SDL_zero(event);
+        event.type = wakeEvent;
+        SDL_PushEvent(&event);
+    }
+}
+
+void markRequestDone(void* id, int idLength) {
+    hashmap_set(imgRequested, id, idLength, (uintptr_t)0);
+    queueFillLevel counts;
+    counts.count = 0;
+    counts.pending = 0;
+    hashmap_iterate(imgRequested, measurePresence, (void*)&counts);
+    requestsPending = counts.pending;
+    if (counts.count == 0) {
+        prefetchesClaimed = 0;
+        allImagesRequestedPresent = 1;
+        signalProgress();
+    }
+}
+
 char* cachePath;
 size_t cachePathLength;
 
-void onImageLoading(HINTERNET hInternet, DWORD_PTR dwContext, DWORD dwInternetStatus, LPVOID lpvStatusInformation, DWORD dwStatusInformationLength) {
-    asyncId* aId = (asyncId*)dwContext;
-    if (notquitrequested) {
-        if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_READ_COMPLETE) {
-            if (dwStatusInformationLength > 0) {
-                aId->bytesRead += dwStatusInformationLength;
-                int numberBytesToRead = rasterTileSize * rasterTileSize * 3 - aId->bytesRead;
-                if (numberBytesToRead > 0) {
-                    WinHttpReadData(aId->hRequest, aId->buffer + aId->bytesRead, numberBytesToRead, NULL);
-                    return;
-                }
-            }
-            else {
-                tjhandle tjInstance = tj3Init(TJINIT_DECOMPRESS);
-                if (tjInstance != NULL) {
-                    if (tj3DecompressHeader(tjInstance, aId->buffer, aId->bytesRead) == 0) {
-                        unsigned char* pixels = malloc(TJSCALED(tj3Get(tjInstance, TJPARAM_JPEGWIDTH), TJUNSCALED) * TJSCALED(tj3Get(tjInstance, TJPARAM_JPEGHEIGHT), TJUNSCALED) * tjPixelSize[TJPF_RGB]);     // malloced length expectation == rasterTileSize * rasterTileSize * 3
-                        if (pixels != NULL) {
-                            if (tj3Decompress8(tjInstance, aId->buffer, aId->bytesRead, pixels, 0, TJPF_RGB) == 0) {
-                                hashmap_set(imgPresent, aId->id, aId->idLength, (uintptr_t)pixels);
-                            }
-                            else {
-                                free(pixels);
-                            }
-                        }
-                    }
-                    tj3Destroy(tjInstance);
-                }
-            }
-            hashmap_set(imgRequested, (void*)(aId->id), aId->idLength, (uintptr_t)0);
-            queueFillLevel counts;
-            counts.count = 0;
-            hashmap_iterate(imgRequested, measurePresence, (void*)&counts);
-            if (counts.count == 0) {
-                allImagesRequestedPresent = 1;
-            }
-            char* cacheFilePath = malloc(cachePathLength + 24 + 1);
-            if (cacheFilePath != NULL) {
-                char* idStartInCachePath = cacheFilePath + cachePathLength;
-                memcpy(cacheFilePath, cachePath, cachePathLength);
-                int number = 0;
-                while (number < aId->idLength) {
-                    char digit = aId->id[number];
-                    if (digit == '/') {
-                        digit = '-';
-                    }
-                    idStartInCachePath[number] = digit;
-                    ++number;
-                }
-                idStartInCachePath[number] = '\0';
-                FILE* cacheFile = fopen(cacheFilePath, "wb");
-                if (cacheFile != NULL) {
-                    fwrite(aId->buffer, 1, aId->bytesRead, cacheFile);
-                    fclose(cacheFile);
-                }
-                free(cacheFilePath);
-            }
-            goto CLOSE_OPEN;
+// packed caches: entries appended to one data file, found through a memory-mapped hash index keyed by z/x/y
+
+typedef struct PackRecord {
+    unsigned long long key;
+    unsigned int size;
+    unsigned int check;                         // of the bytes following
+} packRecord;                                   // in front of every entry in the data file
+
+typedef struct PackIndexHeader {
+    char magic[8];
+    unsigned long long capacity;                // power of 2
+    unsigned long long count;
+    unsigned long long committed;               // length of the data file covered by the index
+} packIndexHeader;
+
+typedef struct PackEntry {
+    unsigned long long key;                     // 0 == empty
+    unsigned long long offset;                  // of the entry's bytes in the data file
+    unsigned int size;
+    unsigned int check;                         // of key, offset and size, detects torn entries
+    unsigned int hits;                          // times read
+} packEntry;
+
+typedef struct Pack {
+    CRITICAL_SECTION lock;
+    HANDLE hData;
+    HANDLE hIndex;
+    HANDLE hIndexMapping;
+    packIndexHeader* index;                     // followed by capacity entries, NULL if not usable
+    HANDLE hDataMapping;
+    unsigned char* data;                        // read only view of the data file as it was when opened
+    unsigned long long dataMapped;
+    unsigned long long dataEnd;
+    unsigned long long budget;                  // maximum size of the data file, 0 == unlimited
+    char* dataPath;
+    char* indexPath;
+    char* indexPathNew;
+} pack;
+
+const char packMagic[8] = { 'G', 'l', 'o', 'b', 'e', 'P', 'I', '2' };
+const unsigned long long packInitialCapacity = 1 << 16;
+
+pack jpegPack;                                  // map parts as downloaded
+pack decodedPack;                               // frequently read map parts decoded, LZO-compressed
+
+unsigned int fnv1a(const unsigned char* bytes, size_t length, unsigned int hash) {
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+unsigned int packEntryCheck(packEntry* entry) {
+    return fnv1a((unsigned char*)entry, 20, 2166136261u);
+}
+
+// unique per map part: map parts of all coarser zoom levels counted before the ones of z
+unsigned long long packKey(char* id, int idLength) {
+    char terminated[25];
+    int z, x, y;
+    memcpy(terminated, id, idLength);
+    terminated[idLength] = '\0';
+    if (sscanf(terminated, idFormat, &z, &x, &y) != 3 || z < 0 || z > 30) {
+        return 0;
+    }
+    return ((1ULL << (2 * z)) - 1) / 3 + ((unsigned long long)y << z) + (unsigned long long)x + 1;
+}
+
+packEntry* packEntries(packIndexHeader* index) {
+    return (packEntry*)(index + 1);
+}
+
+packEntry* packSlot(packIndexHeader* index, unsigned long long key) {
+    unsigned long long mask = index->capacity - 1;
+    unsigned long long slot = (key * 0x9E3779B97F4A7C15ULL >> 17) & mask;
+    packEntry* entries = packEntries(index);
+    while (entries[slot].key != 0 && entries[slot].key != key) {
+        slot = (slot + 1) & mask;
+    }
+    return &(entries[slot]);
+}
+
+packIndexHeader* mapPackIndex(HANDLE hFile, HANDLE* hMapping, unsigned long long capacity) {
+    unsigned long long size = sizeof(packIndexHeader) + capacity * sizeof(packEntry);
+    *hMapping = CreateFileMapping(hFile, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+    if (*hMapping != NULL) {
+        packIndexHeader* header = MapViewOfFile(*hMapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+        if (header != NULL) {
+            return header;
         }
-        else if (dwInternetStatus == WINHTTP_CALLBACK_FLAG_DATA_AVAILABLE || dwInternetStatus == WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE) {
-            int numberBytesToRead = rasterTileSize * rasterTileSize * 3 - aId->bytesRead;
-            if (numberBytesToRead > 0) {
-                WinHttpReadData(aId->hRequest, aId->buffer + aId->bytesRead, numberBytesToRead, NULL);
-            }
-            else {
-                goto CLOSE_OPEN;
+        CloseHandle(*hMapping);
+        *hMapping = NULL;
+    }
+    return NULL;
+}
+
+void packInsert(packIndexHeader* index, unsigned long long key, unsigned long long offset, unsigned int size, unsigned int hits) {
+    packEntry* entry = packSlot(index, key);
+    if (entry->key == 0) {
+        ++index->count;
+    }
+    entry->offset = offset;
+    entry->size = size;
+    entry->key = key;
+    entry->check = packEntryCheck(entry);
+    entry->hits = hits;
+}
+
+// rebuilds the index at twice the capacity in a new file replacing the current one
+int growPackIndex(pack* p) {
+    HANDLE hFile = CreateFileA(p->indexPathNew, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    unsigned long long capacity = p->index->capacity * 2;
+    HANDLE hMapping;
+    packIndexHeader* grown = mapPackIndex(hFile, &hMapping, capacity);
+    if (grown == NULL) {
+        CloseHandle(hFile);
+        return 0;
+    }
+    memcpy(grown->magic, packMagic, 8);
+    grown->capacity = capacity;
+    grown->count = 0;
+    grown->committed = p->index->committed;
+    packEntry* oldEntries = packEntries(p->index);
+    for (unsigned long long i = 0; i < p->index->capacity; ++i) {
+        if (oldEntries[i].key != 0 && oldEntries[i].check == packEntryCheck(&(oldEntries[i]))) {
+            packInsert(grown, oldEntries[i].key, oldEntries[i].offset, oldEntries[i].size, oldEntries[i].hits);
+        }
+    }
+    FlushViewOfFile(grown, 0);
+    UnmapViewOfFile(p->index);
+    CloseHandle(p->hIndexMapping);
+    CloseHandle(p->hIndex);
+    UnmapViewOfFile(grown);
+    CloseHandle(hMapping);
+    CloseHandle(hFile);
+    p->index = NULL;
+    if (MoveFileExA(p->indexPathNew, p->indexPath, MOVEFILE_REPLACE_EXISTING)) {
+        p->hIndex = CreateFileA(p->indexPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (p->hIndex != INVALID_HANDLE_VALUE) {
+            p->index = mapPackIndex(p->hIndex, &(p->hIndexMapping), capacity);
+            if (p->index != NULL) {
+                return 1;
             }
+            CloseHandle(p->hIndex);
         }
-        else if (dwInternetStatus == WINHTTP_CALLBACK_FLAG_SENDREQUEST_COMPLETE) {
-            aId->buffer = malloc(rasterTileSize * rasterTileSize * 3);                      // using size of uncompressed image hoping it is sufficient (checked above)
-            if (aId->buffer != NULL) {
-                WinHttpReceiveResponse(aId->hRequest, NULL);
+    }
+    p->hIndex = INVALID_HANDLE_VALUE;
+    return 0;                                                                   // unusable until restart, the data file is intact and gets reindexed
+}
+
+void unmapPackData(pack* p) {
+    if (p->data != NULL) {
+        UnmapViewOfFile(p->data);
+        CloseHandle(p->hDataMapping);
+        p->data = NULL;
+    }
+    p->dataMapped = 0;
+}
+
+void mapPackData(pack* p, unsigned long long size) {
+    if (size > 0) {
+        p->hDataMapping = CreateFileMapping(p->hData, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (p->hDataMapping != NULL) {
+            p->data = MapViewOfFile(p->hDataMapping, FILE_MAP_READ, 0, 0, 0);
+            if (p->data != NULL) {
+                p->dataMapped = size;
             }
             else {
-                goto CLOSE_OPEN;
+                CloseHandle(p->hDataMapping);
+                p->hDataMapping = NULL;
             }
         }
-        else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_REQUEST_ERROR) {
-            hashmap_set(imgRequested, (void*)(aId->id), aId->idLength, (uintptr_t)0);
-            queueFillLevel counts;
-            counts.count = 0;
-            hashmap_iterate(imgRequested, measurePresence, (void*)&counts);
-            if (counts.count == 0) {
-                allImagesRequestedPresent = 1;
+    }
+}
+
+void closePack(pack* p) {
+    unmapPackData(p);
+    if (p->index != NULL) {
+        FlushViewOfFile(p->index, 0);
+        UnmapViewOfFile(p->index);
+        CloseHandle(p->hIndexMapping);
+        p->index = NULL;
+    }
+    if (p->hIndex != INVALID_HANDLE_VALUE) {
+        CloseHandle(p->hIndex);
+        p->hIndex = INVALID_HANDLE_VALUE;
+    }
+    if (p->hData != INVALID_HANDLE_VALUE) {
+        CloseHandle(p->hData);
+        p->hData = INVALID_HANDLE_VALUE;
+    }
+    free(p->dataPath);
+    free(p->indexPath);
+    free(p->indexPathNew);
+    p->dataPath = p->indexPath = p->indexPathNew = NULL;
+}
+
+int compareHitsDescending(const void* a, const void* b) {
+    unsigned int first = ((const packEntry*)a)->hits;
+    unsigned int second = ((const packEntry*)b)->hits;
+    return (first < second) - (first > second);
+}
+
+/// <summary>
+/// replaces the data file of a full packed cache by one of the entries read most often, filling half of its budget, so the rest refills
+/// with what is used now; their hits are halved so the ones read often only before age out
+/// </summary>
+/// <param name="p">the pack being opened, its data and index files open, the index not mapped yet</param>
+/// <param name="dataSize">size of the data file</param>
+/// <param name="indexSize">size of the index file</param>
+/// <param name="kept">receives the kept entries at their new offsets to restore their hits once reindexed, to be freed</param>
+/// <param name="keptCount">receives their count</param>
+/// <returns>size of the new data file, 0 if it could not be compacted, p->hData is INVALID_HANDLE_VALUE if it could not be reopened</returns>
+unsigned long long compactPack(pack* p, unsigned long long dataSize, unsigned long long indexSize, packEntry** kept, unsigned long long* keptCount) {
+    *kept = NULL;
+    *keptCount = 0;
+    packIndexHeader header;
+    DWORD read;
+    if (indexSize < sizeof(packIndexHeader) || !ReadFile(p->hIndex, &header, sizeof(packIndexHeader), &read, NULL) || read != sizeof(packIndexHeader) || memcmp(header.magic, packMagic, 8) != 0 || header.capacity < packInitialCapacity || (header.capacity & (header.capacity - 1)) != 0 || indexSize != sizeof(packIndexHeader) + header.capacity * sizeof(packEntry)) {
+        return 0;                                                               // without hits nothing to go by
+    }
+    p->index = mapPackIndex(p->hIndex, &(p->hIndexMapping), header.capacity);
+    mapPackData(p, dataSize);
+    packEntry* entries = p->index != NULL && p->data != NULL ? malloc(min(p->index->count, p->index->capacity) * sizeof(packEntry) + 1) : NULL;
+    unsigned long long count = 0;
+    if (entries != NULL) {
+        packEntry* indexEntries = packEntries(p->index);
+        for (unsigned long long i = 0; i < p->index->capacity && count < p->index->count; ++i) {
+            packEntry entry = indexEntries[i];
+            if (entry.key != 0 && entry.check == packEntryCheck(&entry) && entry.offset >= sizeof(packRecord) && entry.offset + entry.size <= p->dataMapped) {
+                packRecord* record = (packRecord*)(p->data + entry.offset - sizeof(packRecord));
+                if (record->key == entry.key && record->size == entry.size) {
+                    entries[count++] = entry;
+                }
             }
-            goto CLOSE_OPEN;
         }
+        qsort(entries, count, sizeof(packEntry), compareHitsDescending);
     }
-    else {
-CLOSE_OPEN:
-        if (aId->buffer != NULL) {
-            free(aId->buffer);
+    char* dataPathNew = malloc(strlen(p->dataPath) + 4 + 1);
+    HANDLE hNew = INVALID_HANDLE_VALUE;
+    if (entries != NULL && dataPathNew != NULL) {
+        sprintf(dataPathNew, "%s.new", p->dataPath);
+        hNew = CreateFileA(dataPathNew, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+    unsigned long long position = 0;
+    unsigned long long keep = 0;
+    int written = hNew != INVALID_HANDLE_VALUE;
+    for (unsigned long long i = 0; written && i < count && position + sizeof(packRecord) + entries[i].size <= p->budget / 2; ++i) {
+        unsigned char* bytes = p->data + entries[i].offset;
+        if (fnv1a(bytes, entries[i].size, 2166136261u) != ((packRecord*)(bytes - sizeof(packRecord)))->check) {
+            continue;                                                           // torn
         }
-        WinHttpSetStatusCallback(aId->hSession,
-            NULL,
-            WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS,
-            (DWORD_PTR)NULL);
-        WinHttpCloseHandle(aId->hRequest);
-        WinHttpCloseHandle(aId->hConnect);
-        WinHttpCloseHandle(aId->hSession);
-        free(aId);
+        DWORD length = sizeof(packRecord) + entries[i].size;
+        DWORD writtenBytes = 0;
+        written = WriteFile(hNew, bytes - sizeof(packRecord), length, &writtenBytes, NULL) && writtenBytes == length;
+        entries[keep] = entries[i];
+        entries[keep].offset = position + sizeof(packRecord);
+        entries[keep].hits /= 2;
+        ++keep;
+        position += length;
+    }
+    if (hNew != INVALID_HANDLE_VALUE) {
+        CloseHandle(hNew);
+    }
+    unmapPackData(p);
+    if (p->index != NULL) {
+        UnmapViewOfFile(p->index);
+        CloseHandle(p->hIndexMapping);
+        p->index = NULL;
     }
+    if (!written) {
+        if (hNew != INVALID_HANDLE_VALUE) {
+            DeleteFileA(dataPathNew);
+        }
+        free(dataPathNew);
+        free(entries);
+        return 0;
+    }
+    CloseHandle(p->hData);
+    int moved = MoveFileExA(dataPathNew, p->dataPath, MOVEFILE_REPLACE_EXISTING);
+    free(dataPathNew);
+    p->hData = CreateFileA(p->dataPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (!moved) {
+        free(entries);
+        return 0;
+    }
+    LOG(("%s: compacted to %llu of %llu entries, %llu bytes\n", p->dataPath, keep, count, position));
+    *kept = entries;
+    *keptCount = keep;
+    return position;
 }
 
-_Atomic int doCollecting;
-_Atomic int collecting;
-_Atomic int rastered;
-_Atomic int notScheduled;
-_Atomic int wantsCompletion;
-_Atomic int checkingImageRequests;
-_Atomic int dontWaitForCollector;
+/// <summary>
+/// opens or creates a packed cache, indexes records appended after the last index update, cuts off torn ones
+/// </summary>
+/// <param name="p">the pack, its lock initialized</param>
+/// <param name="directory">directory of the pack's files, not 0-terminated</param>
+/// <param name="directoryLength">length of directory</param>
+/// <param name="name">of the pack's files, at most 7 characters</param>
+/// <param name="budget">maximum size of the data file, 0 == unlimited; a full one is compacted to its entries read most often, see compactPack</param>
+/// <returns>1 if usable</returns>
+int openPack(pack* p, char* directory, size_t directoryLength, const char* name, unsigned long long budget) {
+    p->hData = p->hIndex = INVALID_HANDLE_VALUE;
+    p->dataPath = p->indexPath = p->indexPathNew = NULL;
+    p->index = NULL;
+    p->data = NULL;
+    p->dataMapped = p->dataEnd = 0;
+    p->budget = budget;
+    p->dataPath = malloc(directoryLength + 7 + 4 + 1);
+    p->indexPath = malloc(directoryLength + 7 + 4 + 1);
+    p->indexPathNew = malloc(directoryLength + 7 + 8 + 1);
+    if (p->dataPath == NULL || p->indexPath == NULL || p->indexPathNew == NULL) {
+        closePack(p);
+        return 0;
+    }
+    sprintf(p->dataPath, "%.*s%s.dat", (int)directoryLength, directory, name);
+    sprintf(p->indexPath, "%.*s%s.idx", (int)directoryLength, directory, name);
+    sprintf(p->indexPathNew, "%.*s%s.idx.new", (int)directoryLength, directory, name);
+    p->hData = CreateFileA(p->dataPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    p->hIndex = CreateFileA(p->indexPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER dataSize, indexSize;
+    if (p->hData == INVALID_HANDLE_VALUE || p->hIndex == INVALID_HANDLE_VALUE || !GetFileSizeEx(p->hData, &dataSize) || !GetFileSizeEx(p->hIndex, &indexSize)) {
+        closePack(p);
+        return 0;
+    }
+    LARGE_INTEGER zero;
+    zero.QuadPart = 0;
+    packEntry* kept = NULL;
+    unsigned long long keptCount = 0;
+    if (budget != 0 && (unsigned long long)dataSize.QuadPart >= budget) {
+        dataSize.QuadPart = compactPack(p, dataSize.QuadPart, indexSize.QuadPart, &kept, &keptCount);
+        if (p->hData == INVALID_HANDLE_VALUE) {
+            closePack(p);
+            return 0;
+        }
+        if (dataSize.QuadPart == 0) {                                           // started over
+            SetFilePointerEx(p->hData, zero, NULL, FILE_BEGIN);
+            SetEndOfFile(p->hData);
+        }
+        indexSize.QuadPart = 0;                                                 // rebuilt from the data file
+    }
+    unsigned long long capacity = packInitialCapacity;
+    int fresh = 1;
+    if (indexSize.QuadPart >= sizeof(packIndexHeader)) {
+        packIndexHeader header;
+        DWORD read;
+        if (ReadFile(p->hIndex, &header, sizeof(packIndexHeader), &read, NULL) && read == sizeof(packIndexHeader) && memcmp(header.magic, packMagic, 8) == 0 && header.capacity >= packInitialCapacity && (header.capacity & (header.capacity - 1)) == 0 && indexSize.QuadPart == sizeof(packIndexHeader) + header.capacity * sizeof(packEntry)) {
+            capacity = header.capacity;
+            fresh = 0;
+        }
+    }
+    if (fresh) {
+        SetFilePointerEx(p->hIndex, zero, NULL, FILE_BEGIN);
+        SetEndOfFile(p->hIndex);                                                // unknown or damaged, rebuilt from the data file
+    }
+    p->index = mapPackIndex(p->hIndex, &(p->hIndexMapping), capacity);
+    if (p->index == NULL) {
+        free(kept);
+        closePack(p);
+        return 0;
+    }
+    if (fresh) {
+        memcpy(p->index->magic, packMagic, 8);
+        p->index->capacity = capacity;
+        p->index->count = 0;
+        p->index->committed = 0;
+    }
+    mapPackData(p, dataSize.QuadPart);
+    unsigned long long position = p->index->committed <= (unsigned long long)dataSize.QuadPart ? p->index->committed : dataSize.QuadPart;
+    while (p->data != NULL && position + sizeof(packRecord) <= p->dataMapped) {
+        packRecord* record = (packRecord*)(p->data + position);
+        if (record->key == 0 || position + sizeof(packRecord) + record->size > p->dataMapped || fnv1a(p->data + position + sizeof(packRecord), record->size, 2166136261u) != record->check) {
+            break;
+        }
+        if ((p->index->count + 1) * 2 > p->index->capacity && !growPackIndex(p)) {
+            free(kept);
+            closePack(p);
+            return 0;
+        }
+        packInsert(p->index, record->key, position + sizeof(packRecord), record->size, 0);
+        position += sizeof(packRecord) + record->size;
+    }
+    for (unsigned long long i = 0; i < keptCount; ++i) {
+        packEntry* entry = packSlot(p->index, kept[i].key);
+        if (entry->key == kept[i].key) {
+            entry->hits = kept[i].hits;
+        }
+    }
+    free(kept);
+    if (position < (unsigned long long)dataSize.QuadPart) {
+        LOG(("%s: cutting off %llu bytes of torn records\n", name, dataSize.QuadPart - position));
+        unmapPackData(p);
+        LARGE_INTEGER end;
+        end.QuadPart = position;
+        SetFilePointerEx(p->hData, end, NULL, FILE_BEGIN);
+        SetEndOfFile(p->hData);
+        mapPackData(p, position);
+    }
+    p->dataEnd = position;
+    p->index->committed = position;
+    LARGE_INTEGER end;
+    end.QuadPart = p->dataEnd;
+    SetFilePointerEx(p->hData, end, NULL, FILE_BEGIN);
+    return 1;
+}
 
-int maxThreads;
+/// <summary>
+/// looks a map part up in the index of a packed cache without reading it
+/// </summary>
+/// <param name="p">the pack</param>
+/// <param name="id">id of the map part, not 0-terminated</param>
+/// <param name="idLength">length of id</param>
+/// <param name="size">receives the size of the entry</param>
+/// <param name="hits">receives the times it was looked up including this one, NULL to look it up without counting</param>
+/// <returns>offset of the entry's bytes in the data file, 0 if not cached</returns>
+unsigned long long packLookup(pack* p, char* id, int idLength, size_t* size, unsigned int* hits) {
+    unsigned long long key = packKey(id, idLength);
+    unsigned long long offset = 0;
+    if (key == 0) {
+        return 0;
+    }
+    EnterCriticalSection(&(p->lock));
+    if (p->index != NULL) {
+        packEntry* slot = packSlot(p->index, key);
+        packEntry entry = *slot;
+        if (entry.key == key && entry.check == packEntryCheck(&entry) && entry.offset >= sizeof(packRecord) && entry.offset + entry.size <= p->dataEnd) {
+            offset = entry.offset;
+            *size = entry.size;
+            if (hits != NULL) {
+                if (slot->hits < 0xFFFFFFFFu) {
+                    ++slot->hits;
+                }
+                *hits = slot->hits;
+            }
+        }
+    }
+    LeaveCriticalSection(&(p->lock));
+    return offset;
+}
 
-typedef struct IdData {
-    char id[25];                                // max length of id is 24 + \0 (digits for zoom level 30, xy 2^30, 2 /)
-    int idLength;
-    struct IdData* next;
-} idData;
-
-typedef struct ThreadData {
-    int yStart;
-    int yEnd;
-    idData dId;
-    _Atomic int rastering;
-    _Atomic int imageRequestRequested;
-    hashmap* lastQueue;
-    HANDLE hThread;
-    HANDLE hComplete;
-} threadData;
-
-threadData* threadsData;
-
-wchar_t* host;
-wchar_t* pathFormat;
-wchar_t* path;
-
-char* cachePathCollector;
-char* idStartInCachePath;
-
-unsigned __stdcall collector(void* data) {
-    int processPossibleAdditions = 1;
-    do {
-        do {
-            collecting = 1;
-            for (int i = 0; i < maxThreads; ++i) {
-                if (threadsData[i].imageRequestRequested) {
-                    threadsData[i].imageRequestRequested = 0;
-                    idData* dId = &(threadsData[i].dId);
-                    do {
-                        int idLength = dId->idLength;
-                        if (idLength > 0) {
-                            char* id = dId->id;
-
-                            uintptr_t result;
-                            if (!hashmap_get(imgRequested, (void*)id, idLength, &result)) {
-                                int number = 0;
-                                while (number < idLength) {
-                                    char digit = id[number];
-                                    if (digit == '/') {
-                                        digit = '-';
-                                    }
-                                    idStartInCachePath[number] = digit;
-                                    ++number;
-                                }
-                                idStartInCachePath[number] = '\0';
-                                FILE* cacheFile = fopen(cachePathCollector, "rb");
-                                if (cacheFile != NULL) {
-                                    unsigned char* cachedImage = malloc(rasterTileSize * rasterTileSize * 3);                                               // using uncompressed size hoping it suffices, checked below
-                                    if (cachedImage != NULL) {
-                                        size_t sizeRead = fread(cachedImage, sizeof(unsigned char), rasterTileSize * rasterTileSize * 3, cacheFile);
-                                        if (sizeRead != 0 && (sizeRead == rasterTileSize * rasterTileSize * 3 || feof(cacheFile))) {
-                                            fclose(cacheFile);
-                                            tjhandle tjInstance = tj3Init(TJINIT_DECOMPRESS);
-                                            if (tjInstance != NULL) {
-                                                if (tj3DecompressHeader(tjInstance, cachedImage, sizeRead) == 0) {
-                                                    unsigned char* pixels = malloc(TJSCALED(tj3Get(tjInstance, TJPARAM_JPEGWIDTH), TJUNSCALED) * TJSCALED(tj3Get(tjInstance, TJPARAM_JPEGHEIGHT), TJUNSCALED) * tjPixelSize[TJPF_RGB]);     // malloced length expectation == rasterTileSize * rasterTileSize * 3
-                                                    if (pixels != NULL) {
-                                                        if (tj3Decompress8(tjInstance, cachedImage, sizeRead, pixels, 0, TJPF_RGB) == 0) {
-                                                            free(cachedImage);
-                                                            char* pId = malloc(idLength);
-                                                            if (pId != NULL) {
-                                                                memcpy(pId, id, idLength);
-                                                                if (hashmap_sets_left_before_resize(imgPresent) <= 2) {                                                         // <= 1 should suffice but crash was observed in hashmap_get(imgPresent, ...)
-                                                                    dontWaitForCollector = 0;
-                                                                    int countRastering;
-                                                                    do {
-                                                                        if (!notquitrequested) {
-                                                                            goto LIKE_AIDNULL;
-                                                                        }
-                                                                        countRastering = 0;
-                                                                        for (int j = 0; j < maxThreads; ++j) {
-                                                                            countRastering += threadsData[j].rastering;
-                                                                        }
-                                                                    } while (countRastering || !notScheduled || wantsCompletion || !allImagesRequestedPresent);
-                                                                    hashmap_set(imgPresent, (void*)pId, idLength, (uintptr_t)pixels);
-                                                                    hashmap_set(imgRequested, (void*)pId, idLength, (uintptr_t)0);
-                                                                    dontWaitForCollector = 1;
-                                                                    goto AFTER_IMG_REQUEST;
-                                                                }
-                                                                else {
-                                                                    hashmap_set(imgPresent, (void*)pId, idLength, (uintptr_t)pixels);
-                                                                    hashmap_set(imgRequested, (void*)pId, idLength, (uintptr_t)0);
-                                                                    LOG(("from cache: %s\n", id));
-                                                                    goto AFTER_IMG_REQUEST;
-                                                                }
-                                                            }
-                                                        }
-                                                        free(pixels);
-                                                    }
-                                                }
-                                                tj3Destroy(tjInstance);
-                                            }
-                                        }
-                                        else {
-                                            fclose(cacheFile);
-                                        }
-                                        free(cachedImage);
-                                    }
-                                    else {
-                                        fclose(cacheFile);
-                                    }
-                                }
+/// <summary>
+/// reads an entry found by packLookup, checked against its record, so a stale or torn one is a miss
+/// </summary>
+/// <param name="p">the pack</param>
+/// <param name="hFile">handle of the pack's data file of the calling thread, read at offsets</param>
+/// <param name="id">id of the map part, not 0-terminated</param>
+/// <param name="idLength">length of id</param>
+/// <param name="offset">from packLookup</param>
+/// <param name="size">from packLookup</param>
+/// <param name="mapped">receives 1 when the returned bytes are a slice of the mapped data file, 0 when they are malloced</param>
+/// <returns>the entry's bytes, NULL if not readable</returns>
+unsigned char* packRead(pack* p, HANDLE hFile, char* id, int idLength, unsigned long long offset, size_t size, int* mapped) {
+    unsigned long long key = packKey(id, idLength);
+    if (offset + size <= p->dataMapped) {
+        packRecord* record = (packRecord*)(p->data + offset - sizeof(packRecord));
+        if (record->key == key && record->size == size && fnv1a(p->data + offset, size, 2166136261u) == record->check) {        // first touch of the mapped pages, the actual read
+            *mapped = 1;
+            return p->data + offset;
+        }
+        return NULL;
+    }
+    unsigned char* bytes = malloc(sizeof(packRecord) + size);                                  // appended after opening
+    if (bytes != NULL) {
+        OVERLAPPED at = { 0 };
+        at.Offset = (DWORD)(offset - sizeof(packRecord));
+        at.OffsetHigh = (DWORD)((offset - sizeof(packRecord)) >> 32);
+        DWORD read = 0;
+        if (hFile != INVALID_HANDLE_VALUE && ReadFile(hFile, bytes, sizeof(packRecord) + size, &read, &at) && read == sizeof(packRecord) + size && ((packRecord*)bytes)->key == key && ((packRecord*)bytes)->size == size && fnv1a(bytes + sizeof(packRecord), size, 2166136261u) == ((packRecord*)bytes)->check) {
+            memmove(bytes, bytes + sizeof(packRecord), size);
+            *mapped = 0;
+            return bytes;
+        }
+        free(bytes);
+    }
+    return NULL;
+}
 
-                                HINTERNET  hSession = NULL,
-                                    hConnect = NULL,
-                                    hRequest = NULL;
-
-                                // Use WinHttpOpen to obtain a session handle.
-                                hSession = WinHttpOpen(L"WinHTTP Globe/1.0",
-                                    WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
-                                    WINHTTP_NO_PROXY_NAME,
-                                    WINHTTP_NO_PROXY_BYPASS,
-                                    WINHTTP_FLAG_ASYNC);
-
-                                // Specify an HTTP server.
-                                if (hSession) {
-                                    if (WinHttpSetStatusCallback(hSession, (WINHTTP_STATUS_CALLBACK)onImageLoading, WINHTTP_CALLBACK_FLAG_SENDREQUEST_COMPLETE | WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE | WINHTTP_CALLBACK_FLAG_DATA_AVAILABLE | WINHTTP_CALLBACK_STATUS_READ_COMPLETE | WINHTTP_CALLBACK_STATUS_REQUEST_ERROR, (DWORD_PTR)NULL) == NULL) {
-                                        hConnect = WinHttpConnect(hSession, host, INTERNET_DEFAULT_HTTPS_PORT, 0);
-                                    }
-                                }
+// appends an entry to the data file before indexing it, so the index never refers to bytes not written
+int packAppend(pack* p, char* id, int idLength, unsigned char* bytes, size_t size) {
+    unsigned long long key = packKey(id, idLength);
+    int appended = 0;
+    if (key == 0 || size == 0) {
+        return 0;
+    }
+    packRecord record;
+    record.key = key;
+    record.size = size;
+    record.check = fnv1a(bytes, size, 2166136261u);
+    EnterCriticalSection(&(p->lock));
+    if (p->index != NULL && (p->budget == 0 || p->dataEnd + sizeof(packRecord) + size <= p->budget) && ((p->index->count + 1) * 2 <= p->index->capacity || growPackIndex(p))) {
+        DWORD written = 0, writtenBytes = 0;
+        if (WriteFile(p->hData, &record, sizeof(packRecord), &written, NULL) && written == sizeof(packRecord) && WriteFile(p->hData, bytes, size, &writtenBytes, NULL) && writtenBytes == size) {
+            packInsert(p->index, key, p->dataEnd + sizeof(packRecord), size, 0);
+            p->dataEnd += sizeof(packRecord) + size;
+            p->index->committed = p->dataEnd;
+            appended = 1;
+        }
+        else {
+            LARGE_INTEGER end;
+            end.QuadPart = p->dataEnd;                                              // drop what was written partially
+            SetFilePointerEx(p->hData, end, NULL, FILE_BEGIN);
+            SetEndOfFile(p->hData);
+        }
+    }
+    LeaveCriticalSection(&(p->lock));
+    return appended;
+}
 
-                                // Create an HTTP request handle.
-                                if (hConnect) {
-                                    wchar_t wId[25];
-                                    mbstowcs(wId, id, 25);
-                                    _swprintf(path, pathFormat, wId);
-                                    hRequest = WinHttpOpenRequest(hConnect, L"GET", path,
-                                        NULL, WINHTTP_NO_REFERER,
-                                        WINHTTP_DEFAULT_ACCEPT_TYPES,
-                                        WINHTTP_FLAG_SECURE);
-                                }
-                                else {
-                                    if (hSession) {
-                                        WinHttpSetStatusCallback(hSession,
-                                            NULL,
-                                            WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS,
-                                            (DWORD_PTR)NULL);
-                                        WinHttpCloseHandle(hSession);
-                                    }
-                                }
+// whether an entry of size bytes no longer fits the pack's budget, read without the lock, so a hint only
+int packFull(pack* p, size_t size) {
+    return p->budget != 0 && p->dataEnd + sizeof(packRecord) + size > p->budget;
+}
 
-                                // Send a request.
-                                if (hRequest) {
-                                    asyncId* aId = malloc(sizeof(asyncId));
-                                    if (aId != NULL) {
-                                        aId->id = malloc(idLength);
-                                        if (aId->id != NULL) {
-                                            memcpy(aId->id, id, idLength);
-                                            aId->idLength = idLength;
-                                            aId->hRequest = hRequest;
-                                            aId->hConnect = hConnect;
-                                            aId->hSession = hSession;
-                                            aId->buffer = NULL;
-                                            aId->bytesRead = 0;
-                                            LOG(("%s\n", id));
-                                            if (hashmap_sets_left_before_resize(imgPresent) <= 2) {         // <= 1 should suffice but crash was observed in hashmap_get(imgPresent, ...)
-                                                dontWaitForCollector = 0;
-                                                int countRastering;
-                                                do {
-                                                    if (!notquitrequested) {
-                                                        free(aId->id);
-                                                        free(aId);
-                                                        goto LIKE_AIDNULL;
-                                                    }
-                                                    countRastering = 0;
-                                                    for (int j = 0; j < maxThreads; ++j) {
-                                                        countRastering += threadsData[j].rastering;
-                                                    }
-                                                } while (countRastering || !notScheduled || wantsCompletion || !allImagesRequestedPresent);
-                                                hashmap_set(imgRequested, (void*)(aId->id), aId->idLength, (uintptr_t)aId);
-                                                hashmap_set(imgPresent, (void*)(aId->id), aId->idLength, (uintptr_t)NULL);
-                                                dontWaitForCollector = 1;
-                                            }
-                                            else {
-                                                hashmap_set(imgRequested, (void*)(aId->id), aId->idLength, (uintptr_t)aId);
-                                                hashmap_set(imgPresent, (void*)(aId->id), aId->idLength, (uintptr_t)NULL);          // preset memory for it be already present during async callbacks
-                                            }
-                                            allImagesRequestedPresent = 0;
-                                            if (!WinHttpSendRequest(hRequest,
-                                                WINHTTP_NO_ADDITIONAL_HEADERS, 0,
-                                                WINHTTP_NO_REQUEST_DATA, 0,
-                                                0, (DWORD_PTR)aId)) {
-                                                hashmap_set(imgRequested, (void*)(aId->id), aId->idLength, (uintptr_t)0);
-                                                queueFillLevel counts;
-                                                counts.count = 0;
-                                                hashmap_iterate(imgRequested, measurePresence, (void*)&counts);
-                                                if (counts.count == 0) {
-                                                    allImagesRequestedPresent = 1;
-                                                }
-                                                free(aId);
-                                                goto LIKE_AIDNULL;
-                                            }
-                                        }
-                                        else {
-                                            free(aId);
-                                            goto LIKE_AIDNULL;
-                                        }
-                                    }
-                                    else {
-LIKE_AIDNULL: ;
-                                        WinHttpSetStatusCallback(hSession,
-                                            NULL,
-                                            WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS,
-                                            (DWORD_PTR)NULL);
-                                        WinHttpCloseHandle(hRequest);
-                                        WinHttpCloseHandle(hConnect);
-                                        WinHttpCloseHandle(hSession);
-                                        if (!notquitrequested) {
-                                            return 0;
-                                        }
-                                    }
-                                }
-                                else {
-                                    if (hConnect) WinHttpCloseHandle(hConnect);
-                                    if (hSession) {
-                                        WinHttpSetStatusCallback(hSession,
-                                            NULL,
-                                            WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS,
-                                            (DWORD_PTR)NULL);
-                                        WinHttpCloseHandle(hSession);
-                                    }
-                                }
-                            }
-AFTER_IMG_REQUEST: ;
-                            dId->idLength = 0;
-                        }
-                        dId = dId->next;
-                    } while (dId != NULL);
+// decoded tier: map parts read often from jpegPack are kept decoded, LZO-compressed, as decompressing is several times faster than decoding
+
+const unsigned int promoteAfterHits = 3;        // reads from jpegPack before a map part is kept decoded
+const unsigned long long decodedTierBudget = 1ULL << 30;
+int decodedTierUsable;
+
+// shrinks decoded pixels of rasterTileSize by 2^scale in both dimensions averaging boxes
+void downsampleTile(unsigned char* from, unsigned char* to, int scale) {
+    int size = rasterTileSize >> scale;
+    int box = 1 << scale;
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                unsigned int sum = 0;
+                for (int by = 0; by < box; ++by) {
+                    unsigned char* row = from + ((y * box + by) * rasterTileSize + x * box) * 3 + c;
+                    for (int bx = 0; bx < box; ++bx) {
+                        sum += row[bx * 3];
+                    }
                 }
+                to[(y * size + x) * 3 + c] = (unsigned char)(sum >> (2 * scale));
             }
-            collecting = 0;
-            if (doCollecting && (!rastered || !notScheduled)) {
-                processPossibleAdditions = 1;
-            }
-            else {
-                break;
-            }
-        } while (true);
-    } while (doCollecting && processPossibleAdditions--);
-    checkingImageRequests = 0;
-    return 0;
+        }
+    }
 }
 
+_Atomic int frame = 1;                          // counts scheduled frames
+
+const int tilesPerChunk = 64;                   // decoded map parts are stored in chunks of preallocated, reused slots
+const int maxTileScale = 3;                     // map parts shown minified are decoded at 1/2, 1/4 or 1/8 of their size
+
+typedef struct TileHeader {
+    unsigned char* next;                        // free slots are linked through it
+    unsigned char* chunk;                       // holding the slot
+    int scale;                                  // decoded at 1 / 2^scale of rasterTileSize
+    _Atomic int noted;                          // frame in which a rasterizer last noted it for a possible upgrade
+    _Atomic int used;                           // frame in which it was last read or decoded
+    int clocked;                                // frame in which the eviction hand last passed it
+    int resident;                               // presented in imgPresent under key
+    char* key;                                  // key of imgPresent and imgRequested
+    int keyLength;
+    unsigned char* source;                      // compressed bytes it was decoded from, kept for the cold tier
+    int sourceSize;
+    int sourceMapped;                           // source is a slice of a packed cache
+    int sourceDecoded;                          // source is LZO-compressed pixels
+} tileHeader;
+
+#define TILE_HEADER 128                         // bytes in front of the pixels of a slot holding its tileHeader, a multiple of 64
+_Static_assert(sizeof(tileHeader) <= TILE_HEADER, "tileHeader overlaps the pixels of its slot");
+
+tileHeader* headerOf(unsigned char* pixels) {
+    return (tileHeader*)(pixels - TILE_HEADER);
+}
 
-_Atomic int queued;
-
-typedef enum MovementDirection {
-    ZIN, ZOUT, SIDE, INIT, REFRESH
-} movementDirection;
-
-movementDirection dir;
-
-void* buffer;
-void* region;
-int pitch;
+CRITICAL_SECTION tileStorageLock;
+unsigned char* tileChunks = NULL;               // linked through their first bytes followed by their scale and their slots taken, slots start at an offset of 64 bytes, each TILE_HEADER bytes ahead of its pixels
+int tileChunkCount = 0;
+long long tileBytesInUse = 0;                   // of slots taken, including the header
+int tilesInUse = 0;                             // slots taken
+long long tileMemoryBudget = 1024LL << 20;      // beyond, map parts not read lately are evicted
+unsigned char* freeTiles[4];                    // per scale
+int freeTileCount[4];
+unsigned char* retiredTiles = NULL;             // replaced ones possibly still read by rasterizers of the current frame
+
+unsigned char* allocateTile(int scale) {
+    int size = rasterTileSize >> scale;
+    int slotSize = TILE_HEADER + size * size * 3;
+    EnterCriticalSection(&tileStorageLock);
+    if (freeTiles[scale] == NULL) {
+        unsigned char* chunk = malloc(64 + tilesPerChunk * slotSize);
+        if (chunk != NULL) {
+            noteAllocated(MEMORY_MAP_PARTS, 64 + tilesPerChunk * slotSize);
+            *((unsigned char**)chunk) = tileChunks;
+            *((int*)(chunk + sizeof(unsigned char*))) = scale;
+            *((int*)(chunk + sizeof(unsigned char*) + sizeof(int))) = 0;
+            tileChunks = chunk;
+            ++tileChunkCount;
+            for (int i = tilesPerChunk - 1; i >= 0; --i) {
+                unsigned char* tile = chunk + 64 + i * slotSize + TILE_HEADER;
+                memset(headerOf(tile), 0, TILE_HEADER);                                     // eviction passes free slots too
+                headerOf(tile)->next = freeTiles[scale];
+                headerOf(tile)->chunk = chunk;
+                headerOf(tile)->scale = scale;
+                freeTiles[scale] = tile;
+            }
+            freeTileCount[scale] += tilesPerChunk;
+        }
+    }
+    unsigned char* tile = freeTiles[scale];
+    if (tile != NULL) {
+        freeTiles[scale] = headerOf(tile)->next;
+        --freeTileCount[scale];
+        ++*((int*)(headerOf(tile)->chunk + sizeof(unsigned char*) + sizeof(int)));
+        headerOf(tile)->noted = 0;
+        headerOf(tile)->clocked = 0;
+        headerOf(tile)->resident = 0;
+        tileBytesInUse += slotSize;
+        ++tilesInUse;
+    }
+    LeaveCriticalSection(&tileStorageLock);
+    return tile;
+}
 
-unsigned char* elevationData;
-int elevationDataAvailable = 0;
+unsigned char* clockChunk = NULL;               // the eviction hand
+int clockSlot = 0;
+
+// unlinks a chunk whose slots are all free and returns its memory, under tileStorageLock
+void freeTileChunk(unsigned char* chunk) {
+    int scale = *((int*)(chunk + sizeof(unsigned char*)));
+    int slotSize = TILE_HEADER + (rasterTileSize >> scale) * (rasterTileSize >> scale) * 3;
+    unsigned char** link = &(freeTiles[scale]);
+    while (*link != NULL) {
+        if (headerOf(*link)->chunk == chunk) {
+            *link = headerOf(*link)->next;
+        }
+        else {
+            link = &(headerOf(*link)->next);
+        }
+    }
+    freeTileCount[scale] -= tilesPerChunk;
+    link = &tileChunks;
+    while (*link != chunk) {
+        link = (unsigned char**)*link;
+    }
+    *link = *((unsigned char**)chunk);
+    if (clockChunk == chunk) {
+        clockChunk = *((unsigned char**)chunk);
+        clockSlot = 0;
+    }
+    --tileChunkCount;
+    noteFreed(MEMORY_MAP_PARTS, 64 + tilesPerChunk * slotSize);
+    free(chunk);
+}
 
-typedef struct Pixel {
-    int sourceX, sourceY;
-    int targetX, targetY;
-} pixel;
+void releaseTile(unsigned char* tile) {
+    tileHeader* header = headerOf(tile);
+    int size = rasterTileSize >> header->scale;
+    if (header->source != NULL && !header->sourceMapped) {
+        free(header->source);
+    }
+    EnterCriticalSection(&tileStorageLock);
+    tileBytesInUse -= TILE_HEADER + size * size * 3 + (header->source != NULL && !header->sourceMapped ? header->sourceSize : 0);
+    --tilesInUse;
+    header->source = NULL;
+    header->resident = 0;
+    header->next = freeTiles[header->scale];
+    freeTiles[header->scale] = tile;
+    ++freeTileCount[header->scale];
+    if (--*((int*)(header->chunk + sizeof(unsigned char*) + sizeof(int))) == 0 && freeTileCount[header->scale] >= 2 * tilesPerChunk) {
+        freeTileChunk(header->chunk);                                                   // another chunk of free slots is left, so no chunk is freed and taken again in turn
+    }
+    LeaveCriticalSection(&tileStorageLock);
+}
 
-void pickPixel(pixel* p, unsigned char* pixels) {
-    memcpy((void*)(((unsigned char*)buffer) + (p->targetY * pitch + p->targetX * 3)), (void*)(pixels + (p->sourceY * rasterTileSize + p->sourceX) * 3), 3);
+// keeps the compressed bytes a slot was decoded from, shrunk to their size
+void keepSource(unsigned char* tile, unsigned char* source, int size, int mapped, int decoded) {
+    tileHeader* header = headerOf(tile);
+    if (!mapped) {
+        unsigned char* shrunk = realloc(source, size);
+        if (shrunk != NULL) {
+            source = shrunk;
+        }
+    }
+    header->source = source;
+    header->sourceSize = size;
+    header->sourceMapped = mapped;
+    header->sourceDecoded = decoded;
+    if (!mapped) {
+        EnterCriticalSection(&tileStorageLock);
+        tileBytesInUse += size;
+        LeaveCriticalSection(&tileStorageLock);
+    }
 }
 
-const double sx = 0.57735;
-const double sy = 0.57735;
-const double sz = -0.57735;
-const unsigned char w = 255;
-const unsigned int r = 0;
-const unsigned int g = 1;
-const unsigned int b = 2;
+void retireTile(unsigned char* tile) {
+    headerOf(tile)->resident = 0;
+    EnterCriticalSection(&tileStorageLock);
+    headerOf(tile)->next = retiredTiles;
+    retiredTiles = tile;
+    LeaveCriticalSection(&tileStorageLock);
+}
 
-const float maxZoomLighting = 2.5F;
+// takes the retired ones, to be released once all rasterizers which could have read them have finished
+unsigned char* takeRetiredTiles() {
+    EnterCriticalSection(&tileStorageLock);
+    unsigned char* tiles = retiredTiles;
+    retiredTiles = NULL;
+    LeaveCriticalSection(&tileStorageLock);
+    return tiles;
+}
 
-/// <summary>
-/// lights a pixel from a predefined light ray
-/// </summary>
-/// <param name="x">x coordinate of the pixel in the window</param>
-/// <param name="y">y coordinate of the pixel in the window</param>
-/// <param name="rgb">array of 3 unsigned char containing the original color, gets overwritten to the lighted color</param>
-void lightPixel(int x, int y, unsigned char* rgb) {
-    ptF angles = atFWithoutOffsets(x, y);
-    double ct = cos(-angles.t);                             // doubles to alleviate banding, does not avail
-    double nx = ct * cos(angles.p + PID);
-    double ny = ct * sin(angles.p + PID);
-    double nz = sin(-angles.t);
-    double sn = 2.0 * (sx * nx + sy * ny + sz * nz);
-    double rx = sx - sn * nx;
-    double ry = sy - sn * ny;
-    double rz = sz - sn * nz;
-    double a = -ry / sqrt(rx * rx + ry * ry + rz * rz);
-    a = a < 0.0 ? 0.0 : a;
-    double f;
-    unsigned char m = max(rgb[r], max(rgb[g], rgb[b]));
-    if (m == rgb[r])
-        f = 0.275;
-    else
-        if (m == rgb[g])
-            f = 0.35;
-        else
-            f = 0.5;
-    double t = f * a * a * (1.0F - zoomF / maxZoomLighting);
-    rgb[r] += (unsigned char)((w - rgb[r]) * t);
-    rgb[g] += (unsigned char)((w - rgb[g]) * t);
-    rgb[b] += (unsigned char)((w - rgb[b]) * t);
+void releaseTiles(unsigned char* tiles) {
+    while (tiles != NULL) {
+        unsigned char* tile = tiles;
+        tiles = headerOf(tile)->next;
+        releaseTile(tile);
+    }
 }
 
-void pickPixelWithLighting(pixel* p, unsigned char* pixels) {
-    unsigned char rgb[3];
-    memcpy((void*)rgb, (void*)(pixels + (p->sourceY * rasterTileSize + p->sourceX) * 3), 3);
-    lightPixel(p->targetX, p->targetY, rgb);
-    memcpy((void*)(((unsigned char*)buffer) + (p->targetY * pitch + p->targetX * 3)), (void*)rgb, 3);
+void freeTileStorage() {
+    while (tileChunks != NULL) {
+        unsigned char* chunk = tileChunks;
+        tileChunks = *((unsigned char**)chunk);
+        int size = rasterTileSize >> *((int*)(chunk + sizeof(unsigned char*)));
+        for (int i = 0; i < tilesPerChunk; ++i) {
+            tileHeader* header = headerOf(chunk + 64 + i * (TILE_HEADER + size * size * 3) + TILE_HEADER);
+            if (header->source != NULL && !header->sourceMapped) {
+                free(header->source);
+            }
+        }
+        noteFreed(MEMORY_MAP_PARTS, 64 + tilesPerChunk * (TILE_HEADER + size * size * 3));
+        free(chunk);
+    }
+    tileChunkCount = 0;
+    tileBytesInUse = 0;
+    for (int scale = 0; scale <= maxTileScale; ++scale) {
+        freeTiles[scale] = NULL;
+        freeTileCount[scale] = 0;
+    }
+    clockChunk = NULL;
+    retiredTiles = NULL;
 }
 
-typedef struct Link {
-    pixel* p;
-    struct Link* l;
-} link;
+// write-behind: downloaded and promoted map parts are appended to the packs in batches by the writer, away from downloads and decoding
 
-void pickPixels(void* key, size_t ksize, uintptr_t value, void* usr) {
-    unsigned char* pixels;
-    hashmap_get(imgPresent, key, ksize, (uintptr_t*)&pixels);
-    if (pixels != NULL) {
-        link* l = (link*)value;
-        do {
-            pickPixel(l->p, pixels);
-            free(l->p);
-            link* currentLink = l;
-            l = l->l;
-            free(currentLink);
-        } while (l != NULL);
+typedef struct WriteJob {
+    pack* pack;
+    char id[25];
+    int idLength;
+    unsigned char* bytes;
+    size_t size;
+    int written;
+    unsigned long long offset;                  // of the bytes in the data file once written
+    struct WriteJob* next;
+} writeJob;
+
+const int writeBatchSize = 32;                  // written at once, or what is queued after writeBatchDelay
+const DWORD writeBatchDelay = 250;
+const long long maxPendingWriteBytes = 32LL << 20;     // the queue's memory pressure, not the decoded map parts', which stay at their budget
+
+CRITICAL_SECTION writeLock;
+CONDITION_VARIABLE writesAvailable;
+writeJob* writeQueue = NULL;
+writeJob* writeQueueLast = NULL;
+int writesQueued = 0;
+long long pendingWriteBytes = 0;
+long long writesDropped = 0;
+_Atomic int writerStop = 0;
+
+// queues a copy of an entry for appending, dropped while the queue is full as it can be downloaded again
+void queueWrite(pack* p, char* id, int idLength, unsigned char* bytes, size_t size) {
+    if (p->index == NULL || idLength > 24) {
+        return;
+    }
+    EnterCriticalSection(&writeLock);
+    int drop = pendingWriteBytes + (long long)size > maxPendingWriteBytes;
+    if (drop) {
+        ++writesDropped;
     }
     else {
-        link* l = (link*)value;
-        do {
-            free(l->p);
-            link* currentLink = l;
-            l = l->l;
-            free(currentLink);
-        } while (l != NULL);
+        pendingWriteBytes += size;
+    }
+    LeaveCriticalSection(&writeLock);
+    writeJob* job = drop ? NULL : malloc(sizeof(writeJob));
+    if (job != NULL) {
+        job->bytes = malloc(size);
+        if (job->bytes != NULL) {
+            memcpy(job->bytes, bytes, size);
+            memcpy(job->id, id, idLength);
+            job->idLength = idLength;
+            job->pack = p;
+            job->size = size;
+            job->written = 0;
+            job->next = NULL;
+            EnterCriticalSection(&writeLock);
+            if (writeQueueLast != NULL) {
+                writeQueueLast->next = job;
+            }
+            else {
+                writeQueue = job;
+            }
+            writeQueueLast = job;
+            int queued = ++writesQueued;
+            LeaveCriticalSection(&writeLock);
+            if (queued == 1 || queued == writeBatchSize) {
+                WakeConditionVariable(&writesAvailable);
+            }
+            return;
+        }
+        free(job);
+    }
+    if (!drop) {
+        EnterCriticalSection(&writeLock);
+        pendingWriteBytes -= size;
+        LeaveCriticalSection(&writeLock);
     }
-    free((char*)key);
 }
 
-void pickPixelsWithLighting(void* key, size_t ksize, uintptr_t value, void* usr) {
-    unsigned char* pixels;
-    hashmap_get(imgPresent, key, ksize, (uintptr_t*)&pixels);
-    if (pixels != NULL) {
-        link* l = (link*)value;
-        do {
-            pickPixelWithLighting(l->p, pixels);
-            free(l->p);
-            link* currentLink = l;
-            l = l->l;
-            free(currentLink);
-        } while (l != NULL);
+// appends the batch's entries of a pack to its data file, makes them durable with one flush, and only then indexes them
+void packAppendBatch(pack* p, writeJob* jobs) {
+    EnterCriticalSection(&(p->lock));
+    if (p->index == NULL) {
+        LeaveCriticalSection(&(p->lock));
+        return;
     }
-    else {
-        link* l = (link*)value;
-        do {
-            free(l->p);
-            link* currentLink = l;
-            l = l->l;
-            free(currentLink);
-        } while (l != NULL);
+    unsigned long long end = p->dataEnd;
+    int toIndex = 0;
+    for (writeJob* job = jobs; job != NULL; job = job->next) {
+        if (job->pack != p) {
+            continue;
+        }
+        packRecord record;
+        record.key = packKey(job->id, job->idLength);
+        record.size = job->size;
+        if (record.key == 0 || (p->budget != 0 && end + sizeof(packRecord) + job->size > p->budget)) {
+            continue;
+        }
+        record.check = fnv1a(job->bytes, job->size, 2166136261u);
+        DWORD written = 0, writtenBytes = 0;
+        if (!WriteFile(p->hData, &record, sizeof(packRecord), &written, NULL) || written != sizeof(packRecord) || !WriteFile(p->hData, job->bytes, job->size, &writtenBytes, NULL) || writtenBytes != job->size) {
+            LARGE_INTEGER position;
+            position.QuadPart = end;                                                // drop what was written partially
+            SetFilePointerEx(p->hData, position, NULL, FILE_BEGIN);
+            SetEndOfFile(p->hData);
+            break;
+        }
+        job->written = 1;
+        job->offset = end + sizeof(packRecord);
+        end += sizeof(packRecord) + job->size;
+        ++toIndex;
     }
-    free((char*)key);
+    if (toIndex > 0) {
+        FlushFileBuffers(p->hData);
+        for (writeJob* job = jobs; job != NULL; job = job->next) {
+            if (job->pack != p || !job->written) {
+                continue;
+            }
+            if ((p->index->count + 1) * 2 > p->index->capacity && !growPackIndex(p)) {
+                break;                                                              // the rest is reindexed at the next start, committed stays in front of it
+            }
+            packInsert(p->index, packKey(job->id, job->idLength), job->offset, job->size, 0);
+            p->index->committed = job->offset + job->size;
+        }
+        p->dataEnd = end;
+        if (p->index != NULL) {
+            FlushViewOfFile(p->index, 0);
+            FlushFileBuffers(p->hIndex);
+        }
+    }
+    LeaveCriticalSection(&(p->lock));
 }
 
-void clearQueue(void* key, size_t ksize, uintptr_t value, void* usr) {
-    link* l = (link*)value;
-    do {
-        free(l->p);
-        link* currentLink = l;
-        l = l->l;
-        free(currentLink);
-    } while (l != NULL);
-    free((char*)key);
+// batches queued writes until writeBatchSize are queued or writeBatchDelay passed, drains the queue when stopping
+unsigned __stdcall writer(void* data) {
+    while (true) {
+        EnterCriticalSection(&writeLock);
+        while (writeQueue == NULL && !writerStop) {
+            SleepConditionVariableCS(&writesAvailable, &writeLock, INFINITE);
+        }
+        if (writeQueue == NULL) {
+            LeaveCriticalSection(&writeLock);
+            break;
+        }
+        if (writesQueued < writeBatchSize && !writerStop) {
+            SleepConditionVariableCS(&writesAvailable, &writeLock, writeBatchDelay);
+        }
+        writeJob* batch = writeQueue;
+        writeQueue = writeQueueLast = NULL;
+        writesQueued = 0;
+        LeaveCriticalSection(&writeLock);
+        packAppendBatch(&jpegPack, batch);
+        packAppendBatch(&decodedPack, batch);
+        long long batchBytes = 0;
+        while (batch != NULL) {
+            writeJob* job = batch;
+            batch = job->next;
+            batchBytes += job->size;
+            free(job->bytes);
+            free(job);
+        }
+        EnterCriticalSection(&writeLock);
+        pendingWriteBytes -= batchBytes;
+        LeaveCriticalSection(&writeLock);
+    }
+    return 0;
 }
 
-// t->t from [0, +/- pi/2] to [0, +/- pi/2] is stretched/mapped to t -> 1/2 * ln(tan(t/2 + pi/4)) from [0, +/- pi/2] to [0, +/- 1.75]
-long double stretchWebMercator(long double t) {
-    // approximation for ln(tan(t/2 + pi/4)) used:
-    long double t4 = 4 * t;
-    return .5L * (619.96L * PI * t) / ((PI * PI - 55.3536L + t4 * (t - PI)) * (PI * PI - 55.3536L + t4 * (t + PI)));
+typedef struct JobQueue {
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE available;
+    asyncId* first;
+    asyncId* last;
+} jobQueue;
+
+jobQueue decodeJobs;                            // compressed map parts handed over by downloads and cache reads
+jobQueue readJobs;                              // map parts found in a cache, to be read
+
+void initJobQueue(jobQueue* queue) {
+    InitializeCriticalSection(&(queue->lock));
+    InitializeConditionVariable(&(queue->available));
+    queue->first = queue->last = NULL;
 }
 
-const long double cutoffLatitude = 1.484422229745332366961L;            // for web mercator projection
+void queueJob(jobQueue* queue, asyncId* aId) {
+    aId->next = NULL;
+    EnterCriticalSection(&(queue->lock));
+    if (queue->last != NULL) {
+        queue->last->next = aId;
+    }
+    else {
+        queue->first = aId;
+    }
+    queue->last = aId;
+    LeaveCriticalSection(&(queue->lock));
+    WakeConditionVariable(&(queue->available));
+}
 
-unsigned __stdcall raster(void* data) {
-    threadData* tData = (threadData*)data;
-    int yStart = tData->yStart;
-    int yEnd = tData->yEnd;
-    hashmap* imgQueue = hashmap_create();
-    tData->rastering = 1;
-    rastered = 0;
-    notScheduled = 1;
-    for (int y = yStart; y < yEnd; ++y) {
-        for (int x = 0; x < WIDTH; ++x) {
-            pt angles = at(x, y);
-            if (angles.t != 2.0L) {
-                long double amount = pow(2, zoom);
-                long double xTile = angles.p * amount / PIDouble;
-                angles.t = stretchWebMercator(angles.t);
-                angles.t = fabsl(angles.t) < cutoffLatitude ? angles.t : copysignl(cutoffLatitude, angles.t);
-                long double yTile = (angles.t - -cutoffLatitude - .0001L) * amount / (2.0L * cutoffLatitude);        // - .0001 = prevent exact 1 as result (values in image are [0,1), [ = including, ) = excluding )
-                int tileX = (int)xTile;                                                 // (int) floors towards 0
-                int tileY = (int)yTile;
-                char id[25];                                                            // maximum length of id incl. \0 at maximum zoom of 30
-                int length = sprintf_s(id, 25, idFormat, zoom, tileX, tileY);
-                if (length == 0) {
-                    length = 5;
-                    strcpy(id, "0/0/0");
-                    xTile = angles.p / PIDouble;
-                    if (xTile < 0.0L) {
-                        xTile = 0.0L;
-                    }
-                    else if (xTile >= 1.0L) {
-                        xTile = .9999L;
-                    }
-                    yTile = (angles.t - -cutoffLatitude - .0001L) / (2.0L * cutoffLatitude);
-                    if (yTile < 0.0L) {
-                        yTile = 0.0L;
-                    }
-                    else if (yTile >= 1.0L) {
-                        yTile = .9999L;
-                    }
-                    tileX = 0;
-                    tileY = 0;
-                }
-                int steps = 0;
-                int iXTile;
-                int iYTile;
-                uintptr_t result;
-                switch (dir) {
-                    case REFRESH:
-                    case ZIN:
-                    case ZOUT:
-                    case SIDE: {
-                        int z = zoom;
-                        long double xTileI = xTile;
-                        long double yTileI = yTile;
-                        int tileXI = tileX;
-                        int tileYI = tileY;
-                        char newId[25];
-                        char* key = id;
-                        int newLength = length;
-                        uintptr_t newResult;
-                        while (hashmap_get(imgPresent, (void*)key, newLength, &newResult) && newResult != (uintptr_t)NULL) {
-                            result = newResult;
-                            ++steps;
-                            iXTile = (int)((xTileI - tileXI) * rasterTileSize);
-                            iYTile = (int)((yTileI - tileYI) * rasterTileSize);
-                            break;                                                      // no break intended for ZIN, ZOUT, SIDE = get as detailed zoom as available uninterrupted from here but this costs too much framerate on Ryzen 5800X
-                            long double amount = pow(2, ++z);
-                            xTileI = angles.p * amount / PIDouble;
-                            yTileI = (angles.t - -cutoffLatitude - .0001L) * amount / (2.0L * cutoffLatitude);
-                            tileXI = (int)xTileI;
-                            tileYI = (int)yTileI;
-                            newLength = sprintf_s(newId, 25, idFormat, z, tileXI, tileYI);
-                            if (newLength == 0) {
-                                break;
-                            }
-                            key = newId;
-                        }
-                        break;
-                    }
-                    case INIT:
-                    default:
-                        break;
-                }
-                if (steps > 0)
-                {
-                    pixel p;
-                    p.sourceX = iXTile;
-                    p.sourceY = iYTile;
-                    p.targetX = x;
-                    p.targetY = y;
-                    pickPixel(&p, (unsigned char*)result);
-                    continue;
-                }
-                else {
-                    int iXTile = (int)((xTile - tileX) * rasterTileSize);
-                    int iYTile = (int)((yTile - tileY) * rasterTileSize);
+// waits for the next job, NULL when quitting was requested; jobs left then are freed with imgRequested
+asyncId* takeJob(jobQueue* queue) {
+    EnterCriticalSection(&(queue->lock));
+    while (queue->first == NULL && notquitrequested) {
+        SleepConditionVariableCS(&(queue->available), &(queue->lock), INFINITE);
+    }
+    asyncId* aId = notquitrequested ? queue->first : NULL;
+    if (aId != NULL) {
+        queue->first = aId->next;
+        if (queue->first == NULL) {
+            queue->last = NULL;
+        }
+    }
+    LeaveCriticalSection(&(queue->lock));
+    return aId;
+}
 
-                    int picked = 0;
-                    switch (dir) {
-                        case ZIN:
-                        case SIDE:
-                            if (zoom > 0) {
-                                long double amount = pow(2, zoom - 1);
-                                long double xTile = angles.p * amount / PIDouble;
-                                long double yTile = (angles.t - -cutoffLatitude - .0001L) * amount / (2.0L * cutoffLatitude);
-                                int tileX = (int)xTile;
-                                int tileY = (int)yTile;
-                                char id[25];
-                                int length = sprintf_s(id, 25, idFormat, zoom - 1, tileX, tileY);
-                                if (length == 0) {
-                                    length = 5;
-                                    strcpy(id, "0/0/0");
-                                    xTile = angles.p / PIDouble;
-                                    if (xTile < 0.0L) {
-                                        xTile = 0.0L;
-                                    }
-                                    else if (xTile >= 1.0L) {
-                                        xTile = .9999L;
-                                    }
-                                    yTile = (angles.t - -cutoffLatitude - .0001L) / (2.0L * cutoffLatitude);
-                                    if (yTile < 0.0L) {
-                                        yTile = 0.0L;
-                                    }
-                                    else if (yTile >= 1.0L) {
-                                        yTile = .9999L;
-                                    }
-                                    tileX = 0;
-                                    tileY = 0;
-                                }
-                                uintptr_t result;
-                                if (hashmap_get(imgPresent, (void*)id, length, &result) && result != (uintptr_t)NULL) {
-                                    pixel p;
-                                    p.sourceX = (int)((xTile - tileX) * rasterTileSize);
-                                    p.sourceY = (int)((yTile - tileY) * rasterTileSize);
-                                    p.targetX = x;
-                                    p.targetY = y;
-                                    pickPixel(&p, (unsigned char*)result);
-                                    picked = 1;
-                                }
-                            }
-                            break;
-                        case ZOUT:
-                        case INIT:
-                        case REFRESH:
-                        default:
-                            break;
-                    }
-                    if (!picked) {
-                        memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)zero3, 3);
-                    }
+void wakeJobQueue(jobQueue* queue) {
+    EnterCriticalSection(&(queue->lock));
+    WakeAllConditionVariable(&(queue->available));
+    LeaveCriticalSection(&(queue->lock));
+}
 
-                    if (imgQueue != NULL) {
-                        pixel* p = malloc(sizeof(pixel));
-                        uintptr_t result;
-                        if (hashmap_get(imgQueue, (void*)id, length, &result)) {
-                            if (p != NULL) {
-                                p->sourceX = iXTile;
-                                p->sourceY = iYTile;
-                                p->targetX = x;
-                                p->targetY = y;
-                                link* l = malloc(sizeof(link));
-                                if (l != NULL) {
-                                    l->p = p;
-                                    l->l = (link*)result;
-                                    hashmap_set(imgQueue, (void*)id, length, (uintptr_t)l);
-                                    continue;
-                                }
-                                else {
-                                    free(p);
-                                }
-                            }
+_Atomic int tileSizeKnown = 0;
+_Atomic int tileSizeChanged = 0;
+
+void setTileSize(int size) {
+    rasterTileSize = size;
+    zoomOffset = size == 512 ? 1 : 0;
+    tileSizeKnown = 1;
+}
+
+// adopts the size of the first decoded map part unless configured, returns whether a map part of this size fits
+int checkTileSize(int width, int height) {
+    if (!tileSizeKnown) {
+        EnterCriticalSection(&tileStorageLock);
+        if (!tileSizeKnown && tileChunks == NULL && width == height && (width == 256 || width == 512)) {        // slots are sized by rasterTileSize, so only before any exists
+            if (width != rasterTileSize) {
+                setTileSize(width);
+                tileSizeChanged = 1;
+                signalProgress();
+                LOG(("map part size detected: %d\n", width));
+            }
+            tileSizeKnown = 1;
+        }
+        LeaveCriticalSection(&tileStorageLock);
+    }
+    return width == rasterTileSize && height == rasterTileSize;
+}
+
+// decodes queued map parts with a decompressor kept for the lifetime of the thread
+unsigned __stdcall decoder(void* data) {
+    tjhandle tjInstance = tj3Init(TJINIT_DECOMPRESS);
+    const lzo_uint maxTileBytes = 512 * 512 * 3;
+    unsigned char* unpacked = NULL;                                                         // pixels from the decoded tier before they are stored at their scale
+    unsigned char* packed = NULL;                                                           // pixels compressed for the decoded tier
+    unsigned char* lzoWork = NULL;
+    while (true) {
+        asyncId* aId = takeJob(&decodeJobs);
+        if (aId == NULL) {
+            break;
+        }
+        unsigned char* pixels = NULL;
+        if (aId->decoded) {
+            if (unpacked == NULL) {
+                unpacked = malloc(maxTileBytes);
+            }
+            lzo_uint size = maxTileBytes;
+            if (unpacked != NULL && lzo1x_decompress_safe(aId->buffer, aId->bytesRead, unpacked, &size, NULL) == LZO_E_OK) {
+                int width = size == 256 * 256 * 3 ? 256 : size == maxTileBytes ? 512 : 0;
+                if (checkTileSize(width, width)) {
+                    pixels = allocateTile(aId->scale);
+                    if (pixels != NULL) {
+                        if (aId->scale == 0) {
+                            memcpy(pixels, unpacked, size);
                         }
                         else {
-                            if (p != NULL) {
-                                p->sourceX = iXTile;
-                                p->sourceY = iYTile;
-                                p->targetX = x;
-                                p->targetY = y;
-                                link* l = malloc(sizeof(link));
-                                if (l != NULL) {
-                                    l->p = p;
-                                    l->l = NULL;
-                                    char* pId = malloc(length);
-                                    if (pId != NULL) {
-                                        idData* lastRequest = NULL;
-                                        idData* request = &(tData->dId);
-                                        while (request->idLength != 0) {
-                                            if (request->next != NULL) {
-                                                request = request->next;
-                                            }
-                                            else {
-                                                idData* newRequest = malloc(sizeof(idData));
-                                                if (newRequest == NULL) {
-                                                    free(pId);
-                                                    goto LIKE_LNULL;
-                                                }
-                                                newRequest->next = NULL;
-                                                lastRequest = request;
-                                                request = newRequest;
-                                                break;
-                                            }
-                                        }
-                                        memcpy(request->id, id, length + 1);
-                                        request->idLength = length;
-                                        if (lastRequest != NULL) {
-                                            lastRequest->next = request;
-                                        }
-                                        memcpy(pId, id, length);
-                                        hashmap_set(imgQueue, (void*)pId, length, (uintptr_t)l);
-                                        queued = 1;
-                                        tData->imageRequestRequested = 1;
-                                        continue;
-                                    }
-                                    else {
-LIKE_LNULL:
-                                        free(l);
-                                        free(p);
-                                    }
-                                }
-                                else {
-                                    free(p);
-                                }
-                            }
+                            downsampleTile(unpacked, pixels, aId->scale);
+                        }
+                    }
+                }
+            }
+        }
+        else if (tjInstance != NULL && tj3DecompressHeader(tjInstance, aId->buffer, aId->bytesRead) == 0 && checkTileSize(tj3Get(tjInstance, TJPARAM_JPEGWIDTH), tj3Get(tjInstance, TJPARAM_JPEGHEIGHT))) {
+            tjscalingfactor scalingFactor = { 1, 1 << aId->scale };                                         // decompressor state persists, always set
+            pixels = tj3SetScalingFactor(tjInstance, scalingFactor) == 0 ? allocateTile(aId->scale) : NULL;
+            if (pixels != NULL) {
+                if (tj3Decompress8(tjInstance, aId->buffer, aId->bytesRead, pixels, 0, TJPF_RGB) == 0) {
+                    if (aId->promote && aId->scale == 0 && !packFull(&decodedPack, rasterTileSize * rasterTileSize * 3)) {        // full until compacted at the next start
+                        if (packed == NULL) {
+                            packed = malloc(maxTileBytes + maxTileBytes / 16 + 64 + 3);
+                            lzoWork = malloc(LZO1X_1_MEM_COMPRESS);
+                        }
+                        lzo_uint packedSize;
+                        if (packed != NULL && lzoWork != NULL && lzo1x_1_compress(pixels, rasterTileSize * rasterTileSize * 3, packed, &packedSize, lzoWork) == LZO_E_OK) {
+                            queueWrite(&decodedPack, aId->id, aId->idLength, packed, packedSize);
                         }
                     }
                 }
+                else {
+                    releaseTile(pixels);
+                    pixels = NULL;
+                }
+            }
+        }
+        if (pixels != NULL) {
+            tileHeader* header = headerOf(pixels);
+            header->used = frame;
+            header->resident = 1;
+            uintptr_t replaced;
+            if (hashmap_get(imgPresent, aId->id, aId->idLength, &replaced) && replaced != (uintptr_t)NULL) {
+                header->key = headerOf((unsigned char*)replaced)->key;
+                header->keyLength = aId->idLength;
+                hashmap_set(imgPresent, aId->id, aId->idLength, (uintptr_t)pixels);
+                retireTile((unsigned char*)replaced);
             }
             else {
-                memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)zero3, 3);
+                header->key = aId->id;                                                              // the key of both maps
+                header->keyLength = aId->idLength;
+                hashmap_set(imgPresent, aId->id, aId->idLength, (uintptr_t)pixels);                 // key preset by the collector, no resize
             }
+            keepSource(pixels, aId->buffer, aId->bytesRead, aId->mapped, aId->decoded);
         }
+        else if (!aId->mapped) {
+            free(aId->buffer);
+        }
+        markRequestDone(aId->id, aId->idLength);
+        if (aId->upgrade) {
+            free(aId->id);
+        }
+        freeAsyncId(aId);
     }
-    //memcpy(((unsigned char*)region) + yStart * pitch, ((unsigned char*)buffer) + yStart * pitch, pitch * (yEnd - yStart));                            // copy all once in main thread appears to be faster than copy parts parallely from threads
-    if (tData->lastQueue != NULL) {
-        hashmap_iterate(tData->lastQueue, clearQueue, NULL);
-        hashmap_free(tData->lastQueue);
+    free(unpacked);
+    free(packed);
+    free(lzoWork);
+    if (tjInstance != NULL) {
+        tj3Destroy(tjInstance);
     }
-    tData->lastQueue = imgQueue;
-    tData->rastering = 0;
     return 0;
 }
 
-// t->t from [0, +/- pi/2] to [0, +/- pi/2] is stretched/mapped to t -> 1/2 * ln(tan(t/2 + pi/4)) from [0, +/- pi/2] to [0, +/- 1.75]
-double stretchWebMercatorD(double t) {
-    // approximation for ln(tan(t/2 + pi/4)) used:
-    double t4 = 4 * t;
-    return .5 * (619.96 * PID * t) / ((PID * PID - 55.3536 + t4 * (t - PID)) * (PID * PID - 55.3536 + t4 * (t + PID)));
+// responses other than 200 OK, like error pages, are no map parts
+DWORD responseStatus(HINTERNET hRequest) {
+    DWORD status = 0;
+    DWORD statusSize = sizeof(status);
+    return WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &status, &statusSize, WINHTTP_NO_HEADER_INDEX) ? status : 0;
 }
 
-const double cutoffLatitudeD = 1.484422229745332366961;            // for web mercator projection
+int responseOk(HINTERNET hRequest) {
+    return responseStatus(hRequest) == 200;
+}
 
-unsigned __stdcall rasterD(void* data) {
-    threadData* tData = (threadData*)data;
-    int yStart = tData->yStart;
-    int yEnd = tData->yEnd;
-    hashmap* imgQueue = hashmap_create();
-    tData->rastering = 1;
-    rastered = 0;
-    notScheduled = 1;
-    for (int y = yStart; y < yEnd; ++y) {
-        for (int x = 0; x < WIDTH; ++x) {
-            ptD angles = atD(x, y);
-            if (angles.t != 2.0) {
-                double amount = pow(2, zoom);
-                double xTile = angles.p * amount / PIDoubleD;
-                angles.t = stretchWebMercatorD(angles.t);
-                angles.t = fabs(angles.t) < cutoffLatitudeD ? angles.t : copysign(cutoffLatitudeD, angles.t);
-                double yTile = (angles.t - -cutoffLatitudeD - .0001) * amount / (2.0 * cutoffLatitudeD);            // - .0001 = prevent exact 1 as result (values in image are [0,1), [ = including, ) = excluding )
-                int tileX = (int)xTile;                                                 // (int) floors towards 0
-                int tileY = (int)yTile;
-                char id[25];                                                            // maximum length of id incl. \0 at maximum zoom of 30
-                int length = sprintf_s(id, 25, idFormat, zoom, tileX, tileY);
-                if (length == 0) {
-                    length = 5;
-                    strcpy(id, "0/0/0");
-                    xTile = angles.p / PIDoubleD;
-                    if (xTile < 0.0) {
-                        xTile = 0.0;
-                    }
-                    else if (xTile >= 1.0) {
-                        xTile = .9999;
-                    }
-                    yTile = (angles.t - -cutoffLatitudeD - .0001) / (2.0 * cutoffLatitudeD);
-                    if (yTile < 0.0) {
-                        yTile = 0.0;
-                    }
-                    else if (yTile >= 1.0) {
-                        yTile = .9999;
-                    }
-                    tileX = 0;
-                    tileY = 0;
-                }
-                int steps = 0;
-                int iXTile;
-                int iYTile;
-                uintptr_t result;
-                switch (dir) {
-                    case REFRESH:
-                    case ZIN:
-                    case ZOUT:
-                    case SIDE: {
-                        int z = zoom;
-                        double xTileI = xTile;
-                        double yTileI = yTile;
-                        int tileXI = tileX;
-                        int tileYI = tileY;
-                        char newId[25];
-                        char* key = id;
-                        int newLength = length;
-                        uintptr_t newResult;
-                        while (hashmap_get(imgPresent, (void*)key, newLength, &newResult) && newResult != (uintptr_t)NULL) {
-                            result = newResult;
-                            ++steps;
-                            iXTile = (int)((xTileI - tileXI) * rasterTileSize);
-                            iYTile = (int)((yTileI - tileYI) * rasterTileSize);
-                            break;                                                      // no break intended for ZIN, ZOUT, SIDE = get as detailed zoom as available uninterrupted from here but this costs too much framerate on Ryzen 5800X
-                            double amount = pow(2, ++z);
-                            xTileI = angles.p * amount / PIDoubleD;
-                            yTileI = (angles.t - -cutoffLatitudeD - .0001) * amount / (2.0 * cutoffLatitudeD);
-                            tileXI = (int)xTileI;
-                            tileYI = (int)yTileI;
-                            newLength = sprintf_s(newId, 25, idFormat, z, tileXI, tileYI);
-                            if (newLength == 0) {
-                                break;
+// benchmark: downloads of the map parts of a scripted tour of views against a map service, see main
+
+int benchmarking;
+#define BENCHMARK_LATENCIES 65536
+double benchmarkLatencies[BENCHMARK_LATENCIES];     // milliseconds from sending a request to having read its response
+LONG benchmarkFetched;
+LONG benchmarkFailed;
+LONGLONG benchmarkBytes;
+LARGE_INTEGER benchmarkFrequency;
+
+void noteBenchmarkFetch(asyncId* aId, int fetched) {
+    if (!benchmarking) {
+        return;
+    }
+    if (!fetched) {
+        InterlockedIncrement(&benchmarkFailed);
+        return;
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    LONG count = InterlockedIncrement(&benchmarkFetched);
+    InterlockedExchangeAdd64(&benchmarkBytes, aId->bytesRead);
+    if (count <= BENCHMARK_LATENCIES) {
+        benchmarkLatencies[count - 1] = (now.QuadPart - aId->sent) * 1000.0 / benchmarkFrequency.QuadPart;
+    }
+}
+
+// negative cache: map parts the map service did not deliver stay failed, not requested again, until their time to live ends, which
+// doubles with every failure and is long for 404s; a zoom level answered only with 404s is taken as beyond the service's deepest, its
+// map parts are not requested for a while and their ancestors are shown enlarged instead, see levelBand; this is kept per region, as
+// services cover some regions deeper than others
+
+typedef struct FailedTile {
+    char* id;                                   // key of failedTiles
+    int idLength;
+    char* key;                                  // of imgPresent and imgRequested while it stays failed, NULL once released to be requested again
+    ULONGLONG retryAfter;                       // GetTickCount64
+    int failures;
+    int notFound;
+    struct FailedTile* older;                   // by last failure
+    struct FailedTile* newer;
+} failedTile;
+
+#define MAX_FAILED_TILES 4096                   // records kept, beyond the ones released longest ago are forgotten
+
+hashmap* failedTiles;                           // copy of id -> failedTile
+CRITICAL_SECTION failedTilesLock;
+failedTile* failedOldest;
+failedTile* failedNewest;
+int failedCount;
+ULONGLONG nextFailedRetry = (ULONGLONG)-1;      // earliest end of a time to live of a failed map part not released yet
+const ULONGLONG failedRetryDelay = 2000;        // milliseconds after a first failure other than 404
+const ULONGLONG notFoundRetryDelay = 3600000;   // milliseconds after a first 404
+const ULONGLONG maxRetryDelay = 604800000;      // a week
+
+#define MAX_ZOOM_EVIDENCE 8                     // 404s in a region at a zoom level none was delivered at to take the one above as its deepest
+#define SERVICE_REGION_ZOOM 4                   // zoom level of the map parts whose regions the service's deepest zoom level is kept for
+#define SERVICE_REGIONS (1 << (2 * SERVICE_REGION_ZOOM))
+
+typedef struct ServiceRegion {
+    _Atomic int maxZoom;                        // the service's deepest zoom level in it, 30 while not known
+    ULONGLONG maxZoomUntil;                     // probed again then
+    int deepestDelivered;
+    int notFound[31];                           // per zoom level
+} serviceRegion;
+
+serviceRegion serviceRegions[SERVICE_REGIONS];  // under failedTilesLock, maxZoom read without
+_Atomic int serviceLimitedRegions;              // whose deepest zoom level is known
+ULONGLONG nextServiceProbe = (ULONGLONG)-1;     // earliest end of their time to live
+
+void resetServiceRegion(serviceRegion* region) {
+    region->maxZoom = 30;
+    region->maxZoomUntil = (ULONGLONG)-1;
+    region->deepestDelivered = -1;
+    for (int z = 0; z <= 30; ++z) {
+        region->notFound[z] = 0;
+    }
+}
+
+void resetServiceRegions() {
+    for (int r = 0; r < SERVICE_REGIONS; ++r) {
+        resetServiceRegion(&(serviceRegions[r]));
+    }
+    serviceLimitedRegions = 0;
+    nextServiceProbe = (ULONGLONG)-1;
+}
+
+// region of a map part, the one of its first descendant at SERVICE_REGION_ZOOM if coarser
+serviceRegion* serviceRegionOf(int z, int tileX, int tileY) {
+    if (z >= SERVICE_REGION_ZOOM) {
+        tileX >>= z - SERVICE_REGION_ZOOM;
+        tileY >>= z - SERVICE_REGION_ZOOM;
+    }
+    else {
+        tileX <<= SERVICE_REGION_ZOOM - z;
+        tileY <<= SERVICE_REGION_ZOOM - z;
+    }
+    return &(serviceRegions[(tileY << SERVICE_REGION_ZOOM) + tileX]);
+}
+
+// zoom level and map part of an id, see idFormat
+int tileOfId(char* id, int idLength, int* tileX, int* tileY) {
+    int numbers[3] = { 0, 0, 0 };
+    int n = 0;
+    for (int i = 0; i < idLength; ++i) {
+        if (id[i] == '/') {
+            ++n;
+        }
+        else if (n < 3) {
+            numbers[n] = numbers[n] * 10 + (id[i] - '0');
+        }
+    }
+    *tileX = numbers[1];
+    *tileY = numbers[2];
+    return numbers[0];
+}
+
+int serviceMaxZoomAt(int z, int tileX, int tileY) {
+    return serviceRegionOf(z, tileX, tileY)->maxZoom;
+}
+
+// under failedTilesLock, as all of the following
+void unlinkFailedTile(failedTile* failed) {
+    if (failed->older != NULL) {
+        failed->older->newer = failed->newer;
+    }
+    else {
+        failedOldest = failed->newer;
+    }
+    if (failed->newer != NULL) {
+        failed->newer->older = failed->older;
+    }
+    else {
+        failedNewest = failed->older;
+    }
+}
+
+void linkFailedTile(failedTile* failed) {
+    failed->older = failedNewest;
+    failed->newer = NULL;
+    if (failedNewest != NULL) {
+        failedNewest->newer = failed;
+    }
+    else {
+        failedOldest = failed;
+    }
+    failedNewest = failed;
+}
+
+void forgetFailedTile(failedTile* failed) {
+    unlinkFailedTile(failed);
+    hashmap_remove(failedTiles, failed->id, failed->idLength);
+    free(failed->id);
+    free(failed);
+    --failedCount;
+}
+
+// the record of a map part, created if it has none, forgetting released ones beyond MAX_FAILED_TILES, not the ones still failed, which
+// hold their key, nor the ones loaded from missing.txt whose time to live did not end
+failedTile* failedTileOf(char* id, int idLength) {
+    failedTile* failed;
+    if (hashmap_get(failedTiles, id, idLength, (uintptr_t*)&failed)) {
+        return failed;
+    }
+    failed = malloc(sizeof(failedTile));
+    char* copy = malloc(idLength);
+    if (failed == NULL || copy == NULL) {
+        free(failed);
+        free(copy);
+        return NULL;
+    }
+    memcpy(copy, id, idLength);
+    failed->id = copy;
+    failed->idLength = idLength;
+    failed->key = NULL;
+    failed->retryAfter = 0;
+    failed->failures = 0;
+    failed->notFound = 0;
+    hashmap_set(failedTiles, copy, idLength, (uintptr_t)failed);
+    linkFailedTile(failed);
+    ++failedCount;
+    ULONGLONG now = GetTickCount64();
+    failedTile* oldest = failedOldest;
+    for (int steps = 0; failedCount > MAX_FAILED_TILES && oldest != failed && steps < 64; ++steps) {      // bounded past kept ones
+        failedTile* newer = oldest->newer;
+        if (oldest->key == NULL && now >= oldest->retryAfter) {
+            forgetFailedTile(oldest);
+        }
+        oldest = newer;
+    }
+    return failed;
+}
+
+// records a map part requested from the map service as failed until its time to live ends, aId->id being the key of the maps
+void noteTileFailure(asyncId* aId, int notFound) {
+    ULONGLONG now = GetTickCount64();
+    int tileX, tileY;
+    int z = tileOfId(aId->id, aId->idLength, &tileX, &tileY);
+    EnterCriticalSection(&failedTilesLock);
+    failedTile* failed = failedTileOf(aId->id, aId->idLength);
+    if (failed != NULL) {
+        unlinkFailedTile(failed);
+        linkFailedTile(failed);
+        failed->key = aId->id;
+        failed->notFound = notFound;
+        failed->retryAfter = now + min((notFound ? notFoundRetryDelay : failedRetryDelay) << min(failed->failures, 20), maxRetryDelay);
+        ++failed->failures;
+        nextFailedRetry = min(nextFailedRetry, failed->retryAfter);
+    }
+    serviceRegion* region = serviceRegionOf(z, tileX, tileY);
+    if (notFound && z > 0 && z > region->deepestDelivered && ++region->notFound[z] >= MAX_ZOOM_EVIDENCE && z - 1 < region->maxZoom) {
+        if (region->maxZoom == 30) {
+            ++serviceLimitedRegions;
+        }
+        region->maxZoom = z - 1;
+        region->maxZoomUntil = now + notFoundRetryDelay;
+        nextServiceProbe = min(nextServiceProbe, region->maxZoomUntil);
+        LOG(("map service delivers up to zoom level %d around %d/%d/%d\n", z - 1, z, tileX, tileY));
+    }
+    LeaveCriticalSection(&failedTilesLock);
+}
+
+// forgets a map part's failures once it is delivered
+void noteTileDelivered(asyncId* aId) {
+    int tileX, tileY;
+    int z = tileOfId(aId->id, aId->idLength, &tileX, &tileY);
+    EnterCriticalSection(&failedTilesLock);
+    serviceRegion* region = serviceRegionOf(z, tileX, tileY);
+    region->deepestDelivered = max(region->deepestDelivered, z);
+    if (z > region->maxZoom) {
+        region->maxZoom = z;
+    }
+    failedTile* failed;
+    if (hashmap_get(failedTiles, aId->id, aId->idLength, (uintptr_t*)&failed)) {
+        forgetFailedTile(failed);
+    }
+    LeaveCriticalSection(&failedTilesLock);
+}
+
+// whether a map part may be requested from the map service, not while it is failed or beyond the service's deepest zoom level in its region
+int mayDownload(char* id, int idLength) {
+    int tileX, tileY;
+    int z = tileOfId(id, idLength, &tileX, &tileY);
+    if (z > serviceMaxZoomAt(z, tileX, tileY)) {
+        return 0;
+    }
+    EnterCriticalSection(&failedTilesLock);
+    failedTile* failed;
+    int may = !hashmap_get(failedTiles, id, idLength, (uintptr_t*)&failed) || GetTickCount64() >= failed->retryAfter;
+    LeaveCriticalSection(&failedTilesLock);
+    return may;
+}
+
+// whether a map part is known to be missing at the map service, so its ancestors stand in for it
+int tileMissing(char* id, int idLength) {
+    EnterCriticalSection(&failedTilesLock);
+    failedTile* failed;
+    int missing = hashmap_get(failedTiles, id, idLength, (uintptr_t*)&failed) && failed->notFound;
+    LeaveCriticalSection(&failedTilesLock);
+    return missing;
+}
+
+void onImageLoading(HINTERNET hInternet, DWORD_PTR dwContext, DWORD dwInternetStatus, LPVOID lpvStatusInformation, DWORD dwStatusInformationLength) {
+    asyncId* aId = (asyncId*)dwContext;
+    int decode = 0;
+    if (notquitrequested) {
+        if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_READ_COMPLETE) {
+            if (dwStatusInformationLength > 0) {
+                aId->bytesRead += dwStatusInformationLength;
+                int numberBytesToRead = aId->capacity - aId->bytesRead;
+                if (numberBytesToRead > 0) {
+                    WinHttpReadData(aId->hRequest, aId->buffer + aId->bytesRead, numberBytesToRead, NULL);
+                    return;
+                }
+                markRequestDone(aId->id, aId->idLength);
+            }
+            else {
+                decode = 1;                                                                 // the decoder marks it done
+                noteTileDelivered(aId);
+            }
+            noteBenchmarkFetch(aId, 1);
+            queueWrite(&jpegPack, aId->id, aId->idLength, aId->buffer, aId->bytesRead);
+            goto CLOSE_OPEN;
+        }
+        else if (dwInternetStatus == WINHTTP_CALLBACK_FLAG_DATA_AVAILABLE || dwInternetStatus == WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE) {
+            DWORD status = dwInternetStatus == WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE ? responseStatus(aId->hRequest) : 200;
+            if (status != 200) {
+                noteTileFailure(aId, status == 404);
+                markRequestDone(aId->id, aId->idLength);                                    // not cached
+                noteBenchmarkFetch(aId, 0);
+                goto CLOSE_OPEN;
+            }
+            int numberBytesToRead = aId->capacity - aId->bytesRead;
+            if (numberBytesToRead > 0) {
+                WinHttpReadData(aId->hRequest, aId->buffer + aId->bytesRead, numberBytesToRead, NULL);
+            }
+            else {
+                goto CLOSE_OPEN;
+            }
+        }
+        else if (dwInternetStatus == WINHTTP_CALLBACK_FLAG_SENDREQUEST_COMPLETE) {
+            aId->buffer = malloc(aId->capacity);                                            // rasterTileSize may have grown since the request was sent
+            if (aId->buffer != NULL) {
+                WinHttpReceiveResponse(aId->hRequest, NULL);
+            }
+            else {
+                goto CLOSE_OPEN;
+            }
+        }
+        else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_REQUEST_ERROR) {
+            noteTileFailure(aId, 0);
+            markRequestDone(aId->id, aId->idLength);
+            noteBenchmarkFetch(aId, 0);
+            goto CLOSE_OPEN;
+        }
+    }
+    else {
+CLOSE_OPEN:
+        if (aId->prefetch) {
+            InterlockedDecrement(&prefetchesInFlight);
+        }
+        InterlockedDecrement(&downloadsInFlight);
+        WinHttpSetStatusCallback(aId->hSession,
+            NULL,
+            WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS,
+            (DWORD_PTR)NULL);
+        WinHttpCloseHandle(aId->hRequest);
+        WinHttpCloseHandle(aId->hConnect);
+        WinHttpCloseHandle(aId->hSession);
+        if (decode) {
+            aId->hRequest = aId->hConnect = aId->hSession = NULL;
+            aId->prefetch = 0;
+            queueJob(&decodeJobs, aId);
+        }
+        else {
+            if (aId->buffer != NULL) {
+                free(aId->buffer);
+            }
+            freeAsyncId(aId);
+        }
+    }
+}
+
+_Atomic int doCollecting;
+_Atomic int collecting;
+_Atomic int rastered;
+_Atomic int notScheduled;
+_Atomic int wantsCompletion;
+_Atomic int checkingImageRequests;
+_Atomic int dontWaitForCollector;
+
+int maxThreads;
+
+typedef struct IdData {
+    char id[25];                                // max length of id is 24 + \0 (digits for zoom level 30, xy 2^30, 2 /)
+    int idLength;
+    int upgrade;                                // present at a reduced scale, check whether the current view needs more
+    struct IdData* next;
+} idData;
+
+typedef struct ThreadData {
+    int yStart;
+    int yEnd;
+    idData dId;
+    _Atomic int rastering;
+    _Atomic int imageRequestRequested;
+    hashmap* lastQueue;
+    long long lastQueueBytes;                   // estimated, see hashmapBytes
+    HANDLE hThread;
+    HANDLE hComplete;
+} threadData;
+
+threadData* threadsData;
+
+#define PREFETCH_CAPACITY 128
+
+idData prefetchIds[PREFETCH_CAPACITY];          // filled by the main thread while !prefetchPending, consumed by the collector
+int prefetchCount;
+int prefetchNext;
+_Atomic int prefetchPending;
+_Atomic int prefetchSuperseded;                 // a newer prediction waits for the collector to drop the rest of the pending one
+
+wchar_t* host;
+wchar_t* pathFormat;
+wchar_t* path;
+INTERNET_PORT servicePort = INTERNET_DEFAULT_HTTPS_PORT;
+DWORD requestFlags = WINHTTP_FLAG_SECURE;       // 0 for a service url given with http://
+
+char* cachePathCollector;
+char* idStartInCachePath;
+
+
+// the view as the collector sees it, the main thread publishes it per frame and the collector copies it per round
+typedef struct ViewSnapshot {
+    double phiLeft;
+    double axisTilt;
+    double rScale;
+    int centerX;
+    int centerY;
+} viewSnapshot;
+
+viewSnapshot volatile publishedView;
+LONG volatile publishedViewSequence;            // odd while the main thread writes publishedView
+viewSnapshot collectorView;                     // collector only
+
+void publishView() {
+    InterlockedIncrement(&publishedViewSequence);
+    publishedView.phiLeft = phiLeft;
+    publishedView.axisTilt = axisTilt;
+    publishedView.rScale = rScale;
+    publishedView.centerX = centerX;
+    publishedView.centerY = centerY;
+    InterlockedIncrement(&publishedViewSequence);
+}
+
+void takeView() {
+    while (true) {
+        LONG sequence = publishedViewSequence;
+        if ((sequence & 1) == 0) {
+            viewSnapshot view = publishedView;
+            if (InterlockedCompareExchange(&publishedViewSequence, sequence, sequence) == sequence) {
+                collectorView = view;
+                return;
+            }
+        }
+        Sleep(0);                                                                       // the main thread is amid publishing
+    }
+}
+
+// orthographic projection of a point on the globe into the window as the collector sees it, returns 0 when it is on the far side
+int toScreen(double p, double t, double* x, double* y) {
+    double pC = p - collectorView.phiLeft;
+    double xC = -collectorView.rScale * cos(t) * cos(pC);
+    double ySpace = collectorView.rScale * sin(t);
+    double zSpace = collectorView.rScale * cos(t) * sin(pC);
+    double cT = cos(collectorView.axisTilt);
+    double sT = sin(collectorView.axisTilt);
+    *x = collectorView.centerX + xC;
+    *y = collectorView.centerY + ySpace * cT + zSpace * sT;
+    return zSpace * cT - ySpace * sT >= 0.0;
+}
+
+// largest scale at which a map part still has at least one texel per window pixel in the current view
+int footprintScale(char* id) {
+    int z, tileX, tileY;
+    if (sscanf(id, idFormat, &z, &tileX, &tileY) != 3 || z < 3) {
+        return 0;                                                                       // map parts this large are not approximated well by their projected grid
+    }
+    double amount = pow(2, z);
+    double x[3][3], y[3][3];
+    int visible[3][3];
+    for (int j = 0; j < 3; ++j) {
+        double s = -cutoffLatitude + (tileY + j * .5) * 2.0 * cutoffLatitude / amount;
+        double t = atan(sinh(s * PID / cutoffLatitude));                                // inverse of stretchWebMercator
+        for (int i = 0; i < 3; ++i) {
+            visible[j][i] = toScreen((tileX + i * .5) * PIDoubleD / amount, t, &(x[j][i]), &(y[j][i]));
+        }
+    }
+    double extent = 0.0;
+    for (int j = 0; j < 3; ++j) {
+        for (int i = 0; i < 3; ++i) {
+            if (visible[j][i]) {
+                if (i < 2 && visible[j][i + 1]) {
+                    extent = fmax(extent, 2.0 * hypot(x[j][i + 1] - x[j][i], y[j][i + 1] - y[j][i]));
+                }
+                if (j < 2 && visible[j + 1][i]) {
+                    extent = fmax(extent, 2.0 * hypot(x[j + 1][i] - x[j][i], y[j + 1][i] - y[j][i]));
+                }
+            }
+        }
+    }
+    if (extent == 0.0) {
+        return 0;                                                                       // hardly visible, no reliable footprint
+    }
+    int scale = 0;
+    while (scale < maxTileScale && (rasterTileSize >> (scale + 1)) >= extent) {
+        ++scale;
+    }
+    return scale;
+}
+
+// cold tier: evicted map parts kept compressed in memory, as they were decoded from, so they come back without disk or network
+
+typedef struct ColdTile {
+    char* id;                                   // key of coldTiles
+    int idLength;
+    unsigned char* bytes;
+    int size;
+    int mapped;                                 // bytes are a slice of a packed cache
+    int decoded;                                // bytes are LZO-compressed pixels
+    struct ColdTile* older;
+    struct ColdTile* newer;
+} coldTile;
+
+typedef struct ColdTierStats {
+    int residents;
+    long long bytes;                            // malloced ones only, slices of packed caches cost nothing
+    long long evictions;                        // of decoded map parts
+    long long kept;                             // of evicted ones
+    long long promotions;
+    long long dropped;                          // to fit its budget
+} coldTierStats;
+
+hashmap* coldTiles;                             // collector only
+coldTile* coldOldest = NULL;
+coldTile* coldNewest = NULL;
+coldTierStats coldStats;
+
+void unlinkColdTile(coldTile* cold) {
+    if (cold->older != NULL) {
+        cold->older->newer = cold->newer;
+    }
+    else {
+        coldOldest = cold->newer;
+    }
+    if (cold->newer != NULL) {
+        cold->newer->older = cold->older;
+    }
+    else {
+        coldNewest = cold->older;
+    }
+    hashmap_remove(coldTiles, cold->id, cold->idLength);
+    --coldStats.residents;
+    if (!cold->mapped) {
+        coldStats.bytes -= cold->size;
+    }
+}
+
+void freeColdTile(coldTile* cold) {
+    if (!cold->mapped) {
+        free(cold->bytes);
+    }
+    free(cold->id);
+    free(cold);
+}
+
+// takes over the key and the source of an evicted slot, drops the oldest beyond a quarter of the memory budget
+void keepColdTile(tileHeader* header) {
+    coldTile* cold = header->source != NULL ? malloc(sizeof(coldTile)) : NULL;
+    if (cold == NULL) {
+        free(header->key);
+        return;
+    }
+    cold->id = header->key;
+    cold->idLength = header->keyLength;
+    cold->bytes = header->source;
+    cold->size = header->sourceSize;
+    cold->mapped = header->sourceMapped;
+    cold->decoded = header->sourceDecoded;
+    if (!cold->mapped) {
+        EnterCriticalSection(&tileStorageLock);
+        tileBytesInUse -= cold->size;
+        LeaveCriticalSection(&tileStorageLock);
+        coldStats.bytes += cold->size;
+    }
+    header->source = NULL;
+    cold->older = coldNewest;
+    cold->newer = NULL;
+    if (coldNewest != NULL) {
+        coldNewest->newer = cold;
+    }
+    else {
+        coldOldest = cold;
+    }
+    coldNewest = cold;
+    hashmap_set(coldTiles, cold->id, cold->idLength, (uintptr_t)cold);
+    ++coldStats.residents;
+    ++coldStats.kept;
+    while (coldStats.bytes > tileMemoryBudget / 4 && coldOldest != NULL) {
+        coldTile* oldest = coldOldest;
+        unlinkColdTile(oldest);
+        freeColdTile(oldest);
+        ++coldStats.dropped;
+    }
+}
+
+void freeColdTiles() {
+    while (coldOldest != NULL) {
+        coldTile* oldest = coldOldest;
+        coldOldest = oldest->newer;
+        freeColdTile(oldest);
+    }
+    coldNewest = NULL;
+}
+
+int evictedInFrame = 0;
+
+// CLOCK over all slots: a resident map part read since the hand last passed gets a second chance, the ones read by the current or the previous frame are pinned
+// only while quiescent, see quiescent, as keys are removed from imgPresent and imgRequested
+void evictTiles() {
+    long long target = tileMemoryBudget / 8 * 7;
+    int evicted = 0;
+    EnterCriticalSection(&tileStorageLock);                                         // decoders may free a chunk the hand passes, releasing a slot
+    long long slotsLeft = 2LL * tileChunkCount * tilesPerChunk;
+    while (tileBytesInUse > target && slotsLeft-- > 0) {
+        if (clockChunk == NULL) {
+            clockChunk = tileChunks;
+            clockSlot = 0;
+            if (clockChunk == NULL) {
+                break;
+            }
+        }
+        int size = rasterTileSize >> *((int*)(clockChunk + sizeof(unsigned char*)));
+        unsigned char* tile = clockChunk + 64 + clockSlot * (TILE_HEADER + size * size * 3) + TILE_HEADER;
+        if (++clockSlot == tilesPerChunk) {
+            clockChunk = *((unsigned char**)clockChunk);
+            clockSlot = 0;
+        }
+        tileHeader* header = headerOf(tile);
+        if (!header->resident || frame - header->used <= 1) {
+            continue;
+        }
+        if (header->used > header->clocked) {
+            header->clocked = frame;
+            continue;
+        }
+        hashmap_remove(imgRequested, header->key, header->keyLength);
+        hashmap_remove(imgPresent, header->key, header->keyLength);
+        header->resident = 0;
+        keepColdTile(header);
+        releaseTile(tile);
+        ++evicted;
+    }
+    LeaveCriticalSection(&tileStorageLock);
+    evictedInFrame = frame;                                                         // what is still above the budget is pinned, not retried before the next frame
+    coldStats.evictions += evicted;
+    LOG(("evicted %d map parts, %lld MiB in use; cold tier: %d map parts, %lld MiB, %lld kept, %lld promoted, %lld dropped\n", evicted, tileBytesInUse >> 20, coldStats.residents, coldStats.bytes >> 20, coldStats.kept, coldStats.promotions, coldStats.dropped));
+}
+
+// whether no rasterizer, completion or map part request runs, prefetches included as they set the maps when done, checked while
+// dontWaitForCollector is 0 so no frame is scheduled or completed meanwhile
+int quiescent() {
+    int countRastering = 0;
+    for (int j = 0; j < maxThreads; ++j) {
+        countRastering += threadsData[j].rastering;
+    }
+    return !countRastering && notScheduled && !wantsCompletion && allImagesRequestedPresent && requestsPending == 0;
+}
+
+// waits until quiescent, so keys may be removed and the maps resized, returns 0 when quitting was requested meanwhile
+int waitForQuiescence() {
+    dontWaitForCollector = 0;
+    while (true) {
+        if (!notquitrequested) {
+            return 0;
+        }
+        if (quiescent()) {
+            return 1;
+        }
+        WaitForSingleObject(hCollectorWake, collectorWaitTimeout);
+    }
+}
+
+// whether the time to live of a failed map part or of the map service's deepest zoom level in a region ended
+int failedTilesDue() {
+    ULONGLONG now = GetTickCount64();
+    return now >= nextFailedRetry || now >= nextServiceProbe;
+}
+
+void releaseFailedTile(void* key, size_t ksize, uintptr_t value, void* usr) {
+    failedTile* failed = (failedTile*)value;
+    ULONGLONG now = *((ULONGLONG*)usr);
+    if (failed->key != NULL) {
+        if (now >= failed->retryAfter) {
+            hashmap_remove(imgRequested, failed->key, ksize);
+            hashmap_remove(imgPresent, failed->key, ksize);
+            free(failed->key);
+            failed->key = NULL;
+        }
+        else {
+            nextFailedRetry = min(nextFailedRetry, failed->retryAfter);
+        }
+    }
+}
+
+// releases the failed map parts whose time to live ended to be requested again when shown, only while quiescent, see waitForQuiescence
+void releaseFailedTiles() {
+    ULONGLONG now = GetTickCount64();
+    EnterCriticalSection(&failedTilesLock);
+    if (now >= nextServiceProbe) {
+        nextServiceProbe = (ULONGLONG)-1;
+        for (int r = 0; r < SERVICE_REGIONS; ++r) {
+            serviceRegion* region = &(serviceRegions[r]);
+            if (region->maxZoom < 30 && now >= region->maxZoomUntil) {
+                resetServiceRegion(region);
+                --serviceLimitedRegions;
+            }
+            else if (region->maxZoom < 30) {
+                nextServiceProbe = min(nextServiceProbe, region->maxZoomUntil);
+            }
+        }
+    }
+    nextFailedRetry = (ULONGLONG)-1;
+    hashmap_iterate(failedTiles, releaseFailedTile, (void*)&now);
+    LeaveCriticalSection(&failedTilesLock);
+    signalProgress();
+}
+
+
+// presets imgRequested and imgPresent for a pending map part, returns 0 when quitting was requested meanwhile
+int presetRequest(asyncId* aId) {
+    if (aId->upgrade) {
+        hashmap_set(imgRequested, (void*)(aId->id), aId->idLength, requestValue(aId));     // keys exist, no resize
+        InterlockedIncrement(&requestsPending);
+        allImagesRequestedPresent = 0;
+        return 1;
+    }
+    int overBudget = tileBytesInUse > tileMemoryBudget && evictedInFrame != frame;
+    int resizing = hashmap_sets_left_before_resize(imgPresent) <= 2;               // <= 1 should suffice but crash was observed in hashmap_get(imgPresent, ...)
+    if (resizing || overBudget) {
+        if (!waitForQuiescence()) {
+            return 0;
+        }
+        if (overBudget) {
+            evictTiles();
+        }
+        if (failedTilesDue()) {
+            releaseFailedTiles();
+        }
+        hashmap_set(imgRequested, (void*)(aId->id), aId->idLength, requestValue(aId));
+        hashmap_set(imgPresent, (void*)(aId->id), aId->idLength, (uintptr_t)NULL);
+        dontWaitForCollector = 1;
+        signalProgress();                                                           // a frame may wait to be scheduled or completed
+    }
+    else {
+        hashmap_set(imgRequested, (void*)(aId->id), aId->idLength, requestValue(aId));
+        hashmap_set(imgPresent, (void*)(aId->id), aId->idLength, (uintptr_t)NULL);          // preset memory for it be already present during async callbacks
+    }
+    InterlockedIncrement(&requestsPending);
+    if (!aId->speculative) {
+        allImagesRequestedPresent = 0;
+    }
+    return 1;
+}
+
+// 404s outlive the session in missing.txt in the cache folder of the map service, a line per map part of its id, the end of its time to
+// live in seconds since 1970 and its failures
+
+void saveFailedTile(void* key, size_t ksize, uintptr_t value, void* usr) {
+    failedTile* failed = (failedTile*)value;
+    ULONGLONG now = GetTickCount64();
+    if (failed->notFound && failed->retryAfter > now) {
+        fprintf((FILE*)usr, "%.*s %lld %d\n", (int)ksize, (char*)key, (long long)time(NULL) + (long long)((failed->retryAfter - now) / 1000), failed->failures);
+    }
+}
+
+void saveFailedTiles() {
+    char* filePath = malloc(cachePathLength + 11 + 1);
+    if (filePath == NULL) {
+        return;
+    }
+    sprintf(filePath, "%.*smissing.txt", (int)cachePathLength, cachePath);
+    FILE* file = fopen(filePath, "w");
+    if (file != NULL) {
+        hashmap_iterate(failedTiles, saveFailedTile, (void*)file);
+        fclose(file);
+    }
+    free(filePath);
+}
+
+void loadFailedTiles() {
+    char* filePath = malloc(cachePathLength + 11 + 1);
+    if (filePath == NULL) {
+        return;
+    }
+    sprintf(filePath, "%.*smissing.txt", (int)cachePathLength, cachePath);
+    FILE* file = fopen(filePath, "r");
+    free(filePath);
+    if (file == NULL) {
+        return;
+    }
+    ULONGLONG now = GetTickCount64();
+    long long seconds = (long long)time(NULL);
+    char id[25];
+    long long until;
+    int failures;
+    while (fscanf(file, "%24s %lld %d", id, &until, &failures) == 3) {
+        if (until > seconds) {
+            failedTile* failed = failedTileOf(id, (int)strlen(id));
+            if (failed != NULL) {
+                failed->notFound = 1;
+                failed->failures = failures;
+                failed->retryAfter = now + (ULONGLONG)(until - seconds) * 1000;
+            }
+        }
+    }
+    fclose(file);
+}
+
+void freeFailedTile(void* key, size_t ksize, uintptr_t value, void* usr) {
+    free(((failedTile*)value)->id);                                                 // its key in the maps is freed with imgPresent
+    free((failedTile*)value);
+}
+
+// hands a map part of the cold tier to the decoders, returns 0 if not in it, -1 when quitting was requested meanwhile
+int promoteColdTile(char* id, int idLength, int scale) {
+    uintptr_t result;
+    if (!hashmap_get(coldTiles, id, idLength, &result)) {
+        return 0;
+    }
+    coldTile* cold = (coldTile*)result;
+    asyncId* aId = malloc(sizeof(asyncId));
+    if (aId == NULL) {
+        return 0;
+    }
+    noteAllocated(MEMORY_REQUESTS, sizeof(asyncId));
+    unlinkColdTile(cold);
+    aId->id = cold->id;                                                             // becomes the key of imgPresent and imgRequested
+    aId->idLength = idLength;
+    aId->hRequest = aId->hConnect = aId->hSession = NULL;
+    aId->buffer = cold->bytes;
+    aId->bytesRead = cold->size;
+    aId->capacity = 0;
+    aId->prefetch = 0;
+    aId->speculative = 0;
+    aId->scale = scale;
+    aId->upgrade = 0;
+    aId->mapped = cold->mapped;
+    aId->decoded = cold->decoded;
+    aId->promote = 0;
+    free(cold);
+    ++coldStats.promotions;
+    if (!presetRequest(aId)) {
+        if (!aId->mapped) {
+            free(aId->buffer);
+        }
+        free(aId->id);
+        freeAsyncId(aId);
+        return -1;
+    }
+    LOG(("from cold tier: %s at scale %d\n", id, scale));
+    queueJob(&decodeJobs, aId);
+    return 1;
+}
+
+int legacyCache;                                // cache directory still holds map parts in files of their own
+
+// reads a map part from its own file in the cache directory and moves it into the packed cache, filePath holds the cache directory with room for an id
+unsigned char* readLegacyCache(char* id, int idLength, char* filePath, size_t* size) {
+    char* idStartInFilePath = filePath + cachePathLength;
+    int number = 0;
+    while (number < idLength) {
+        char digit = id[number];
+        if (digit == '/') {
+            digit = '-';
+        }
+        idStartInFilePath[number] = digit;
+        ++number;
+    }
+    idStartInFilePath[number] = '\0';
+    FILE* cacheFile = fopen(filePath, "rb");
+    if (cacheFile == NULL) {
+        return NULL;
+    }
+    unsigned char* cachedImage = malloc(rasterTileSize * rasterTileSize * 3);                                               // using uncompressed size hoping it suffices, checked below
+    if (cachedImage != NULL) {
+        size_t sizeRead = fread(cachedImage, sizeof(unsigned char), rasterTileSize * rasterTileSize * 3, cacheFile);
+        if (sizeRead != 0 && (sizeRead == rasterTileSize * rasterTileSize * 3 || feof(cacheFile))) {
+            fclose(cacheFile);
+            if (packAppend(&jpegPack, id, idLength, cachedImage, sizeRead)) {
+                DeleteFileA(filePath);
+            }
+            *size = sizeRead;
+            return cachedImage;
+        }
+        free(cachedImage);
+    }
+    fclose(cacheFile);
+    return NULL;
+}
+
+// presence of legacy files, a bloom filter built by a scan at startup; until it is done every map part may be one
+// files moved into the packed cache stay set, such a false hit only costs a failed read before the download
+
+unsigned long long* legacyBloom = NULL;
+unsigned long long legacyBloomMask;            // of bit indices
+_Atomic int legacyScanned = 0;
+
+void legacyBloomBits(unsigned long long key, unsigned long long* bits) {
+    unsigned long long h1 = key * 0x9E3779B97F4A7C15ULL;
+    unsigned long long h2 = ((key ^ (key >> 29)) * 0xBF58476D1CE4E5B9ULL) | 1;
+    for (int i = 0; i < 4; ++i) {
+        bits[i] = (h1 + i * h2) >> 7 & legacyBloomMask;
+    }
+}
+
+int legacyMayHave(char* id, int idLength) {
+    if (!legacyCache) {
+        return 0;
+    }
+    if (!legacyScanned) {
+        return 1;
+    }
+    unsigned long long bits[4];
+    legacyBloomBits(packKey(id, idLength), bits);
+    for (int i = 0; i < 4; ++i) {
+        if (!(legacyBloom[bits[i] >> 6] & 1ULL << (bits[i] & 63))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// scans the cache directory for legacy files into the bloom filter and faults the pages of the packed cache indexes in, both off the collector
+unsigned __stdcall presenceScan(void* data) {
+    volatile unsigned char touched = 0;
+    pack* packs[2] = { &jpegPack, &decodedPack };
+    for (int i = 0; i < 2; ++i) {
+        unsigned long long offset = 0;
+        int more = 1;
+        while (more && notquitrequested) {
+            EnterCriticalSection(&(packs[i]->lock));                                // in steps, as the writer may remap a growing index meanwhile
+            more = packs[i]->index != NULL;
+            if (more) {
+                unsigned char* page = (unsigned char*)packs[i]->index;
+                unsigned long long size = sizeof(packIndexHeader) + packs[i]->index->capacity * sizeof(packEntry);
+                for (int step = 0; step < 256 && offset < size; ++step, offset += 4096) {
+                    touched += page[offset];
+                }
+                more = offset < size;
+            }
+            LeaveCriticalSection(&(packs[i]->lock));
+        }
+    }
+    if (!legacyCache) {
+        return 0;
+    }
+    char* pattern = malloc(cachePathLength + 5 + 1);
+    size_t capacity = 1 << 16, count = 0;
+    unsigned long long* keys = malloc(capacity * sizeof(unsigned long long));
+    if (pattern == NULL || keys == NULL) {
+        free(pattern);
+        free(keys);
+        return 0;                                                                   // stays not scanned, probing every map part
+    }
+    sprintf(pattern, "%.*s*-*-*", (int)cachePathLength, cachePath);
+    WIN32_FIND_DATAA file;
+    HANDLE hFind = FindFirstFileA(pattern, &file);
+    free(pattern);
+    if (hFind != INVALID_HANDLE_VALUE) {
+        do {
+            char id[25];
+            int length = 0;
+            while (file.cFileName[length] != '\0' && length < 24) {
+                id[length] = file.cFileName[length] == '-' ? '/' : file.cFileName[length];
+                ++length;
+            }
+            unsigned long long key = file.cFileName[length] == '\0' ? packKey(id, length) : 0;
+            if (key != 0) {
+                if (count == capacity) {
+                    unsigned long long* grown = realloc(keys, 2 * capacity * sizeof(unsigned long long));
+                    if (grown == NULL) {
+                        FindClose(hFind);
+                        free(keys);
+                        return 0;
+                    }
+                    keys = grown;
+                    capacity *= 2;
+                }
+                keys[count++] = key;
+            }
+        } while (notquitrequested && FindNextFileA(hFind, &file));
+        FindClose(hFind);
+    }
+    if (!notquitrequested) {
+        free(keys);
+        return 0;
+    }
+    unsigned long long bitCount = 1 << 16;
+    while (bitCount < 16 * count) {
+        bitCount *= 2;                                                              // 16 bits per file, around 0.2% false hits with 4 bits each
+    }
+    legacyBloom = calloc(bitCount / 64, sizeof(unsigned long long));
+    if (legacyBloom != NULL) {
+        legacyBloomMask = bitCount - 1;
+        for (size_t i = 0; i < count; ++i) {
+            unsigned long long bits[4];
+            legacyBloomBits(keys[i], bits);
+            for (int j = 0; j < 4; ++j) {
+                legacyBloom[bits[j] >> 6] |= 1ULL << (bits[j] & 63);
+            }
+        }
+        if (count == 0) {
+            legacyCache = 0;
+        }
+        legacyScanned = 1;
+        LOG(("legacy cache files: %zu\n", count));
+    }
+    free(keys);
+    return 0;
+}
+
+asyncId* newAsyncId(char* id, int idLength, int prefetch, int scale, int upgrade) {
+    asyncId* aId = malloc(sizeof(asyncId));
+    if (aId != NULL) {
+        aId->id = malloc(idLength);
+        if (aId->id == NULL) {
+            free(aId);
+            return NULL;
+        }
+        noteAllocated(MEMORY_REQUESTS, sizeof(asyncId));
+        memcpy(aId->id, id, idLength);
+        aId->idLength = idLength;
+        aId->hRequest = aId->hConnect = aId->hSession = NULL;
+        aId->buffer = NULL;
+        aId->bytesRead = 0;
+        aId->capacity = 0;
+        aId->prefetch = prefetch;
+        aId->speculative = prefetch;
+        aId->scale = scale;
+        aId->upgrade = upgrade;
+        aId->mapped = 0;
+        aId->decoded = 0;
+        aId->promote = 0;
+        aId->pack = NULL;
+        aId->offset = 0;
+        aId->sent = 0;
+        aId->next = NULL;
+    }
+    return aId;
+}
+
+// keeps a pending map part that may not be requested from the map service as failed, see mayDownload, and marks it done
+void holdFailed(asyncId* aId) {
+    EnterCriticalSection(&failedTilesLock);
+    failedTile* failed = failedTileOf(aId->id, aId->idLength);
+    if (failed != NULL) {
+        failed->key = aId->id;
+        int tileX, tileY;
+        int z = tileOfId(aId->id, aId->idLength, &tileX, &tileY);
+        serviceRegion* region = serviceRegionOf(z, tileX, tileY);
+        if (z > region->maxZoom) {
+            failed->notFound = 1;
+            failed->retryAfter = max(failed->retryAfter, region->maxZoomUntil);
+        }
+        nextFailedRetry = min(nextFailedRetry, failed->retryAfter);
+    }
+    LeaveCriticalSection(&failedTilesLock);
+    markRequestDone(aId->id, aId->idLength);
+    freeAsyncId(aId);                                                               // its id is the key of the maps
+}
+
+// keeps a map part that may not be requested from the map service as failed without requesting it, see holdFailed, returns 0 when
+// quitting was requested meanwhile
+int presetFailed(char* id, int idLength) {
+    asyncId* aId = newAsyncId(id, idLength, 0, 0, 0);
+    if (aId == NULL) {
+        return 1;
+    }
+    if (!presetRequest(aId)) {
+        free(aId->id);
+        freeAsyncId(aId);
+        return 0;
+    }
+    holdFailed(aId);
+    return 1;
+}
+
+// sends the request of a map part registered in imgRequested to the map service, completed by onImageLoading, returns 0 if it could not be sent
+int download(asyncId* aId, wchar_t* requestPath) {
+    HINTERNET  hSession = NULL,
+        hConnect = NULL,
+        hRequest = NULL;
+
+    // Use WinHttpOpen to obtain a session handle.
+    hSession = WinHttpOpen(L"WinHTTP Globe/1.0",
+        WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
+        WINHTTP_NO_PROXY_NAME,
+        WINHTTP_NO_PROXY_BYPASS,
+        WINHTTP_FLAG_ASYNC);
+
+    // Specify an HTTP server.
+    if (hSession) {
+        if (WinHttpSetStatusCallback(hSession, (WINHTTP_STATUS_CALLBACK)onImageLoading, WINHTTP_CALLBACK_FLAG_SENDREQUEST_COMPLETE | WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE | WINHTTP_CALLBACK_FLAG_DATA_AVAILABLE | WINHTTP_CALLBACK_STATUS_READ_COMPLETE | WINHTTP_CALLBACK_STATUS_REQUEST_ERROR, (DWORD_PTR)NULL) == NULL) {
+            hConnect = WinHttpConnect(hSession, host, servicePort, 0);
+        }
+    }
+
+    // Create an HTTP request handle.
+    if (hConnect) {
+        char id[25];
+        wchar_t wId[25];
+        memcpy(id, aId->id, aId->idLength);
+        id[aId->idLength] = '\0';
+        mbstowcs(wId, id, 25);
+        _swprintf(requestPath, pathFormat, wId);
+        hRequest = WinHttpOpenRequest(hConnect, L"GET", requestPath,
+            NULL, WINHTTP_NO_REFERER,
+            WINHTTP_DEFAULT_ACCEPT_TYPES,
+            requestFlags);
+    }
+
+    // Send a request.
+    if (hRequest) {
+        aId->hRequest = hRequest;
+        aId->hConnect = hConnect;
+        aId->hSession = hSession;
+        aId->buffer = NULL;
+        aId->bytesRead = 0;
+        aId->capacity = rasterTileSize * rasterTileSize * 3;                        // using size of uncompressed image hoping it is sufficient (checked above)
+        if (aId->prefetch) {
+            InterlockedIncrement(&prefetchesInFlight);
+        }
+        InterlockedIncrement(&downloadsInFlight);
+        if (benchmarking) {
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&now);
+            aId->sent = now.QuadPart;
+        }
+        if (WinHttpSendRequest(hRequest,
+            WINHTTP_NO_ADDITIONAL_HEADERS, 0,
+            WINHTTP_NO_REQUEST_DATA, 0,
+            0, (DWORD_PTR)aId)) {
+            return 1;
+        }
+        if (aId->prefetch) {
+            InterlockedDecrement(&prefetchesInFlight);
+        }
+        InterlockedDecrement(&downloadsInFlight);
+        aId->hRequest = aId->hConnect = aId->hSession = NULL;
+        WinHttpCloseHandle(hRequest);
+    }
+    if (hConnect) WinHttpCloseHandle(hConnect);
+    if (hSession) {
+        WinHttpSetStatusCallback(hSession,
+            NULL,
+            WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS,
+            (DWORD_PTR)NULL);
+        WinHttpCloseHandle(hSession);
+    }
+    return 0;
+}
+
+typedef struct LoadSources {
+    long long coldTier;                         // promoted from the map parts kept compressed in memory
+    long long decodedCache;
+    long long jpegCache;                        // packed or legacy
+    long long mapService;
+} loadSources;
+
+loadSources loads;                              // of map parts requested, collector only
+
+// issues the loading of one map part from cache or map service, returns 0 when quitting was requested meanwhile
+// an upgrade only reloads a present one from cache when the current view needs it at a smaller scale
+int requestImage(char* id, int idLength, int prefetch, int upgrade) {
+    uintptr_t result;
+    int scale = prefetch ? 0 : footprintScale(id);
+    if (upgrade) {
+        uintptr_t pixels;
+        if (!hashmap_get(imgRequested, (void*)id, idLength, &result) || result != (uintptr_t)0 || !hashmap_get(imgPresent, (void*)id, idLength, &pixels) || pixels == (uintptr_t)NULL || headerOf((unsigned char*)pixels)->scale <= scale) {
+            return 1;
+        }
+    }
+    if (upgrade || !hashmap_get(imgRequested, (void*)id, idLength, &result)) {
+        int promoted = upgrade ? 0 : promoteColdTile(id, idLength, scale);
+        if (promoted != 0) {
+            loads.coldTier += promoted > 0;
+            return promoted > 0;
+        }
+        size_t size = 0;
+        unsigned int hits = 0;
+        pack* source = &decodedPack;
+        unsigned long long offset = decodedTierUsable ? packLookup(&decodedPack, id, idLength, &size, &hits) : 0;    // hits rank it when compacted
+        if (offset == 0) {
+            source = &jpegPack;
+            offset = packLookup(&jpegPack, id, idLength, &size, &hits);
+        }
+        if (offset != 0 || legacyMayHave(id, idLength)) {
+            asyncId* aId = newAsyncId(id, idLength, prefetch, scale, upgrade);
+            if (aId != NULL) {
+                if (offset != 0) {
+                    aId->pack = source;
+                    aId->offset = offset;
+                    aId->bytesRead = size;
+                    aId->decoded = source == &decodedPack;
+                    aId->promote = !aId->decoded && decodedTierUsable && hits >= promoteAfterHits && !packFull(&decodedPack, rasterTileSize * rasterTileSize * 3);
+                }
+                if (!presetRequest(aId)) {
+                    free(aId->id);
+                    freeAsyncId(aId);
+                    return 0;
+                }
+                if (offset != 0 && source == &decodedPack) {
+                    ++loads.decodedCache;
+                }
+                else {
+                    ++loads.jpegCache;
+                }
+                queueJob(&readJobs, aId);                                               // the readers download it when not readable
+                return 1;
+            }
+        }
+        if (upgrade) {
+            return 1;
+        }
+        if (!mayDownload(id, idLength)) {
+            return presetFailed(id, idLength);
+        }
+        asyncId* aId = newAsyncId(id, idLength, prefetch, scale, 0);
+        if (aId != NULL) {
+            LOG(("%s%s\n", prefetch ? "prefetch: " : "", id));
+            if (!presetRequest(aId)) {
+                free(aId->id);
+                freeAsyncId(aId);
+                return 0;
+            }
+            ++loads.mapService;
+            if (!download(aId, path)) {
+                markRequestDone(aId->id, aId->idLength);
+                freeAsyncId(aId);
+            }
+        }
+        if (!notquitrequested) {
+            return 0;
+        }
+    }
+    else if (!prefetch && result != (uintptr_t)0 && !prefetchesClaimed && (result & SPECULATIVE_REQUEST)) {
+        prefetchesClaimed = 1;                                                          // the view needs one a prediction requested, wait for them all
+        allImagesRequestedPresent = 0;
+        if (hashmap_get(imgRequested, (void*)id, idLength, &result) && result == (uintptr_t)0) {
+            markRequestDone(id, idLength);                                              // done meanwhile, its recount may have missed the claim
+        }
+    }
+    return 1;
+}
+
+// reads map parts found in a cache off the collector, with handles of their own so reads proceed in parallel, and hands them to the decoders
+unsigned __stdcall reader(void* data) {
+    HANDLE hJpegData = jpegPack.dataPath != NULL ? CreateFileA(jpegPack.dataPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL) : INVALID_HANDLE_VALUE;
+    HANDLE hDecodedData = decodedTierUsable ? CreateFileA(decodedPack.dataPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL) : INVALID_HANDLE_VALUE;
+    char* filePath = malloc(cachePathLength + 24 + 1);
+    wchar_t* requestPath = malloc((wcslen(pathFormat) - 2 + 24 + 1) * sizeof(wchar_t));
+    if (filePath != NULL) {
+        memcpy(filePath, cachePath, cachePathLength);
+    }
+    while (true) {
+        asyncId* aId = takeJob(&readJobs);
+        if (aId == NULL) {
+            break;
+        }
+        size_t size = aId->bytesRead;
+        int mapped = 0;
+        unsigned char* bytes = NULL;
+        if (aId->pack != NULL) {
+            bytes = packRead(aId->pack, aId->pack == &decodedPack ? hDecodedData : hJpegData, aId->id, aId->idLength, aId->offset, size, &mapped);
+        }
+        else if (filePath != NULL) {
+            bytes = readLegacyCache(aId->id, aId->idLength, filePath, &size);
+        }
+        if (bytes != NULL) {
+            aId->buffer = bytes;
+            aId->bytesRead = size;
+            aId->mapped = mapped;
+            LOG(("from %scache%s: %.*s at scale %d\n", aId->decoded ? "decoded " : "", aId->upgrade ? " again" : "", aId->idLength, aId->id, aId->scale));
+            queueJob(&decodeJobs, aId);
+            continue;
+        }
+        aId->decoded = 0;
+        aId->promote = 0;
+        if (!aId->upgrade && requestPath != NULL) {
+            if (!mayDownload(aId->id, aId->idLength)) {                               // not cached after all, as the legacy files may be
+                holdFailed(aId);
+                continue;
+            }
+            LOG(("%.*s\n", aId->idLength, aId->id));
+            if (download(aId, requestPath)) {
+                continue;
+            }
+        }
+        markRequestDone(aId->id, aId->idLength);
+        if (aId->upgrade) {
+            free(aId->id);
+        }
+        freeAsyncId(aId);
+    }
+    if (hJpegData != INVALID_HANDLE_VALUE) {
+        CloseHandle(hJpegData);
+    }
+    if (hDecodedData != INVALID_HANDLE_VALUE) {
+        CloseHandle(hDecodedData);
+    }
+    free(filePath);
+    free(requestPath);
+    return 0;
+}
+
+unsigned __stdcall collector(void* data) {
+    int processPossibleAdditions = 1;
+    do {
+        do {
+            collecting = 1;
+            takeView();
+            if (failedTilesDue()) {                                                                     // released without waiting when quiescent anyway, else at presetRequest's next wait
+                dontWaitForCollector = 0;
+                if (quiescent()) {
+                    releaseFailedTiles();
+                }
+                dontWaitForCollector = 1;
+                signalProgress();
+            }
+            int requestsFound = 0;
+            for (int i = 0; i < maxThreads; ++i) {
+                if (threadsData[i].imageRequestRequested) {
+                    threadsData[i].imageRequestRequested = 0;
+                    requestsFound = 1;
+                    idData* dId = &(threadsData[i].dId);
+                    do {
+                        int idLength = dId->idLength;
+                        if (idLength > 0) {
+                            if (!requestImage(dId->id, idLength, 0, dId->upgrade)) {
+                                return 0;
                             }
-                            key = newId;
+                            dId->idLength = 0;
                         }
-                        break;
+                        dId = dId->next;
+                    } while (dId != NULL);
+                }
+            }
+            if (prefetchPending && prefetchSuperseded) {
+                prefetchNext = prefetchCount;                                                           // the rest of this prediction is outdated
+            }
+            if (!requestsFound && prefetchPending && allImagesRequestedPresent) {                       // idle priority: only when everything the current view asked for is present
+                while (prefetchNext < prefetchCount && prefetchesInFlight < maxPrefetchesInFlight) {
+                    idData* dId = &(prefetchIds[prefetchNext++]);
+                    if (!requestImage(dId->id, dId->idLength, 1, 0)) {
+                        return 0;
                     }
-                    case INIT:
-                    default:
-                        break;
                 }
-                if (steps > 0)
-                {
-                    pixel p;
-                    p.sourceX = iXTile;
-                    p.sourceY = iYTile;
-                    p.targetX = x;
-                    p.targetY = y;
-                    pickPixel(&p, (unsigned char*)result);
-                    continue;
+            }
+            if (prefetchPending && prefetchNext == prefetchCount) {                                     // what did not fit into the budget waits for the next round
+                prefetchNext = 0;
+                prefetchSuperseded = 0;
+                prefetchPending = 0;
+            }
+            collecting = 0;
+            if (doCollecting && (!rastered || !notScheduled)) {
+                processPossibleAdditions = 1;
+                if (!requestsFound) {
+                    WaitForSingleObject(hCollectorWake, collectorWaitTimeout);                          // until rasterizers request map parts or finish
+                }
+            }
+            else {
+                break;
+            }
+        } while (true);
+    } while (doCollecting && processPossibleAdditions--);
+    checkingImageRequests = 0;
+    signalProgress();
+    return 0;
+}
+
+
+_Atomic int queued;
+
+typedef enum MovementDirection {
+    ZIN, ZOUT, SIDE, INIT, REFRESH
+} movementDirection;
+
+movementDirection dir;
+
+void* buffer;
+void* region;
+int pitch;
+
+unsigned char* elevationData;
+int elevationDataAvailable = 0;
+
+typedef struct Pixel {
+    int sourceX, sourceY;
+    int targetX, targetY;
+} pixel;
+
+// map parts decoded at a reduced scale are sampled at correspondingly reduced coordinates
+unsigned char* texelAt(unsigned char* pixels, int sourceX, int sourceY) {
+    int scale = headerOf(pixels)->scale;
+    return pixels + ((sourceY >> scale) * (rasterTileSize >> scale) + (sourceX >> scale)) * 3;
+}
+
+void pickPixel(pixel* p, unsigned char* pixels) {
+    memcpy((void*)(((unsigned char*)buffer) + (p->targetY * pitch + p->targetX * 3)), (void*)texelAt(pixels, p->sourceX, p->sourceY), 3);
+}
+
+const double sx = 0.57735;
+const double sy = 0.57735;
+const double sz = -0.57735;
+const unsigned char w = 255;
+const unsigned int r = 0;
+const unsigned int g = 1;
+const unsigned int b = 2;
+
+const float maxZoomLighting = 2.5F;
+
+/// <summary>
+/// lights a pixel from a predefined light ray
+/// </summary>
+/// <param name="x">x coordinate of the pixel in the window</param>
+/// <param name="y">y coordinate of the pixel in the window</param>
+/// <param name="rgb">array of 3 unsigned char containing the original color, gets overwritten to the lighted color</param>
+void lightPixel(int x, int y, unsigned char* rgb) {
+    ptF angles = atFWithoutOffsets(x, y);
+    double ct = cos(-angles.t);                             // doubles to alleviate banding, does not avail
+    double nx = ct * cos(angles.p + PID);
+    double ny = ct * sin(angles.p + PID);
+    double nz = sin(-angles.t);
+    double sn = 2.0 * (sx * nx + sy * ny + sz * nz);
+    double rx = sx - sn * nx;
+    double ry = sy - sn * ny;
+    double rz = sz - sn * nz;
+    double a = -ry / sqrt(rx * rx + ry * ry + rz * rz);
+    a = a < 0.0 ? 0.0 : a;
+    double f;
+    unsigned char m = max(rgb[r], max(rgb[g], rgb[b]));
+    if (m == rgb[r])
+        f = 0.275;
+    else
+        if (m == rgb[g])
+            f = 0.35;
+        else
+            f = 0.5;
+    double t = f * a * a * (1.0F - (zoomF + zoomOffset) / maxZoomLighting);
+    rgb[r] += (unsigned char)((w - rgb[r]) * t);
+    rgb[g] += (unsigned char)((w - rgb[g]) * t);
+    rgb[b] += (unsigned char)((w - rgb[b]) * t);
+}
+
+void pickPixelWithLighting(pixel* p, unsigned char* pixels) {
+    unsigned char rgb[3];
+    memcpy((void*)rgb, (void*)texelAt(pixels, p->sourceX, p->sourceY), 3);
+    lightPixel(p->targetX, p->targetY, rgb);
+    memcpy((void*)(((unsigned char*)buffer) + (p->targetY * pitch + p->targetX * 3)), (void*)rgb, 3);
+}
+
+typedef struct Link {
+    pixel* p;
+    struct Link* l;
+} link;
+
+// accounts the pixels and keys of a map part's queue freed
+void noteQueueFreed(long long pixels, size_t keyBytes) {
+    noteFreed(MEMORY_QUEUED_PIXELS, pixels * (long long)(sizeof(pixel) + sizeof(link)));
+    noteFreed(MEMORY_QUEUE_KEYS, keyBytes);
+}
+
+void pickPixels(void* key, size_t ksize, uintptr_t value, void* usr) {
+    unsigned char* pixels = NULL;                                                   // failed ones may have been released meanwhile
+    long long count = 0;
+    hashmap_get(imgPresent, key, ksize, (uintptr_t*)&pixels);
+    if (pixels != NULL) {
+        link* l = (link*)value;
+        do {
+            pickPixel(l->p, pixels);
+            free(l->p);
+            link* currentLink = l;
+            l = l->l;
+            free(currentLink);
+            ++count;
+        } while (l != NULL);
+    }
+    else {
+        link* l = (link*)value;
+        do {
+            free(l->p);
+            link* currentLink = l;
+            l = l->l;
+            free(currentLink);
+            ++count;
+        } while (l != NULL);
+    }
+    noteQueueFreed(count, ksize);
+    free((char*)key);
+}
+
+void pickPixelsWithLighting(void* key, size_t ksize, uintptr_t value, void* usr) {
+    unsigned char* pixels = NULL;
+    long long count = 0;
+    hashmap_get(imgPresent, key, ksize, (uintptr_t*)&pixels);
+    if (pixels != NULL) {
+        link* l = (link*)value;
+        do {
+            pickPixelWithLighting(l->p, pixels);
+            free(l->p);
+            link* currentLink = l;
+            l = l->l;
+            free(currentLink);
+            ++count;
+        } while (l != NULL);
+    }
+    else {
+        link* l = (link*)value;
+        do {
+            free(l->p);
+            link* currentLink = l;
+            l = l->l;
+            free(currentLink);
+            ++count;
+        } while (l != NULL);
+    }
+    noteQueueFreed(count, ksize);
+    free((char*)key);
+}
+
+void clearQueue(void* key, size_t ksize, uintptr_t value, void* usr) {
+    link* l = (link*)value;
+    long long count = 0;
+    do {
+        free(l->p);
+        link* currentLink = l;
+        l = l->l;
+        free(currentLink);
+        ++count;
+    } while (l != NULL);
+    noteQueueFreed(count, ksize);
+    free((char*)key);
+}
+
+// accounts the imgQueue a thread rastered with pixels queued, keyBytes in parts keys, it becomes the thread's lastQueue
+void noteQueue(threadData* tData, long long pixels, long long keyBytes, long long parts) {
+    noteAllocated(MEMORY_QUEUED_PIXELS, pixels * (long long)(sizeof(pixel) + sizeof(link)));
+    noteAllocated(MEMORY_QUEUE_KEYS, keyBytes);
+    tData->lastQueueBytes = tData->lastQueue != NULL ? hashmapBytes(parts) : 0;
+    noteAllocated(MEMORY_QUEUES, tData->lastQueueBytes);
+}
+
+// stamps a map part read by the current frame, and hands one present at a reduced scale to the collector once per frame, which reloads it when the view needs more detail
+void noteTileUse(threadData* tData, unsigned char* pixels, char* id, int length) {
+    tileHeader* header = headerOf(pixels);
+    if (header->used != frame) {
+        header->used = frame;                                                       // keeps it from being evicted
+    }
+    if (header->scale > 0 && header->noted != frame) {
+        header->noted = frame;
+        idData* lastRequest = NULL;
+        idData* request = &(tData->dId);
+        while (request->idLength != 0) {
+            if (request->next != NULL) {
+                request = request->next;
+            }
+            else {
+                idData* newRequest = malloc(sizeof(idData));
+                if (newRequest == NULL) {
+                    return;
+                }
+                noteAllocated(MEMORY_REQUEST_CHAINS, sizeof(idData));
+                newRequest->next = NULL;
+                lastRequest = request;
+                request = newRequest;
+                break;
+            }
+        }
+        memcpy(request->id, id, length + 1);
+        request->idLength = length;
+        request->upgrade = 1;
+        if (lastRequest != NULL) {
+            lastRequest->next = request;
+        }
+        tData->imageRequestRequested = 1;
+        wakeCollector();
+    }
+}
+
+// t->t from [-cutoffLatitude, cutoffLatitude] is stretched/mapped to t -> ln(tan(t/2 + pi/4)) * cutoffLatitude / pi, web mercator scaled so
+// the map's edges stay at +/- cutoffLatitude, beyond clamped to them
+long double stretchWebMercator(long double t) {
+    t = fabsl(t) < cutoffLatitude ? t : copysignl(cutoffLatitude, t);
+    return 2.0L * atanhl(tanl(.5L * t)) * cutoffLatitude / PI;                     // ln(tan(t/2 + pi/4)) == 2 atanh(tan(t/2))
+}
+
+// the view rebased for rastering: the angles of a pixel are computed in float relative to the centre of the view,
+// the centre's map part and position in it, large numbers at high zoom, once per frame in long double, so float suffices up to zoom 30
+
+typedef struct RebasedView {
+    float rScale;
+    float sinT, cosT;                           // of axisTilt
+    int xOrigin, yOrigin;                       // map part of the reference, the centre, at most at the map's edge
+    float xFraction, yFraction;                 // position of the reference in it
+    float xPerRadian;                           // map parts per radian of longitude
+    float yPerStretch;                          // map parts per unit of stretched latitude
+    float stretchBelow, stretchAbove;           // stretched latitudes relative to the reference's where the map ends
+    float sinReference, cosReference;           // of the reference's latitude
+    float sinShift, cosShift, shiftCosine;      // of the centre's latitude minus the reference's, shiftCosine == 1 - cosShift
+    fastMathTier tier;
+} rebasedView;
+
+void rebaseView(rebasedView* view) {
+    long double amount = powl(2, zoom);
+    long double p = fmodl(phiLeft + PIHalf + PIDouble, PIDouble);                  // the centre, see at(centerX, centerY)
+    long double t = -axisTilt;
+    long double reference = fabsl(t) < cutoffLatitude ? t : copysignl(cutoffLatitude, t);
+    long double stretched = stretchWebMercator(reference);
+    long double xTile = p * amount / PIDouble;
+    long double yTile = (stretched - -cutoffLatitude - .0001L) * amount / (2.0L * cutoffLatitude);
+    view->rScale = rScale;
+    view->sinT = sinl(axisTilt);
+    view->cosT = cosl(axisTilt);
+    view->xOrigin = (int)floorl(xTile);
+    view->yOrigin = (int)floorl(yTile);
+    view->xFraction = xTile - floorl(xTile);
+    view->yFraction = yTile - floorl(yTile);
+    view->xPerRadian = amount / PIDouble;
+    view->yPerStretch = amount / (2.0L * cutoffLatitude);
+    view->stretchBelow = -cutoffLatitude - stretched;
+    view->stretchAbove = cutoffLatitude - stretched;
+    view->sinReference = sinl(reference);
+    view->cosReference = cosl(reference);
+    view->sinShift = sinl(t - reference);
+    view->cosShift = cosl(t - reference);
+    view->shiftCosine = 2.0L * sinl(.5L * (t - reference)) * sinl(.5L * (t - reference));
+    // the errors of the fast math are relative to the angles from the centre, so at most the texels from it times the error,
+    // texels from it are at most the angle to the window's corners stretched by the latitude there, at most a whole map
+    long double halfDiagonal = sqrtl((long double)WIDTH * WIDTH + (long double)HEIGHT * HEIGHT) / (2.0L * rScale);
+    long double angle = halfDiagonal < 1.0L ? asinl(halfDiagonal) : PIHalf;
+    long double latitude = fabsl(reference) + angle < cutoffLatitude ? fabsl(reference) + angle : cutoffLatitude;
+    long double texels = fminl(angle / cosl(latitude), PIDouble) * amount * rasterTileSize / PIDouble;
+    view->tier = fastMathTierFor(.5L / (3.0L * texels));                            // of 2 atan2 and 1 atanh per pixel
+}
+
+#define OFF_GLOBE -1e30F
+
+typedef struct RasterPosition {
+    float x, y;                                 // in map parts from the reference's, see rebaseView, x == OFF_GLOBE for a pixel not on the globe
+} rasterPosition;
+
+// position of a pixel, 0 if the pixel is not on the globe
+int rebasedPosition(rebasedView* view, int x, int y, rasterPosition* position) {
+    float u = (x - centerX) / view->rScale;
+    float v = (y - centerY) / view->rScale;
+    float uu = u * u;
+    float m = uu + v * v;
+    if (m > 1.0F) {
+        position->x = OFF_GLOBE;
+        return 0;
+    }
+    float c = sqrtf(1.0F - m);                                                      // the pixel on the unit sphere is (u, v, c) facing the viewer
+    float h = v * view->sinT + c * view->cosT;                                      // towards the centre's meridian, negative beyond a pole
+    float l = sqrtf(uu + h * h);                                                    // cos of the latitude
+    float w = h > 0.0F ? uu / (l + h) : l - h;                                      // l - h, without cancellation near the centre
+    float deltaP = fastAtan2(u, h, view->tier);
+    float sinDeltaT = v + view->sinT * w;                                           // sin and cos of the difference to the centre's latitude expanded not to cancel
+    float cosDeltaT = l * view->cosT - v * view->sinT * view->cosT + c * view->sinT * view->sinT;
+    float oneMinusCos = cosDeltaT > 0.0F ? sinDeltaT * sinDeltaT / (1.0F + cosDeltaT) : 1.0F - cosDeltaT;
+    float sinDelta = sinDeltaT * view->cosShift + cosDeltaT * view->sinShift;       // the same to the reference's latitude
+    oneMinusCos = oneMinusCos * view->cosShift + view->shiftCosine + sinDeltaT * view->sinShift;
+    // stretchWebMercator(reference + delta) - stretchWebMercator(reference) == atanh((sin a - sin b) / (1 - sin a sin b)) * cutoffLatitude / pi
+    // for a, b the pixel's and the reference's latitude, numerator and denominator expanded not to cancel
+    float numerator = view->cosReference * sinDelta - view->sinReference * oneMinusCos;
+    float denominator = oneMinusCos + view->cosReference * l;
+    float ratio = denominator > 0.0F ? numerator / denominator : 0.0F;
+    ratio = fminf(fmaxf(ratio, -.9999999F), .9999999F);                             // at a pole
+    float deltaStretched = fastAtanh(ratio, view->tier) * cutoffLatitudeF / PIF;
+    deltaStretched = deltaStretched < view->stretchBelow ? view->stretchBelow : (deltaStretched > view->stretchAbove ? view->stretchAbove : deltaStretched);
+    position->x = view->xFraction + deltaP * view->xPerRadian;
+    position->y = view->yFraction + deltaStretched * view->yPerStretch;
+    return 1;
+}
+
+// map part and position in it of a position on the globe
+void rebasedTileOf(rebasedView* view, rasterPosition* position, int* tileX, int* tileY, float* xIn, float* yIn) {
+    float xFloor = floorf(position->x);
+    float yFloor = floorf(position->y);
+    int last = (1 << zoom) - 1;
+    *tileX = (view->xOrigin + (int)xFloor) & last;                                  // around the globe
+    *tileY = view->yOrigin + (int)yFloor;
+    *xIn = position->x - xFloor;
+    *yIn = position->y - yFloor;
+    if (*tileY < 0) {
+        *tileY = 0;
+        *yIn = 0.0F;
+    }
+    else if (*tileY > last) {
+        *tileY = last;
+        *yIn = .9999F;
+    }
+}
+
+// map part and position in it of a pixel, 0 if the pixel is not on the globe
+int rebasedTileAt(rebasedView* view, int x, int y, int* tileX, int* tileY, float* xIn, float* yIn) {
+    rasterPosition position;
+    if (!rebasedPosition(view, x, y, &position)) {
+        return 0;
+    }
+    rebasedTileOf(view, &position, tileX, tileY, xIn, yIn);
+    return 1;
+}
+
+// texel of a position in a map part, a position rounded up to 1 stays in it
+int texelIndex(float in) {
+    int index = (int)(in * rasterTileSize);
+    return index < rasterTileSize ? index : rasterTileSize - 1;
+}
+
+#define RASTER_BLOCK 32                         // pixels per side of the squares rastered one after another, their map parts' texels stay cached meanwhile
+
+LONGLONG volatile rasterLookups;                // of the map parts of rastered pixels on the globe
+LONGLONG volatile rasterLookupHits;             // of them answered by the map part directory, without sprintf_s and hashmap_get
+LONGLONG volatile rasterForwardPixels;          // rastered map part by map part, without a lookup, see rasterBandForward
+LONGLONG volatile rasterPixels;                 // rastered by raster
+LONGLONG volatile rasterExactPositions;         // computed exactly for them, the others interpolated, see positionBand
+LONGLONG volatile rasterCoarsePixels;           // rastered from map parts of coarser zoom levels, see blockLevel
+
+#define MAP_PART_DIRECTORY 4096                 // entries at most of the directory of the map parts a thread's rows show, beyond map parts are looked up per pixel
+
+typedef struct MapPartEntry {
+    int resolved;
+    unsigned char* pixels;                      // present map part, retired ones are released after rastering
+    unsigned char* ancestor;                    // the map part containing it ancestorLevel zoom levels up, shown while it loads or if it is missing
+    int ancestorLevel;
+    int requested;                              // pixels are queued for it
+    link* queued;                               // pixels waiting for it, handed to imgQueue after rastering
+} mapPartEntry;
+
+#define COARSE_MAP_PARTS 64                     // at most resolved at coarser zoom levels per thread, beyond pixels use the zoom level of the view
+
+typedef struct CoarseMapPart {
+    int z, tileX, tileY;
+    mapPartEntry entry;
+} coarseMapPart;
+
+typedef struct RasterState {
+    threadData* tData;
+    rebasedView view;
+    hashmap* imgQueue;                          // pixels waiting for their map parts
+    LONGLONG lookups;
+    LONGLONG lookupHits;
+    LONGLONG forwardPixels;
+    LONGLONG exactPositions;
+    mapPartEntry* directory;                    // of the map parts from xMin, yMin, indexed by (tileX - xMin) & last and tileY - yMin, NULL if none
+    int xMin, yMin, columns, rows;
+    coarseMapPart coarse[COARSE_MAP_PARTS];     // shown at coarser zoom levels where the globe is foreshortened, see blockLevel
+    int coarseCount;
+    int lastCoarse;
+    LONGLONG coarsePixels;
+    long long queuedPixels;                     // in imgQueue and the entries, accounted once rastered, see noteQueue
+    long long queueKeyBytes;
+    long long queuedParts;
+} rasterState;
+
+// requests a map part from the collector, 0 if out of memory
+int requestMapPart(threadData* tData, char* id, int length) {
+    idData* lastRequest = NULL;
+    idData* request = &(tData->dId);
+    while (request->idLength != 0) {
+        if (request->next != NULL) {
+            request = request->next;
+        }
+        else {
+            idData* newRequest = malloc(sizeof(idData));
+            if (newRequest == NULL) {
+                return 0;
+            }
+            noteAllocated(MEMORY_REQUEST_CHAINS, sizeof(idData));
+            newRequest->next = NULL;
+            lastRequest = request;
+            request = newRequest;
+            break;
+        }
+    }
+    memcpy(request->id, id, length + 1);
+    request->idLength = length;
+    request->upgrade = 0;
+    if (lastRequest != NULL) {
+        lastRequest->next = request;
+    }
+    queued = 1;
+    tData->imageRequestRequested = 1;
+    wakeCollector();
+    return 1;
+}
+
+// resolves an entry to the present map part z/tileX/tileY or to its parent while it is requested, to its finest present ancestor if it
+// is missing at the map service
+void resolveMapPartEntry(rasterState* state, mapPartEntry* entry, int z, int tileX, int tileY) {
+    entry->resolved = 1;
+    char id[25];
+    int length = sprintf_s(id, 25, idFormat, z, tileX, tileY);
+    uintptr_t result;
+    if (dir != INIT && hashmap_get(imgPresent, (void*)id, length, &result) && result != (uintptr_t)NULL) {
+        entry->pixels = (unsigned char*)result;
+        noteTileUse(state->tData, entry->pixels, id, length);
+        return;
+    }
+    int missing = dir != INIT && tileMissing(id, length);
+    int levels = missing ? z : ((dir == ZIN || dir == SIDE) && z > 0 ? 1 : 0);
+    for (int level = 1; level <= levels; ++level) {
+        char ancestorId[25];
+        int ancestorLength = sprintf_s(ancestorId, 25, idFormat, z - level, tileX >> level, tileY >> level);
+        if (hashmap_get(imgPresent, (void*)ancestorId, ancestorLength, &result) && result != (uintptr_t)NULL) {
+            entry->ancestor = (unsigned char*)result;
+            entry->ancestorLevel = level;
+            if (missing) {
+                noteTileUse(state->tData, entry->ancestor, ancestorId, ancestorLength);
+            }
+            break;
+        }
+    }
+    if (!missing && state->imgQueue != NULL && requestMapPart(state->tData, id, length)) {
+        entry->requested = 1;
+    }
+}
+
+// the directory's entry of a map part, resolved on first use, NULL if the directory does not hold it
+mapPartEntry* resolveMapPart(rasterState* state, int tileX, int tileY) {
+    int column = (tileX - state->xMin) & ((1 << zoom) - 1);
+    int row = tileY - state->yMin;
+    if (column >= state->columns || row < 0 || row >= state->rows) {
+        return NULL;
+    }
+    mapPartEntry* entry = &(state->directory[row * state->columns + column]);
+    if (!entry->resolved) {
+        resolveMapPartEntry(state, entry, zoom, tileX, tileY);
+    }
+    return entry;
+}
+
+// the entry of a map part of a coarser zoom level, resolved on first use, NULL if too many are shown
+mapPartEntry* resolveCoarseMapPart(rasterState* state, int z, int tileX, int tileY) {
+    coarseMapPart* part = &(state->coarse[state->lastCoarse]);
+    if (state->coarseCount > 0 && part->z == z && part->tileX == tileX && part->tileY == tileY) {
+        return &(part->entry);
+    }
+    for (int i = 0; i < state->coarseCount; ++i) {
+        part = &(state->coarse[i]);
+        if (part->z == z && part->tileX == tileX && part->tileY == tileY) {
+            state->lastCoarse = i;
+            return &(part->entry);
+        }
+    }
+    if (state->coarseCount == COARSE_MAP_PARTS) {
+        return NULL;
+    }
+    state->lastCoarse = state->coarseCount++;
+    part = &(state->coarse[state->lastCoarse]);
+    part->z = z;
+    part->tileX = tileX;
+    part->tileY = tileY;
+    memset(&(part->entry), 0, sizeof(mapPartEntry));
+    resolveMapPartEntry(state, &(part->entry), z, tileX, tileY);
+    return &(part->entry);
+}
+
+// hands the pixels waiting for an entry to imgQueue
+void flushMapPartEntry(rasterState* state, mapPartEntry* entry, int z, int tileX, int tileY) {
+    if (entry->queued != NULL) {
+        char id[25];
+        int length = sprintf_s(id, 25, idFormat, z, tileX, tileY);
+        char* pId = malloc(length);
+        if (pId != NULL) {
+            memcpy(pId, id, length);
+            hashmap_set(state->imgQueue, (void*)pId, length, (uintptr_t)entry->queued);
+            state->queueKeyBytes += length;
+            ++state->queuedParts;
+        }
+        else {
+            clearQueue(NULL, 0, (uintptr_t)entry->queued, NULL);
+        }
+    }
+}
+
+// hands the pixels waiting in the directory and for coarser map parts to imgQueue, once per map part, and frees the directory
+void flushMapPartDirectory(rasterState* state) {
+    for (int i = 0; i < state->coarseCount; ++i) {
+        coarseMapPart* part = &(state->coarse[i]);
+        flushMapPartEntry(state, &(part->entry), part->z, part->tileX, part->tileY);
+    }
+    state->coarseCount = 0;
+    if (state->directory == NULL) {
+        return;
+    }
+    int last = (1 << zoom) - 1;
+    for (int row = 0; row < state->rows; ++row) {
+        for (int column = 0; column < state->columns; ++column) {
+            flushMapPartEntry(state, &(state->directory[row * state->columns + column]), zoom, (state->xMin + column) & last, state->yMin + row);
+        }
+    }
+    free(state->directory);
+    state->directory = NULL;
+}
+
+#define SURVEY_GRID 16                          // pixels between the samples finding the map parts a thread's rows show
+
+// sets up the directory for the map parts around the ones found from samples of the rows of a thread, none if they are too many
+void surveyMapParts(rasterState* state, int yStart, int yEnd) {
+    state->directory = NULL;
+    int found = 0;
+    int xLow = 0, xHigh = 0, yLow = 0, yHigh = 0;                                   // in map parts from the reference's
+    for (int ySample = yStart; ySample < yEnd + SURVEY_GRID - 1; ySample += SURVEY_GRID) {
+        int y = min(ySample, yEnd - 1);                                                 // the last row and column are sampled too
+        for (int xSample = 0; xSample < WIDTH + SURVEY_GRID - 1; xSample += SURVEY_GRID) {
+            int x = min(xSample, WIDTH - 1);
+            rasterPosition position;
+            if (rebasedPosition(&(state->view), x, y, &position)) {
+                int xPart = (int)floorf(position.x);
+                int yPart = (int)floorf(position.y);
+                if (!found) {
+                    found = 1;
+                    xLow = xHigh = xPart;
+                    yLow = yHigh = yPart;
                 }
-                else {
-                    int iXTile = (int)((xTile - tileX) * rasterTileSize);
-                    int iYTile = (int)((yTile - tileY) * rasterTileSize);
+                xLow = min(xLow, xPart);
+                xHigh = max(xHigh, xPart);
+                yLow = min(yLow, yPart);
+                yHigh = max(yHigh, yPart);
+            }
+        }
+    }
+    if (!found) {
+        return;
+    }
+    int last = (1 << zoom) - 1;
+    state->xMin = (state->view.xOrigin + xLow - 1) & last;                          // a map part's pixels between samples may show its neighbours
+    state->columns = min(xHigh - xLow + 3, last + 1);                               // each map part once around the globe
+    state->yMin = max(state->view.yOrigin + yLow - 1, 0);
+    state->rows = min(state->view.yOrigin + yHigh + 1, last) - state->yMin + 1;
+    if (state->rows <= 0 || state->columns * state->rows > MAP_PART_DIRECTORY) {
+        return;
+    }
+    state->directory = calloc((size_t)state->columns * state->rows, sizeof(mapPartEntry));
+}
 
-                    int picked = 0;
-                    switch (dir) {
-                        case ZIN:
-                        case SIDE:
-                            if (zoom > 0) {
-                                double amount = pow(2, zoom - 1);
-                                double xTile = angles.p * amount / PIDoubleD;
-                                double yTile = (angles.t - -cutoffLatitudeD - .0001) * amount / (2.0 * cutoffLatitudeD);
-                                int tileX = (int)xTile;
-                                int tileY = (int)yTile;
-                                char id[25];
-                                int length = sprintf_s(id, 25, idFormat, zoom - 1, tileX, tileY);
-                                if (length == 0) {
-                                    length = 5;
-                                    strcpy(id, "0/0/0");
-                                    xTile = angles.p / PIDoubleD;
-                                    if (xTile < 0.0) {
-                                        xTile = 0.0;
-                                    }
-                                    else if (xTile >= 1.0) {
-                                        xTile = .9999;
-                                    }
-                                    yTile = (angles.t - -cutoffLatitudeD - .0001) / (2.0 * cutoffLatitudeD);
-                                    if (yTile < 0.0) {
-                                        yTile = 0.0;
-                                    }
-                                    else if (yTile >= 1.0) {
-                                        yTile = .9999;
-                                    }
-                                    tileX = 0;
-                                    tileY = 0;
-                                }
-                                uintptr_t result;
-                                if (hashmap_get(imgPresent, (void*)id, length, &result) && result != (uintptr_t)NULL) {
-                                    pixel p;
-                                    p.sourceX = (int)((xTile - tileX) * rasterTileSize);
-                                    p.sourceY = (int)((yTile - tileY) * rasterTileSize);
-                                    p.targetX = x;
-                                    p.targetY = y;
-                                    pickPixel(&p, (unsigned char*)result);
-                                    picked = 1;
-                                }
-                            }
-                            break;
-                        case ZOUT:
-                        case INIT:
-                        case REFRESH:
-                        default:
-                            break;
+// rasters a pixel at xIn, yIn of map part tileX, tileY from it looked up, from the one containing it at the previous zoom level or queued
+// while it loads, level zoom levels coarser than the view's where its footprint covers as many, see blockLevel
+void rasterPixelOf(rasterState* state, int x, int y, int tileX, int tileY, float xIn, float yIn, int level) {
+    ++state->lookups;
+    mapPartEntry* entry = NULL;
+    if (level > 0) {
+        float reduction = 1.0F / (1 << level);
+        int inside = (1 << level) - 1;
+        entry = resolveCoarseMapPart(state, zoom - level, tileX >> level, tileY >> level);
+        if (entry != NULL) {
+            xIn = ((tileX & inside) + xIn) * reduction;
+            yIn = ((tileY & inside) + yIn) * reduction;
+            tileX >>= level;
+            tileY >>= level;
+            ++state->coarsePixels;
+        }
+    }
+    if (entry == NULL && state->directory != NULL) {
+        entry = resolveMapPart(state, tileX, tileY);
+    }
+    int iXTile = texelIndex(xIn);
+    int iYTile = texelIndex(yIn);
+    if (entry != NULL) {
+        ++state->lookupHits;
+        pixel p;
+        p.sourceX = iXTile;
+        p.sourceY = iYTile;
+        p.targetX = x;
+        p.targetY = y;
+        if (entry->pixels != NULL) {
+            pickPixel(&p, entry->pixels);
+            return;
+        }
+        if (entry->ancestor != NULL) {
+            pixel parent = p;
+            int inside = (1 << entry->ancestorLevel) - 1;
+            float reduction = 1.0F / (1 << entry->ancestorLevel);
+            parent.sourceX = texelIndex(((tileX & inside) + xIn) * reduction);
+            parent.sourceY = texelIndex(((tileY & inside) + yIn) * reduction);
+            pickPixel(&parent, entry->ancestor);
+        }
+        else {
+            memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)zero3, 3);
+        }
+        if (entry->requested) {
+            pixel* queuedPixel = malloc(sizeof(pixel));
+            link* l = malloc(sizeof(link));
+            if (queuedPixel != NULL && l != NULL) {
+                *queuedPixel = p;
+                l->p = queuedPixel;
+                l->l = entry->queued;
+                entry->queued = l;
+                ++state->queuedPixels;
+            }
+            else {
+                free(queuedPixel);
+                free(l);
+            }
+        }
+        return;
+    }
+    char id[25];                                                                    // maximum length of id incl. \0 at maximum zoom of 30
+    int length = sprintf_s(id, 25, idFormat, zoom, tileX, tileY);
+    uintptr_t result;
+    if (dir != INIT && hashmap_get(imgPresent, (void*)id, length, &result) && result != (uintptr_t)NULL) {
+        pixel p;
+        p.sourceX = iXTile;
+        p.sourceY = iYTile;
+        p.targetX = x;
+        p.targetY = y;
+        pickPixel(&p, (unsigned char*)result);
+        noteTileUse(state->tData, (unsigned char*)result, id, length);
+        return;
+    }
+    else {
+        int picked = 0;
+        if ((dir == ZIN || dir == SIDE) && zoom > 0) {                              // the map part containing it at the previous zoom level, while it loads
+            char parentId[25];
+            int parentLength = sprintf_s(parentId, 25, idFormat, zoom - 1, tileX >> 1, tileY >> 1);
+            if (hashmap_get(imgPresent, (void*)parentId, parentLength, &result) && result != (uintptr_t)NULL) {
+                pixel p;
+                p.sourceX = texelIndex(((tileX & 1) + xIn) * .5F);
+                p.sourceY = texelIndex(((tileY & 1) + yIn) * .5F);
+                p.targetX = x;
+                p.targetY = y;
+                pickPixel(&p, (unsigned char*)result);
+                picked = 1;
+            }
+        }
+        if (!picked) {
+            memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)zero3, 3);
+        }
+        if (state->imgQueue != NULL) {
+            pixel* p = malloc(sizeof(pixel));
+            uintptr_t result;
+            if (hashmap_get(state->imgQueue, (void*)id, length, &result)) {
+                if (p != NULL) {
+                    p->sourceX = iXTile;
+                    p->sourceY = iYTile;
+                    p->targetX = x;
+                    p->targetY = y;
+                    link* l = malloc(sizeof(link));
+                    if (l != NULL) {
+                        l->p = p;
+                        l->l = (link*)result;
+                        hashmap_set(state->imgQueue, (void*)id, length, (uintptr_t)l);
+                        ++state->queuedPixels;
+                        return;
                     }
-                    if (!picked) {
-                        memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)zero3, 3);
+                    else {
+                        free(p);
                     }
-
-                    if (imgQueue != NULL) {
-                        pixel* p = malloc(sizeof(pixel));
-                        uintptr_t result;
-                        if (hashmap_get(imgQueue, (void*)id, length, &result)) {
-                            if (p != NULL) {
-                                p->sourceX = iXTile;
-                                p->sourceY = iYTile;
-                                p->targetX = x;
-                                p->targetY = y;
-                                link* l = malloc(sizeof(link));
-                                if (l != NULL) {
-                                    l->p = p;
-                                    l->l = (link*)result;
-                                    hashmap_set(imgQueue, (void*)id, length, (uintptr_t)l);
-                                    continue;
-                                }
-                                else {
-                                    free(p);
-                                }
+                }
+            }
+            else {
+                if (p != NULL) {
+                    p->sourceX = iXTile;
+                    p->sourceY = iYTile;
+                    p->targetX = x;
+                    p->targetY = y;
+                    link* l = malloc(sizeof(link));
+                    if (l != NULL) {
+                        l->p = p;
+                        l->l = NULL;
+                        char* pId = malloc(length);
+                        if (pId != NULL) {
+                            if (!requestMapPart(state->tData, id, length)) {
+                                free(pId);
+                                goto LIKE_LNULL;
                             }
+                            memcpy(pId, id, length);
+                            hashmap_set(state->imgQueue, (void*)pId, length, (uintptr_t)l);
+                            ++state->queuedPixels;
+                            state->queueKeyBytes += length;
+                            ++state->queuedParts;
+                            return;
                         }
                         else {
-                            if (p != NULL) {
-                                p->sourceX = iXTile;
-                                p->sourceY = iYTile;
-                                p->targetX = x;
-                                p->targetY = y;
-                                link* l = malloc(sizeof(link));
-                                if (l != NULL) {
-                                    l->p = p;
-                                    l->l = NULL;
-                                    char* pId = malloc(length);
-                                    if (pId != NULL) {
-                                        idData* lastRequest = NULL;
-                                        idData* request = &(tData->dId);
-                                        while (request->idLength != 0) {
-                                            if (request->next != NULL) {
-                                                request = request->next;
-                                            }
-                                            else {
-                                                idData* newRequest = malloc(sizeof(idData));
-                                                if (newRequest == NULL) {
-                                                    free(pId);
-                                                    goto LIKE_LNULLD;
-                                                }
-                                                newRequest->next = NULL;
-                                                lastRequest = request;
-                                                request = newRequest;
-                                                break;
-                                            }
-                                        }
-                                        memcpy(request->id, id, length + 1);
-                                        request->idLength = length;
-                                        if (lastRequest != NULL) {
-                                            lastRequest->next = request;
-                                        }
-                                        memcpy(pId, id, length);
-                                        hashmap_set(imgQueue, (void*)pId, length, (uintptr_t)l);
-                                        queued = 1;
-                                        tData->imageRequestRequested = 1;
-                                        continue;
-                                    }
-                                    else {
-LIKE_LNULLD:
-                                        free(l);
-                                        free(p);
-                                    }
-                                }
-                                else {
-                                    free(p);
-                                }
-                            }
+LIKE_LNULL:
+                            free(l);
+                            free(p);
                         }
                     }
+                    else {
+                        free(p);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// rasters a pixel, see rasterPixelOf, its position computed if not given
+void rasterPixel(rasterState* state, int x, int y, rasterPosition* position, int level) {
+    rasterPosition computed;
+    if (position == NULL) {
+        position = &computed;
+        rebasedPosition(&(state->view), x, y, position);
+        ++state->exactPositions;
+    }
+    if (position->x != OFF_GLOBE) {
+        int tileX, tileY;
+        float xIn, yIn;
+        rebasedTileOf(&(state->view), position, &tileX, &tileY, &xIn, &yIn);
+        rasterPixelOf(state, x, y, tileX, tileY, xIn, yIn, level);
+    }
+    else {
+        memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)zero3, 3);
+    }
+}
+
+#define GRID_CELL 8                             // pixels per side of the cells of a band whose corners' positions are computed, inside interpolated
+
+int gridInterpolation = 1;                      // toggled with G in debug builds to compare with computing every position
+
+// position of a pixel computed
+rasterPosition exactPosition(rasterState* state, int x, int y) {
+    rasterPosition position;
+    rebasedPosition(&(state->view), x, y, &position);
+    ++state->exactPositions;
+    return position;
+}
+
+// positions of the pixels of cell [x0, x1) x [y0, y1) of a band in rows yBand to yEnd, bilinearly interpolated from its corners where the
+// positions interpolated at its centre along both diagonals are within a quarter texel of the computed one, else in quarters down to 2
+// pixels, then computed;
+// at the limb, the poles, the map's edges and the meridian opposite the centre's the interpolation fails and the cells are divided
+void positionCell(rasterState* state, rasterPosition* positions, int yBand, int yEnd, int x0, int y0, int x1, int y1, rasterPosition c00, rasterPosition c10, rasterPosition c01, rasterPosition c11) {
+    if (x0 >= WIDTH || y0 >= yEnd) {
+        return;
+    }
+    float dx = x0 > centerX ? x0 - centerX : (x1 - 1 < centerX ? centerX - (x1 - 1) : 0.0F);
+    float dy = y0 > centerY ? y0 - centerY : (y1 - 1 < centerY ? centerY - (y1 - 1) : 0.0F);
+    int xEnd = min(x1, WIDTH);
+    int yCellEnd = min(y1, yEnd);
+    if (dx * dx + dy * dy > state->view.rScale * state->view.rScale) {                 // entirely beside the globe
+        for (int y = y0; y < yCellEnd; ++y) {
+            for (int x = x0; x < xEnd; ++x) {
+                positions[(y - yBand) * WIDTH + x].x = OFF_GLOBE;
+            }
+        }
+        return;
+    }
+    int width = x1 - x0;
+    int height = y1 - y0;
+    int xMiddle = x0 + width / 2;
+    int yMiddle = y0 + height / 2;
+    rasterPosition middle;
+    int middleComputed = 0;
+    if (c00.x != OFF_GLOBE && c10.x != OFF_GLOBE && c01.x != OFF_GLOBE && c11.x != OFF_GLOBE) {                   // so is every pixel between, the globe is convex
+        middle = exactPosition(state, xMiddle, yMiddle);
+        middleComputed = 1;
+        float tolerance = .25F / rasterTileSize;
+        if (middle.x != OFF_GLOBE                                                       // both diagonals, around a pole one alone can be symmetric
+            && fabsf(.5F * (c00.x + c11.x) - middle.x) <= tolerance && fabsf(.5F * (c10.x + c01.x) - middle.x) <= tolerance
+            && fabsf(.5F * (c00.y + c11.y) - middle.y) <= tolerance && fabsf(.5F * (c10.y + c01.y) - middle.y) <= tolerance) {
+            for (int y = y0; y < yCellEnd; ++y) {
+                float f = (float)(y - y0) / height;
+                rasterPosition left = { c00.x + (c01.x - c00.x) * f, c00.y + (c01.y - c00.y) * f };
+                rasterPosition right = { c10.x + (c11.x - c10.x) * f, c10.y + (c11.y - c10.y) * f };
+                rasterPosition step = { (right.x - left.x) / width, (right.y - left.y) / width };
+                rasterPosition* position = positions + (y - yBand) * WIDTH + x0;
+                for (int x = x0; x < xEnd; ++x) {
+                    *(position++) = left;
+                    left.x += step.x;
+                    left.y += step.y;
+                }
+            }
+            return;
+        }
+    }
+    if (width <= 2) {
+        for (int y = y0; y < yCellEnd; ++y) {
+            for (int x = x0; x < xEnd; ++x) {
+                positions[(y - yBand) * WIDTH + x] = x == x0 && y == y0 ? c00 : (middleComputed && x == xMiddle && y == yMiddle ? middle : exactPosition(state, x, y));
+            }
+        }
+        return;
+    }
+    if (!middleComputed) {
+        middle = exactPosition(state, xMiddle, yMiddle);
+    }
+    rasterPosition top = exactPosition(state, xMiddle, y0);
+    rasterPosition bottom = exactPosition(state, xMiddle, y1);
+    rasterPosition left = exactPosition(state, x0, yMiddle);
+    rasterPosition right = exactPosition(state, x1, yMiddle);
+    positionCell(state, positions, yBand, yEnd, x0, y0, xMiddle, yMiddle, c00, top, left, middle);
+    positionCell(state, positions, yBand, yEnd, xMiddle, y0, x1, yMiddle, top, c10, middle, right);
+    positionCell(state, positions, yBand, yEnd, x0, yMiddle, xMiddle, y1, left, middle, c01, bottom);
+    positionCell(state, positions, yBand, yEnd, xMiddle, yMiddle, x1, y1, middle, right, bottom, c11);
+}
+
+// positions of the pixels of a band of rows from yBand to yEnd, corners is room for 2 rows of corners of its cells
+void positionBand(rasterState* state, rasterPosition* positions, rasterPosition* corners, int yBand, int yEnd) {
+    if (!gridInterpolation) {
+        for (int y = yBand; y < yEnd; ++y) {
+            for (int x = 0; x < WIDTH; ++x) {
+                positions[(y - yBand) * WIDTH + x] = exactPosition(state, x, y);
+            }
+        }
+        return;
+    }
+    int columns = (WIDTH + GRID_CELL - 1) / GRID_CELL;
+    rasterPosition* top = corners;
+    rasterPosition* bottom = corners + columns + 1;
+    for (int i = 0; i <= columns; ++i) {
+        top[i] = exactPosition(state, i * GRID_CELL, yBand);
+    }
+    for (int y = yBand; y < yEnd; y += GRID_CELL) {
+        for (int i = 0; i <= columns; ++i) {
+            bottom[i] = exactPosition(state, i * GRID_CELL, y + GRID_CELL);
+        }
+        for (int i = 0; i < columns; ++i) {
+            positionCell(state, positions, yBand, yEnd, i * GRID_CELL, y, (i + 1) * GRID_CELL, y + GRID_CELL, top[i], top[i + 1], bottom[i], bottom[i + 1]);
+        }
+        rasterPosition* swap = top;
+        top = bottom;
+        bottom = swap;
+    }
+}
+
+int levelOfDetail = 1;                          // toggled with L in debug builds to compare with showing every pixel at the zoom level of the view
+
+// zoom levels coarser than the view's a block of pixels is rastered at: as many as its pixels cover texels of the view's zoom level
+// per side, from the area one of its pixels covers where the globe is foreshortened least in it, next to the centre of the disk
+int blockLevel(rasterState* state, int x0, int y0, int x1, int y1) {
+    if (!levelOfDetail) {
+        return 0;
+    }
+    int x = min(max(centerX, x0), x1 - 1);
+    int y = min(max(centerY, y0), y1 - 1);
+    int xStep = x < centerX ? 1 : -1;                                                  // towards the centre, staying on the globe
+    int yStep = y < centerY ? 1 : -1;
+    rasterPosition position, xNeighbour, yNeighbour;
+    state->exactPositions += 3;
+    if (!rebasedPosition(&(state->view), x, y, &position) || !rebasedPosition(&(state->view), x + xStep, y, &xNeighbour)
+        || !rebasedPosition(&(state->view), x, y + yStep, &yNeighbour)) {
+        return 0;
+    }
+    float ax = xNeighbour.x - position.x;
+    float ay = xNeighbour.y - position.y;
+    float bx = yNeighbour.x - position.x;
+    float by = yNeighbour.y - position.y;
+    float halfAround = .5F * (1 << zoom);
+    if (fabsf(ax) > halfAround || fabsf(bx) > halfAround) {                            // across the meridian opposite the centre's
+        return 0;
+    }
+    float texels = fabsf(ax * by - ay * bx) * rasterTileSize * rasterTileSize;         // covered by the pixel
+    int level = 0;
+    while (level < zoom && texels >= 4.0F) {
+        texels *= .25F;
+        ++level;
+    }
+    return level;
+}
+
+// levels of the blocks of a band, see blockLevel, at least as many as the view's zoom level is beyond the map service's deepest in the
+// region under the block's centre, which enlarges its map parts
+void levelBand(rasterState* state, int* levels, int yBand, int yEnd) {
+    int limited = serviceLimitedRegions > 0;
+    for (int xBlock = 0; xBlock < WIDTH; xBlock += RASTER_BLOCK) {
+        int xEnd = min(xBlock + RASTER_BLOCK, WIDTH);
+        int overzoom = 0;
+        int tileX, tileY;
+        float xIn, yIn;
+        if (limited && rebasedTileAt(&(state->view), (xBlock + xEnd) / 2, (yBand + yEnd) / 2, &tileX, &tileY, &xIn, &yIn)) {
+            overzoom = max(zoom - serviceMaxZoomAt(zoom, tileX, tileY), 0);
+        }
+        levels[xBlock / RASTER_BLOCK] = max(blockLevel(state, xBlock, yBand, xEnd, yEnd), overzoom);
+    }
+}
+
+#define FORWARD_MAP_PARTS 64                    // at most shown by a thread's rows to raster them map part by map part
+#define FORWARD_DONE 1                          // states of the pixels of a band rastered map part by map part, 0 while not reached
+#define FORWARD_MISSING 2                       // + index of the missing map part it lies in, its position replaced by the one in it
+#define FORWARD_UNLISTED 255                    // lies in a map part not among the thread's
+
+int forwardRastering = 1;                       // toggled with F in debug builds to compare with rastering pixel by pixel
+
+typedef struct ForwardMapPart {
+    int tileX, tileY;
+    unsigned char* pixels;                      // NULL if not present
+    int xMin, yMin, xMax, yMax;                 // window region around the samples in it
+} forwardMapPart;
+
+forwardMapPart* findForwardMapPart(forwardMapPart* parts, int count, int tileX, int tileY) {
+    for (int i = 0; i < count; ++i) {
+        if (parts[i].tileX == tileX && parts[i].tileY == tileY) {
+            return &(parts[i]);
+        }
+    }
+    return NULL;
+}
+
+// the map parts shown by the rows of a thread, found from samples and resolved once, 0 if too many are shown to benefit
+int findForwardMapParts(rasterState* state, int yStart, int yEnd, forwardMapPart* parts, int* count) {
+    *count = 0;
+    for (int ySample = yStart; ySample < yEnd + SURVEY_GRID - 1; ySample += SURVEY_GRID) {
+        int y = min(ySample, yEnd - 1);                                                 // the last row and column are sampled too
+        for (int xSample = 0; xSample < WIDTH + SURVEY_GRID - 1; xSample += SURVEY_GRID) {
+            int x = min(xSample, WIDTH - 1);
+            int tileX, tileY;
+            float xIn, yIn;
+            if (rebasedTileAt(&(state->view), x, y, &tileX, &tileY, &xIn, &yIn)) {
+                forwardMapPart* part = findForwardMapPart(parts, *count, tileX, tileY);
+                if (part == NULL) {
+                    if (*count == FORWARD_MAP_PARTS) {
+                        return 0;
+                    }
+                    part = &(parts[(*count)++]);
+                    part->tileX = tileX;
+                    part->tileY = tileY;
+                    part->xMin = part->xMax = x;
+                    part->yMin = part->yMax = y;
+                }
+                part->xMin = min(part->xMin, x);
+                part->xMax = max(part->xMax, x);
+                part->yMin = min(part->yMin, y);
+                part->yMax = max(part->yMax, y);
+            }
+        }
+    }
+    for (int i = 0; i < *count; ++i) {
+        forwardMapPart* part = &(parts[i]);
+        mapPartEntry* entry = resolveMapPart(state, part->tileX, part->tileY);
+        part->pixels = entry != NULL ? entry->pixels : NULL;                            // missing ones are left to rasterPixel
+        part->xMin = max(part->xMin - SURVEY_GRID, 0);                                  // its pixels are at most a sample distance away from its samples
+        part->xMax = min(part->xMax + SURVEY_GRID, WIDTH - 1);
+        part->yMin = max(part->yMin - SURVEY_GRID, yStart);
+        part->yMax = min(part->yMax + SURVEY_GRID, yEnd - 1);
+    }
+    return 1;
+}
+
+// rasters a band map part by map part: each present one fills the pixels around its samples mapping into it row by row, until a row
+// leaves it, so its texels are read once; pixels of missing or unsampled map parts and of blocks rastered at coarser zoom levels are left
+// for rasterPixel, the ones found in a missing map part without finding it again
+void rasterBandForward(rasterState* state, forwardMapPart* parts, int count, rasterPosition* positions, int* levels, unsigned char* done, int yBand, int yEnd) {
+    memset(done, 0, (size_t)WIDTH * (yEnd - yBand));
+    for (int i = 0; i < count; ++i) {
+        forwardMapPart* part = &(parts[i]);
+        if (part->pixels == NULL) {
+            continue;
+        }
+        for (int y = max(part->yMin, yBand); y <= min(part->yMax, yEnd - 1); ++y) {
+            unsigned char* doneRow = done + (size_t)(y - yBand) * WIDTH;
+            rasterPosition* positionRow = positions + (size_t)(y - yBand) * WIDTH;
+            int inside = 0;
+            for (int x = part->xMin; x <= part->xMax; ++x) {
+                if (doneRow[x] != 0 || levels[x / RASTER_BLOCK] > 0) {                    // of coarser zoom levels left to rasterPixel
+                    if (inside) {
+                        break;
+                    }
+                    continue;
+                }
+                if (positionRow[x].x == OFF_GLOBE) {
+                    memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)zero3, 3);
+                    doneRow[x] = FORWARD_DONE;
+                    if (inside) {
+                        break;
+                    }
+                    continue;
+                }
+                int tileX, tileY;
+                float xIn, yIn;
+                rebasedTileOf(&(state->view), &(positionRow[x]), &tileX, &tileY, &xIn, &yIn);
+                int within = tileX == part->tileX && tileY == part->tileY;
+                forwardMapPart* other = within ? part : findForwardMapPart(parts, count, tileX, tileY);
+                if (other != NULL && other->pixels != NULL) {                           // known anyway, so filled from a neighbour too
+                    pixel p;
+                    p.sourceX = texelIndex(xIn);
+                    p.sourceY = texelIndex(yIn);
+                    p.targetX = x;
+                    p.targetY = y;
+                    pickPixel(&p, other->pixels);
+                    doneRow[x] = FORWARD_DONE;
+                    ++state->forwardPixels;
+                }
+                else if (other != NULL) {
+                    positionRow[x].x = xIn;
+                    positionRow[x].y = yIn;
+                    doneRow[x] = (unsigned char)(FORWARD_MISSING + (other - parts));
+                }
+                else {
+                    doneRow[x] = FORWARD_UNLISTED;
                 }
+                if (within) {
+                    inside = 1;
+                }
+                else if (inside) {
+                    break;
+                }
+            }
+        }
+    }
+    for (int y = yBand; y < yEnd; ++y) {
+        unsigned char* doneRow = done + (size_t)(y - yBand) * WIDTH;
+        rasterPosition* positionRow = positions + (size_t)(y - yBand) * WIDTH;
+        for (int x = 0; x < WIDTH; ++x) {
+            if (doneRow[x] == FORWARD_DONE) {
+                continue;
+            }
+            if (doneRow[x] >= FORWARD_MISSING && doneRow[x] != FORWARD_UNLISTED) {
+                forwardMapPart* part = &(parts[doneRow[x] - FORWARD_MISSING]);
+                rasterPixelOf(state, x, y, part->tileX, part->tileY, positionRow[x].x, positionRow[x].y, 0);
             }
             else {
-                memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)zero3, 3);
+                rasterPixel(state, x, y, &(positionRow[x]), levels[x / RASTER_BLOCK]);
             }
         }
     }
+}
+
+// rasters a band in blocks of RASTER_BLOCK columns, serpentine so consecutive blocks neighbour
+void rasterBandBlocks(rasterState* state, rasterPosition* positions, int* levels, int yBand, int yEnd, int backwards) {
+    int blockColumns = (WIDTH + RASTER_BLOCK - 1) / RASTER_BLOCK;
+    for (int block = 0; block < blockColumns; ++block) {
+        int xBlock = (backwards ? blockColumns - 1 - block : block) * RASTER_BLOCK;
+        int blockWidth = min(RASTER_BLOCK, WIDTH - xBlock);
+        int blockPixels = blockWidth * (yEnd - yBand);
+        int level = levels != NULL ? levels[xBlock / RASTER_BLOCK] : 0;
+        for (int i = 0; i < blockPixels; ++i) {
+            int x = xBlock + i % blockWidth;
+            int y = yBand + i / blockWidth;
+            rasterPixel(state, x, y, positions != NULL ? &(positions[(y - yBand) * WIDTH + x]) : NULL, level);
+        }
+    }
+}
+
+// rasterizes without lighting at every zoom, see rebaseView, in bands of RASTER_BLOCK rows, their positions interpolated, see positionBand,
+// map part by map part if few are shown, see rasterBandForward, else in blocks, see rasterBandBlocks
+unsigned __stdcall raster(void* data) {
+    threadData* tData = (threadData*)data;
+    int yStart = tData->yStart;
+    int yEnd = tData->yEnd;
+    tData->rastering = 1;
+    rastered = 0;
+    notScheduled = 1;
+    rasterState state;
+    state.tData = tData;
+    state.imgQueue = hashmap_create();
+    rebaseView(&(state.view));
+    state.lookups = 0;
+    state.lookupHits = 0;
+    state.forwardPixels = 0;
+    state.exactPositions = 0;
+    state.coarseCount = 0;
+    state.lastCoarse = 0;
+    state.coarsePixels = 0;
+    state.queuedPixels = 0;
+    state.queueKeyBytes = 0;
+    state.queuedParts = 0;
+    surveyMapParts(&state, yStart, yEnd);
+    int* levels = calloc(WIDTH / RASTER_BLOCK + 1, sizeof(int));
+    rasterPosition* positions = malloc(((size_t)WIDTH * RASTER_BLOCK + 2 * (WIDTH / GRID_CELL + 2)) * sizeof(rasterPosition));
+    unsigned char* done = malloc((size_t)WIDTH * RASTER_BLOCK);
+    forwardMapPart parts[FORWARD_MAP_PARTS];
+    int count;
+    int forward = forwardRastering && dir != INIT && positions != NULL && done != NULL && levels != NULL && state.directory != NULL
+        && findForwardMapParts(&state, yStart, yEnd, parts, &count);
+    for (int yBand = yStart; yBand < yEnd; yBand += RASTER_BLOCK) {
+        int yBandEnd = min(yBand + RASTER_BLOCK, yEnd);
+        if (positions != NULL) {
+            positionBand(&state, positions, positions + (size_t)WIDTH * RASTER_BLOCK, yBand, yBandEnd);
+        }
+        if (levels != NULL) {
+            levelBand(&state, levels, yBand, yBandEnd);
+        }
+        if (forward) {
+            rasterBandForward(&state, parts, count, positions, levels, done, yBand, yBandEnd);
+        }
+        else {
+            rasterBandBlocks(&state, positions, levels, yBand, yBandEnd, ((yBand - yStart) / RASTER_BLOCK) & 1);
+        }
+    }
+    free(levels);
+    free(done);
+    free(positions);
+    flushMapPartDirectory(&state);
+    InterlockedExchangeAdd64(&rasterLookups, state.lookups);
+    InterlockedExchangeAdd64(&rasterLookupHits, state.lookupHits);
+    InterlockedExchangeAdd64(&rasterForwardPixels, state.forwardPixels);
+    InterlockedExchangeAdd64(&rasterPixels, (LONGLONG)WIDTH * (yEnd - yStart));
+    InterlockedExchangeAdd64(&rasterExactPositions, state.exactPositions);
+    InterlockedExchangeAdd64(&rasterCoarsePixels, state.coarsePixels);
     //memcpy(((unsigned char*)region) + yStart * pitch, ((unsigned char*)buffer) + yStart * pitch, pitch * (yEnd - yStart));                            // copy all once in main thread appears to be faster than copy parts parallely from threads
     if (tData->lastQueue != NULL) {
         hashmap_iterate(tData->lastQueue, clearQueue, NULL);
         hashmap_free(tData->lastQueue);
+        noteFreed(MEMORY_QUEUES, tData->lastQueueBytes);
     }
-    tData->lastQueue = imgQueue;
+    tData->lastQueue = state.imgQueue;
+    noteQueue(tData, state.queuedPixels, state.queueKeyBytes, state.queuedParts);
     tData->rastering = 0;
+    signalProgress();
     return 0;
 }
 
-// t->t from [0, +/- pi/2] to [0, +/- pi/2] is stretched/mapped to t -> 1/2 * ln(tan(t/2 + pi/4)) from [0, +/- pi/2] to [0, +/- 1.75]
-float stretchWebMercatorF(float t) {
-    // approximation for ln(tan(t/2 + pi/4)) used:
-    float t4 = 4 * t;
-    return .5F * (619.96F * PIF * t) / ((PIF * PIF - 55.3536F + t4 * (t - PIF)) * (PIF * PIF - 55.3536F + t4 * (t + PIF)));
-}
+const double cutoffLatitudeD = 1.484422229745332366961;            // for web mercator projection
 
-const float cutoffLatitudeF = 1.484422229745332366961F;            // for web mercator projection
+// stretchWebMercator in double
+double stretchWebMercatorD(double t) {
+    t = fabs(t) < cutoffLatitudeD ? t : copysign(cutoffLatitudeD, t);
+    return 2.0 * atanh(tan(.5 * t)) * cutoffLatitudeD / PID;
+}
 
-unsigned __stdcall rasterF(void* data) {
+unsigned __stdcall rasterFWithLighting(void* data) {
     threadData* tData = (threadData*)data;
     int yStart = tData->yStart;
     int yEnd = tData->yEnd;
     hashmap* imgQueue = hashmap_create();
+    long long queuedPixels = 0;                                         // accounted once rastered, see noteQueue
+    long long queueKeyBytes = 0;
+    long long queuedParts = 0;
     tData->rastering = 1;
     rastered = 0;
     notScheduled = 1;
@@ -1520,7 +4430,7 @@ unsigned __stdcall rasterF(void* data) {
             if (angles.t != 2.0F) {
                 float amount = pow(2, zoom);
                 float xTile = angles.p * amount / PIDoubleF;
-                angles.t = stretchWebMercatorF(angles.t);
+                angles.t = fastStretch(angles.t, projectionTier);
                 angles.t = fabsf(angles.t) < cutoffLatitudeF ? angles.t : copysignf(cutoffLatitudeF, angles.t);
                 float yTile = (angles.t - -cutoffLatitudeF - .0001F) * amount / (2.0F * cutoffLatitudeF);            // - .0001 = prevent exact 1 as result (values in image are [0,1), [ = including, ) = excluding )
                 int tileX = (int)xTile;                                                 // (int) floors towards 0
@@ -1595,7 +4505,8 @@ unsigned __stdcall rasterF(void* data) {
                     p.sourceY = iYTile;
                     p.targetX = x;
                     p.targetY = y;
-                    pickPixel(&p, (unsigned char*)result);
+                    pickPixelWithLighting(&p, (unsigned char*)result);
+                    noteTileUse(tData, (unsigned char*)result, id, length);
                     continue;
                 }
                 else {
@@ -1641,7 +4552,7 @@ unsigned __stdcall rasterF(void* data) {
                                     p.sourceY = (int)((yTile - tileY) * rasterTileSize);
                                     p.targetX = x;
                                     p.targetY = y;
-                                    pickPixel(&p, (unsigned char*)result);
+                                    pickPixelWithLighting(&p, (unsigned char*)result);
                                     picked = 1;
                                 }
                             }
@@ -1653,7 +4564,10 @@ unsigned __stdcall rasterF(void* data) {
                             break;
                     }
                     if (!picked) {
-                        memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)zero3, 3);
+                        unsigned char rgb[3];
+                        memcpy((void*)rgb, (void*)zero3, 3);
+                        lightPixel(x, y, rgb);
+                        memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)rgb, 3);
                     }
 
                     if (imgQueue != NULL) {
@@ -1670,6 +4584,7 @@ unsigned __stdcall rasterF(void* data) {
                                     l->p = p;
                                     l->l = (link*)result;
                                     hashmap_set(imgQueue, (void*)id, length, (uintptr_t)l);
+                                    ++queuedPixels;
                                     continue;
                                 }
                                 else {
@@ -1699,8 +4614,9 @@ unsigned __stdcall rasterF(void* data) {
                                                 idData* newRequest = malloc(sizeof(idData));
                                                 if (newRequest == NULL) {
                                                     free(pId);
-                                                    goto LIKE_LNULLF;
+                                                    goto LIKE_LNULLFWL;
                                                 }
+                                                noteAllocated(MEMORY_REQUEST_CHAINS, sizeof(idData));
                                                 newRequest->next = NULL;
                                                 lastRequest = request;
                                                 request = newRequest;
@@ -1709,17 +4625,22 @@ unsigned __stdcall rasterF(void* data) {
                                         }
                                         memcpy(request->id, id, length + 1);
                                         request->idLength = length;
+                                        request->upgrade = 0;
                                         if (lastRequest != NULL) {
                                             lastRequest->next = request;
                                         }
                                         memcpy(pId, id, length);
                                         hashmap_set(imgQueue, (void*)pId, length, (uintptr_t)l);
+                                        ++queuedPixels;
+                                        queueKeyBytes += length;
+                                        ++queuedParts;
                                         queued = 1;
                                         tData->imageRequestRequested = 1;
+                                        wakeCollector();
                                         continue;
                                     }
                                     else {
-LIKE_LNULLF:
+LIKE_LNULLFWL:
                                         free(l);
                                         free(p);
                                     }
@@ -1733,533 +4654,1320 @@ LIKE_LNULLF:
                 }
             }
             else {
-                memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)zero3, 3);
+                memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)zero3, 3);
+            }
+        }
+    }
+    //memcpy(((unsigned char*)region) + yStart * pitch, ((unsigned char*)buffer) + yStart * pitch, pitch * (yEnd - yStart));                            // copy all once in main thread appears to be faster than copy parts parallely from threads
+    if (tData->lastQueue != NULL) {
+        hashmap_iterate(tData->lastQueue, clearQueue, NULL);
+        hashmap_free(tData->lastQueue);
+        noteFreed(MEMORY_QUEUES, tData->lastQueueBytes);
+    }
+    tData->lastQueue = imgQueue;
+    noteQueue(tData, queuedPixels, queueKeyBytes, queuedParts);
+    tData->rastering = 0;
+    signalProgress();
+    return 0;
+}
+
+unsigned __stdcall rasterCompletion(void* data) {
+    threadData* tData = (threadData*)data;
+    if (tData->lastQueue != NULL) {
+        hashmap_iterate(tData->lastQueue, pickPixels, NULL);
+        hashmap_free(tData->lastQueue);
+        noteFreed(MEMORY_QUEUES, tData->lastQueueBytes);
+        //int yStart = tData->yStart;
+        //int yEnd = tData->yEnd;
+        //memcpy(((unsigned char*)region) + yStart * pitch, ((unsigned char*)buffer) + yStart * pitch, pitch * (yEnd - yStart));                        // copy all once in main thread appears to be faster than copy parts parallely from threads
+        tData->lastQueue = NULL;
+    }
+    signalProgress();
+    return 0;
+}
+
+const float maxRElevate = 0.2F;
+const float elevationExaggeration = 40.0F;
+
+void copyPixel(int sourceX, int sourceY, int destX, int destY) {
+    memcpy((void*)(((unsigned char*)buffer) + (destY * pitch + destX * 3)), (void*)(((unsigned char*)buffer) + (sourceY * pitch + sourceX * 3)), 3);
+}
+
+// sourceX, sourceY is x3, y3
+void paintTriangle(int x1, int y1, int x2, int y2, int sourceX, int sourceY) {
+    int yTop = min(min(y1, y2), sourceY);
+    int yBottom = max(max(y1, y2), sourceY);
+    int yMiddle = yTop == y1 ? (yBottom == y2 ? sourceY : y2) : (yTop == y2 ? (yBottom == y1 ? sourceY : y1) : (yBottom == y2 ? y1 : y2));
+    int yTopX = yTop == y1 ? x1 : (yTop == y2 ? x2 : sourceX);
+    int yBottomX = yBottom == y1 ? x1 : (yBottom == y2 ? x2 : sourceX);
+    int yMiddleX = yMiddle == y1 ? x1 : (yMiddle == y2 ? x2 : sourceX);
+    if (yMiddle > yTop) {
+        if(yTop >= 0 && yTop < HEIGHT && yTopX >= 0 && yTopX < WIDTH)
+            copyPixel(sourceX, sourceY, yTopX, yTop);
+        float m1 = ((float)(yMiddleX - yTopX)) / (yMiddle - yTop);
+        float m2 = ((float)(yBottomX - yTopX)) / (yBottom - yTop);
+        int start;
+        int end;
+        int* lower;
+        int* upper;
+        if (yBottomX > yTopX + m1 * (yBottom - yTop)) {
+            lower = &start;
+            upper = &end;
+        }
+        else {
+            lower = &end;
+            upper = &start;
+        }
+        int maxy = (yMiddle < HEIGHT ? yMiddle + 1 : HEIGHT) - yTop;
+        for (int y = yTop >= 0 ? 1 : -yTop; y < maxy; ++y) {
+            start = yTopX + m1 * y;
+            end = yTopX + m2 * y;
+            int maxbound = *upper < WIDTH ? *upper + 1 : WIDTH;
+            for (int l = *lower >= 0 ? (*lower < WIDTH ? *lower : (WIDTH - 1)) : 0; l < maxbound; ++l) {
+                copyPixel(sourceX, sourceY, l, yTop + y);
+            }
+        }
+        if (yBottom > yMiddle) {
+            float m3 = ((float)(yBottomX - yMiddleX)) / (yBottom - yMiddle);
+            int maxy = (yBottom < HEIGHT ? yBottom + 1 : HEIGHT) - yMiddle;
+            for (int y = yMiddle >= 0 ? 1 : -yMiddle; y < maxy; ++y) {
+                start = yMiddleX + m3 * y;
+                end = yTopX + m2 * (yMiddle - yTop + y);
+                int maxbound = *upper < WIDTH ? *upper + 1 : WIDTH;
+                for (int l = *lower >= 0 ? (*lower < WIDTH ? *lower : (WIDTH - 1)) : 0; l < maxbound; ++l) {
+                    copyPixel(sourceX, sourceY, l, yMiddle + y);
+                }
+            }
+        }
+    }
+    else {
+        if (yTop >= 0 && yTop < HEIGHT) {
+            int lower;
+            int upper;
+            if (yTopX > yMiddleX) {
+                lower = yMiddleX >= 0 ? (yMiddleX < WIDTH ? yMiddleX : WIDTH - 1) : 0;
+                upper = yTopX < WIDTH ? yTopX + 1 : WIDTH;
+            }
+            else {
+                lower = yTopX >= 0 ? (yTopX < WIDTH ? yTopX : WIDTH - 1) : 0;
+                upper = yMiddleX < WIDTH ? yMiddleX + 1 : WIDTH;
+            }
+            for (int l = lower; l < upper; ++l) {
+                copyPixel(sourceX, sourceY, l, yTop);
+            }
+        }
+        if (yBottom > yMiddle) {
+            float m2 = ((float)(yBottomX - yTopX)) / (yBottom - yTop);
+            float m3 = ((float)(yBottomX - yMiddleX)) / (yBottom - yMiddle);
+            int start;
+            int end;
+            int* lower;
+            int* upper;
+            if (yTopX > yMiddleX) {
+                lower = &start;
+                upper = &end;
+            }
+            else {
+                lower = &end;
+                upper = &start;
+            }
+            int maxy = (yBottom < HEIGHT ? yBottom + 1 : HEIGHT) - yMiddle;
+            for (int y = yMiddle >= 0 ? 1 : -yMiddle; y < maxy; ++y) {
+                start = yMiddleX + m3 * y;
+                end = yTopX + m2 * y;
+                int maxbound = *upper < WIDTH ? *upper + 1 : WIDTH;
+                for (int l = *lower >= 0 ? (*lower < WIDTH ? *lower : WIDTH - 1) : 0; l < maxbound; ++l) {
+                    copyPixel(sourceX, sourceY, l, yMiddle + y);
+                }
+            }
+        }
+        else {
+            if (yTop >= 0 && yTop < HEIGHT) {
+                int lower = 0;
+                int upper = 0;
+                if (yTopX > yMiddleX) {
+                    if (yBottomX > yTopX) {
+                        lower = (yTopX + 1) >= 0 ? (yTopX + 1) < WIDTH ? (yTopX + 1) : (WIDTH - 1) : 0;
+                        upper = yBottomX < WIDTH ? yBottomX + 1 : WIDTH;
+                    }
+                    else if (yBottomX < yMiddleX) {
+                        lower = yBottomX >= 0 ? yBottomX < WIDTH ? yBottomX : (WIDTH - 1) : 0;
+                        upper = yMiddleX < WIDTH ? yMiddleX : WIDTH;
+                    }
+                }
+                else {
+                    if (yBottomX > yMiddleX) {
+                        lower = (yMiddleX + 1) >= 0 ? (yMiddleX + 1) < WIDTH ? (yMiddleX + 1) : (WIDTH - 1) : 0;
+                        upper = yBottomX < WIDTH ? yBottomX + 1 : WIDTH;
+                    }
+                    else if (yBottomX < yTopX) {
+                        lower = yBottomX >= 0 ? yBottomX < WIDTH ? yBottomX : (WIDTH - 1) : 0;
+                        upper = yTopX < WIDTH ? yTopX : WIDTH;
+                    }
+                }
+                for (int l = lower; l < upper; ++l) {
+                    copyPixel(sourceX, sourceY, l, yTop);
+                }
+            }
+        }
+    }
+}
+
+void putElevation(int xC, int yC/*, int r*/) {
+    int x = centerX + xC;
+    int y = centerY + yC;
+    ptF gAngles = atF(x, y);
+    if (gAngles.t != 2.0F) {
+        //float a = 1.0F / (1.0F - maxRElevate);                        // outcommented smooth transition to non-elevation
+        //float f = a * r / roundf(rScaleF) - maxRElevate * a;
+        int16_t h = *((int16_t*)(elevationData + (((int)((gAngles.t - -PIHalfF - .0001F) / PIF * 1080)) * 2160 + (int)(gAngles.p / PIDoubleF * 2160)) * 2));
+        float RNew = rScaleF * (1.0F + /*(pow(2, maxZoomLighting - 1 - zoom) - 1) * f **/ elevationExaggeration * h / 6378000.0F);
+        ptF sAngles = atFWithoutOffsets(x, y);                          // when gAngles on globe, so are sAngles expected to be on globe
+        float sint = fastSin(sAngles.t, projectionTier);
+        int nX = centerX + roundf(RNew * sqrtf(1.0f - sint * sint) * fastCos(sAngles.p + PIF, projectionTier));
+        int nY = centerY + roundf(RNew * sint);
+        int s = xC * yC > 0 ? 1 : -1;                                   // omitting xC, yC == 0
+        ptF sAngles2 = atFWithoutOffsets(x - .4F, y + s * .4F);         // .5 which is the theroretical limit creates pixel smearing for small triangles due to points being rounded to neighbouring pixel, so does .425 slightly
+        if (sAngles2.t != 2.0F) {
+            float sint = fastSin(sAngles2.t, projectionTier);
+            int nX2 = centerX + roundf(RNew * sqrtf(1.0f - sint * sint) * fastCos(sAngles2.p + PIF, projectionTier));
+            int nY2 = centerY + roundf(RNew * sint);
+            paintTriangle(nX, nY, nX2, nY2, x, y);
+        }
+        ptF sAngles3 = atFWithoutOffsets(x + .4F, y - s * .4F);
+        if (sAngles3.t != 2.0F) {
+            float sint = fastSin(sAngles3.t, projectionTier);
+            int nX3 = centerX + roundf(RNew * sqrtf(1.0f - sint * sint) * fastCos(sAngles3.p + PIF, projectionTier));
+            int nY3 = centerY + roundf(RNew * sint);
+            paintTriangle(nX, nY, nX3, nY3, x, y);
+        }
+    }
+}
+
+void elevate() {
+    int R = roundf(rScaleF);
+    int maxR = roundf(maxRElevate * R);
+    for (int r = R; r > maxR; --r) {
+        if(centerX - r >= 0 && HEIGHT > 0)
+            putElevation(-r, 0/*, r*/);
+        int lastY = 0;
+        int maxX = 1 < (WIDTH - centerX) ? 1 : (WIDTH - centerX);
+        for (int x = (centerX - r + 1) >= 0 ? (-r + 1) : (-centerX + 1); x < maxX; ++x) {
+            int y = roundf(sqrtf(r * r - x * x));
+            if (centerY - y >= 0)
+                putElevation(x, -y/*, r*/);
+            if (centerY + y < HEIGHT)
+                putElevation(x, y/*, r*/);
+            int a = (y - lastY) / 2;                                    // integers! is equal to ceil((y - lastY - 1) / 2)
+            if (centerY + y - 1 < HEIGHT && centerY - (y - 1) >= 0) {
+                for (int c = 1; c <= a; ++c) {
+                    putElevation(x - 1, lastY + c/*, r*/);
+                    putElevation(x - 1, -(lastY + c)/*, r*/);
+                    putElevation(x, y - c/*, r*/);
+                    putElevation(x, -(y - c)/*, r*/);
+                }
+            }
+            else {
+                for (int c = 1; c <= a; ++c) {
+                    if (centerY + lastY + c < HEIGHT)
+                        putElevation(x - 1, lastY + c/*, r*/);
+                    if (centerY - (lastY + c) >= 0)
+                        putElevation(x - 1, -(lastY + c)/*, r*/);
+                    if (centerY + y - c < HEIGHT)
+                        putElevation(x, y - c/*, r*/);
+                    if (centerY - (y - c) >= 0)
+                        putElevation(x, -(y - c)/*, r*/);
+                }
+            }
+            lastY = y;
+        }
+        maxX = r < (WIDTH - centerX) ? r + 1 : (WIDTH - centerX);
+        for (int x = 1; x < maxX; ++x) {
+            int y = roundf(sqrtf(r * r - x * x));
+            if (centerY - y >= 0)
+                putElevation(x, -y/*, r*/);
+            if (centerY + y < HEIGHT)
+                putElevation(x, y/*, r*/);
+            int a = (lastY - y) / 2;                                    // integers! is equal to ceil((y - lastY - 1) / 2)
+            if (centerY + lastY - 1 < HEIGHT && centerY - (lastY - 1) >= 0) {
+                for (int c = 1; c <= a; ++c) {
+                    putElevation(x - 1, lastY - c/*, r*/);
+                    putElevation(x - 1, -(lastY - c)/*, r*/);
+                    putElevation(x, y + c/*, r*/);
+                    putElevation(x, -(y + c)/*, r*/);
+                }
+            }
+            else {
+                for (int c = 1; c <= a; ++c) {
+                    if (centerY + lastY - c < HEIGHT)
+                        putElevation(x - 1, lastY - c/*, r*/);
+                    if (centerY - (lastY - c) >= 0)
+                        putElevation(x - 1, -(lastY - c)/*, r*/);
+                    if (centerY + y + c < HEIGHT)
+                        putElevation(x, y + c/*, r*/);
+                    if (centerY - (y + c) >= 0)
+                        putElevation(x, -(y + c)/*, r*/);
+                }
             }
+            lastY = y;
         }
     }
-    //memcpy(((unsigned char*)region) + yStart * pitch, ((unsigned char*)buffer) + yStart * pitch, pitch * (yEnd - yStart));                            // copy all once in main thread appears to be faster than copy parts parallely from threads
+}
+
+unsigned __stdcall rasterCompletionWithLighting(void* data) {
+    threadData* tData = (threadData*)data;
     if (tData->lastQueue != NULL) {
-        hashmap_iterate(tData->lastQueue, clearQueue, NULL);
+        hashmap_iterate(tData->lastQueue, pickPixelsWithLighting, NULL);
         hashmap_free(tData->lastQueue);
+        noteFreed(MEMORY_QUEUES, tData->lastQueueBytes);
+        //int yStart = tData->yStart;
+        //int yEnd = tData->yEnd;
+        //memcpy(((unsigned char*)region) + yStart * pitch, ((unsigned char*)buffer) + yStart * pitch, pitch * (yEnd - yStart));                        // copy all once in main thread appears to be faster than copy parts parallely from threads
+        tData->lastQueue = NULL;
     }
-    tData->lastQueue = imgQueue;
-    tData->rastering = 0;
+    signalProgress();
     return 0;
 }
 
-unsigned __stdcall rasterFWithLighting(void* data) {
-    threadData* tData = (threadData*)data;
-    int yStart = tData->yStart;
-    int yEnd = tData->yEnd;
-    hashmap* imgQueue = hashmap_create();
-    tData->rastering = 1;
-    rastered = 0;
-    notScheduled = 1;
-    for (int y = yStart; y < yEnd; ++y) {
-        for (int x = 0; x < WIDTH; ++x) {
-            ptF angles = atF(x, y);
-            if (angles.t != 2.0F) {
-                float amount = pow(2, zoom);
-                float xTile = angles.p * amount / PIDoubleF;
-                angles.t = stretchWebMercatorF(angles.t);
-                angles.t = fabsf(angles.t) < cutoffLatitudeF ? angles.t : copysignf(cutoffLatitudeF, angles.t);
-                float yTile = (angles.t - -cutoffLatitudeF - .0001F) * amount / (2.0F * cutoffLatitudeF);            // - .0001 = prevent exact 1 as result (values in image are [0,1), [ = including, ) = excluding )
-                int tileX = (int)xTile;                                                 // (int) floors towards 0
-                int tileY = (int)yTile;
-                char id[25];                                                            // maximum length of id incl. \0 at maximum zoom of 30
-                int length = sprintf_s(id, 25, idFormat, zoom, tileX, tileY);
-                if (length == 0) {
-                    length = 5;
-                    strcpy(id, "0/0/0");
-                    xTile = angles.p / PIDoubleF;
-                    if (xTile < 0.0F) {
-                        xTile = 0.0F;
-                    }
-                    else if (xTile >= 1.0F) {
-                        xTile = .9999F;
-                    }
-                    yTile = (angles.t - -cutoffLatitudeF - .0001F) / (2.0F * cutoffLatitudeF);
-                    if (yTile < 0.0F) {
-                        yTile = 0.0F;
-                    }
-                    else if (yTile >= 1.0F) {
-                        yTile = .9999F;
+// on-screen figures of performance, toggled with H, drawn into the texture only while shown
+
+#define HUD_LINES 7
+#define HUD_LINE_LENGTH 128
+#define HUD_SCALE 2                             // screen pixels per pixel of a glyph
+
+const char hudCharacters[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ.:%/-()";
+const unsigned short hudGlyphs[] = {            // 3x5, an octal digit per row from the top, its highest bit left
+    075557, 026227, 071747, 071317, 055711, 074717, 074757, 071111, 075757, 075717,
+    025755, 065656, 034443, 065556, 074647, 074644, 034553, 055755, 072227, 011152, 055655, 044447, 057755,
+    065555, 025552, 065644, 025563, 065655, 034216, 072222, 055557, 055552, 055775, 055255, 055222, 071247,
+    000002, 002020, 051245, 011244, 000700, 012221, 042224
+};
+
+typedef struct HudFigures {
+    double raster;                              // milliseconds from launching the rasterizers until all are done
+    double completion;                          // from launching the completion until all queued pixels are picked
+    double elevate;
+    double present;                             // of the frame before, from copying it to the texture until presented
+    int presents;                               // since secondStarted
+    int framesPerSecond;                        // presented in the second before
+    long long secondStarted;
+    long long lookups;                          // of the map part directory until the last frame
+    long long lookupHits;
+    double directoryHits;                       // percent of the lookups of the last frame
+} hudFigures;
+
+int hud = 0;                                    // toggled with H
+hudFigures hudFrame;
+LARGE_INTEGER hudFrequency;
+
+long long hudTicks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+double hudMilliseconds(long long since) {
+    return (hudTicks() - since) * 1000.0 / hudFrequency.QuadPart;
+}
+
+void noteRastered(long long rasterStarted) {
+    hudFrame.raster = hudMilliseconds(rasterStarted);
+    hudFrame.completion = 0.0;
+    long long lookups = rasterLookups;
+    long long lookupHits = rasterLookupHits;
+    hudFrame.directoryHits = lookups > hudFrame.lookups ? 100.0 * (lookupHits - hudFrame.lookupHits) / (lookups - hudFrame.lookups) : 100.0;
+    hudFrame.lookups = lookups;
+    hudFrame.lookupHits = lookupHits;
+}
+
+void notePresent(long long presentStarted) {
+    long long now = hudTicks();
+    hudFrame.present = (now - presentStarted) * 1000.0 / hudFrequency.QuadPart;
+    ++hudFrame.presents;
+    if (now - hudFrame.secondStarted >= hudFrequency.QuadPart) {
+        hudFrame.framesPerSecond = (int)(hudFrame.presents * hudFrequency.QuadPart / (now - hudFrame.secondStarted));
+        hudFrame.presents = 0;
+        hudFrame.secondStarted = now;
+    }
+}
+
+void drawHudLine(int line, const char* text) {
+    int yStart = HUD_SCALE * (2 + line * 6);
+    for (int i = 0; text[i] != '\0'; ++i) {
+        char c = text[i] >= 'a' && text[i] <= 'z' ? text[i] - 'a' + 'A' : text[i];
+        const char* found = c != ' ' ? strchr(hudCharacters, c) : NULL;
+        if (found == NULL) {
+            continue;
+        }
+        unsigned short glyph = hudGlyphs[found - hudCharacters];
+        int xStart = HUD_SCALE * (2 + i * 4);
+        for (int row = 0; row < 5; ++row) {
+            for (int column = 0; column < 3; ++column) {
+                if (((glyph >> ((4 - row) * 3 + 2 - column)) & 1) == 0) {
+                    continue;
+                }
+                for (int y = yStart + row * HUD_SCALE; y < yStart + (row + 1) * HUD_SCALE && y < HEIGHT; ++y) {
+                    for (int x = xStart + column * HUD_SCALE; x < xStart + (column + 1) * HUD_SCALE && x < WIDTH; ++x) {
+                        memset(((unsigned char*)region) + y * pitch + x * 3, 255, 3);
                     }
-                    tileX = 0;
-                    tileY = 0;
                 }
-                int steps = 0;
-                int iXTile;
-                int iYTile;
-                uintptr_t result;
-                switch (dir) {
-                    case REFRESH:
-                    case ZIN:
-                    case ZOUT:
-                    case SIDE: {
-                        int z = zoom;
-                        float xTileI = xTile;
-                        float yTileI = yTile;
-                        int tileXI = tileX;
-                        int tileYI = tileY;
-                        char newId[25];
-                        char* key = id;
-                        int newLength = length;
-                        uintptr_t newResult;
-                        while (hashmap_get(imgPresent, (void*)key, newLength, &newResult) && newResult != (uintptr_t)NULL) {
-                            result = newResult;
-                            ++steps;
-                            iXTile = (int)((xTileI - tileXI) * rasterTileSize);
-                            iYTile = (int)((yTileI - tileYI) * rasterTileSize);
-                            break;                                                      // no break intended for ZIN, ZOUT, SIDE = get as detailed zoom as available uninterrupted from here but this costs too much framerate on Ryzen 5800X
-                            float amount = pow(2, ++z);
-                            xTileI = angles.p * amount / PIDoubleF;
-                            yTileI = (angles.t - -cutoffLatitudeF - .0001F) * amount / (2.0F * cutoffLatitudeF);
-                            tileXI = (int)xTileI;
-                            tileYI = (int)yTileI;
-                            newLength = sprintf_s(newId, 25, idFormat, z, tileXI, tileYI);
-                            if (newLength == 0) {
-                                break;
-                            }
-                            key = newId;
+            }
+        }
+    }
+}
+
+// draws the figures into the locked texture on a darkened box, after the frame was copied to it
+void drawHud() {
+    char lines[HUD_LINES][HUD_LINE_LENGTH];
+    loadSources counted = loads;
+    long long requested = counted.coldTier + counted.decodedCache + counted.jpegCache + counted.mapService;
+    int lighting = zoomF + zoomOffset < maxZoomLighting;
+    sprintf_s(lines[0], HUD_LINE_LENGTH, "%d fps  raster %.1f  completion %.1f  elevate %.1f  present %.1f ms", hudFrame.framesPerSecond, hudFrame.raster, hudFrame.completion, hudFrame.elevate, hudFrame.present);
+    sprintf_s(lines[1], HUD_LINE_LENGTH, "zoom %d (%.2f)  %s  %s  %s  math %s", zoom, zoomF, lighting ? "lighting" : (forwardRastering ? "forward" : "per pixel"), gridInterpolation ? "grid" : "exact", levelOfDetail ? "lod" : "no lod", fastMathTierNames[projectionTier]);
+    sprintf_s(lines[2], HUD_LINE_LENGTH, "map parts %d resident  %d cold  %ld pending  %ld http (%ld prefetch)", tilesInUse, coldStats.residents, requestsPending, downloadsInFlight, prefetchesInFlight);
+    sprintf_s(lines[3], HUD_LINE_LENGTH, "directory %.1f%%  cached %.1f%%: %lld cold %lld decoded %lld jpeg %lld http", hudFrame.directoryHits, requested > 0 ? 100.0 * (requested - counted.mapService) / requested : 100.0, counted.coldTier, counted.decodedCache, counted.jpegCache, counted.mapService);
+    sprintf_s(lines[4], HUD_LINE_LENGTH, "memory %lld/%lld mib  cold %lld mib", tileBytesInUse >> 20, tileMemoryBudget >> 20, coldStats.bytes >> 20);
+    for (int i = 0; i < MEMORY_CATEGORIES; ++i) {                       // in use and at most, KiB
+        char* line = lines[5 + i / 3];
+        size_t length = i % 3 == 0 ? 0 : strlen(line);
+        sprintf_s(line + length, HUD_LINE_LENGTH - length, "%s%s %lld/%lld kib", i % 3 == 0 ? "" : "  ", memoryCategoryNames[i], memoryAccounts[i].bytes >> 10, memoryAccounts[i].highWater >> 10);
+    }
+    int longest = 0;
+    for (int i = 0; i < HUD_LINES; ++i) {
+        longest = max(longest, (int)strlen(lines[i]));
+    }
+    int boxWidth = min(HUD_SCALE * (3 + longest * 4), WIDTH);
+    int boxHeight = min(HUD_SCALE * (3 + HUD_LINES * 6), HEIGHT);
+    for (int y = 0; y < boxHeight; ++y) {
+        unsigned char* line = ((unsigned char*)region) + y * pitch;
+        for (int x = 0; x < boxWidth * 3; ++x) {
+            line[x] >>= 2;
+        }
+    }
+    for (int i = 0; i < HUD_LINES; ++i) {
+        drawHudLine(i, lines[i]);
+    }
+}
+
+
+ptD atDFor(int x, int y, double phiLeftD, double axisTiltD, double rScaleD)
+{
+    int xC = x - centerX;
+    int yC = y - centerY;
+    double rScaleSqrD = rScaleD * rScaleD;
+    double r2Sqr = rScaleSqrD - xC * xC;
+    if (yC * yC <= r2Sqr)
+    {
+        if (r2Sqr > 0.0)
+        {
+            double r2Sqrt = sqrt(r2Sqr);
+            double yC2 = yC / r2Sqrt;
+            double cAT = cos(axisTiltD);
+            double ySpace = r2Sqrt * (yC2 * cAT - copysign(sqrt((1.0 - yC2 * yC2) * (1.0 - cAT * cAT)), axisTiltD));                     // == r2Sqrt * sin(asin(yC / r2Sqrt) - axisTiltD);
+            double r2ScAT = r2Sqrt * cAT;
+            double r3Sqr = rScaleSqrD - ySpace * ySpace;
+            ptD value;
+            value.p = fmod(phiLeftD + (((axisTiltD > 0.0 && -yC > r2ScAT) || (axisTiltD < 0.0 && yC > r2ScAT)) ? -1.0 : 1.0) * (r3Sqr > 0.0 ? sqrt(r3Sqr) > abs(xC) ? acos(-xC / sqrt(r3Sqr)) : (PIHalfD + copysign(PIHalfD, xC)) : PIHalfD) + PIDoubleD, PIDoubleD);
+            value.t = asin(ySpace / rScaleD);
+            return value;
+        }
+        else
+        {
+            ptD value;
+            value.p = fmod(phiLeftD + (xC > 0 ? PID : 0.0) + PIDoubleD, PIDoubleD);
+            value.t = 0.0;
+            return value;
+        }
+    }
+    ptD value;
+    value.p = 0.0;
+    value.t = 2.0;
+    return value;
+}
+
+// same map part x and y as the rasterizers determine for angles on the globe
+void tileAt(ptD angles, int z, int* x, int* y) {
+    double amount = pow(2, z);
+    double xTile = angles.p * amount / PIDoubleD;
+    angles.t = stretchWebMercatorD(angles.t);
+    angles.t = fabs(angles.t) < cutoffLatitudeD ? angles.t : copysign(cutoffLatitudeD, angles.t);
+    double yTile = (angles.t - -cutoffLatitudeD - .0001) * amount / (2.0 * cutoffLatitudeD);
+    *x = (int)xTile;
+    *y = (int)yTile;
+}
+
+// same map part id as the rasterizers determine for angles on the globe
+int getTileId(ptD angles, int z, char* id) {
+    int x, y;
+    tileAt(angles, z, &x, &y);
+    int length = sprintf_s(id, 25, idFormat, z, x, y);
+    if (length == 0) {
+        length = 5;
+        strcpy(id, "0/0/0");
+    }
+    return length;
+}
+
+// Globe --check-projection: time per pixel and largest error of the projection kernels against a reference, over zoom levels, window
+// sizes and tilts, in texels, or in pixels where a pixel spans more than a texel, towards the limb and the poles; 1 if an error
+// exceeds half of one at the zoom levels a kernel is used at
+
+#define PROJECTION_KERNELS 8
+#define PROJECTION_ZOOMS 8
+#define PROJECTION_STRIDE 4                     // pixels between sampled ones in x and y
+
+const char* projectionKernelNames[] = { "at", "atD", "atF", "atFWithoutOffsets", "rebased", "getOffsetsFrom", "stretchD", "fastStretch" };
+const int projectionKernelMaxZoom[] = { 30, 30, 3, 3, 30, 30, 30, 3 };                 // used up to, atF and fastStretch only with lighting
+const int projectionZooms[] = { 0, 2, 5, 10, 15, 20, 25, 30 };
+const int projectionWindows[][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+const long double projectionTilts[] = { 0.0L, .6L, -1.1L, 1.45L };
+
+// angles of a pixel on the unit sphere turned by the view, with atan2, which unlike at stays accurate towards the limb
+int referenceAngles(int x, int y, long double phi, long double tilt, pt* angles) {
+    long double u = (x - centerX) / rScale;
+    long double v = (y - centerY) / rScale;
+    long double m = u * u + v * v;
+    if (m > 1.0L) {
+        return 0;
+    }
+    long double c = sqrtl(1.0L - m);
+    long double h = v * sinl(tilt) + c * cosl(tilt);                                    // towards the centre's meridian, negative beyond a pole
+    angles->p = fmodl(phi + atan2l(h, -u) + 2.0L * PIDouble, PIDouble);
+    angles->t = atan2l(v * cosl(tilt) - c * sinl(tilt), sqrtl(u * u + h * h));
+    return 1;
+}
+
+// texel of angles at zoom level z, as the rasterizers determine it, see tileAt
+void referenceTexel(pt angles, int z, long double* xTexel, long double* yTexel) {
+    long double amount = powl(2, z) * rasterTileSize;
+    long double t = stretchWebMercator(angles.t);
+    *xTexel = angles.p * amount / PIDouble;
+    *yTexel = (t - -cutoffLatitude - .0001L) * amount / (2.0L * cutoffLatitude);
+}
+
+// difference of texels, across the map's left and right edge the shorter way
+long double texelError(long double xTexel, long double yTexel, long double xReference, long double yReference, int z) {
+    long double width = powl(2, z) * rasterTileSize;
+    long double dx = fmodl(fabsl(xTexel - xReference), width);
+    return fmaxl(fminl(dx, width - dx), fabsl(yTexel - yReference));
+}
+
+// at zoom level z rather than the one determineZoom chooses, so the texels compared are the same at every tilt
+void setProjectionView(int width, int height, long double phi, long double tilt, long double scale, int z) {
+    WIDTH = width;
+    HEIGHT = height;
+    centerX = WIDTH / 2;
+    centerY = HEIGHT / 2;
+    phiLeft = phi;
+    axisTilt = tilt;
+    rScale = scale;
+    rScaleSqr = rScale * rScale;
+    phiLeftD = phiLeft;
+    axisTiltD = axisTilt;
+    rScaleD = rScale;
+    rScaleSqrD = rScaleSqr;
+    phiLeftF = phiLeft;
+    axisTiltF = axisTilt;
+    rScaleF = rScale;
+    rScaleSqrF = rScaleSqr;
+    determineZoom();
+    zoom = z;
+    zoomF = z;
+    determineProjectionTier();
+}
+
+// texels a pixel spans at most towards its right and lower neighbour, at least 1
+long double referenceFootprint(int x, int y, long double phi, long double tilt, long double xTexel, long double yTexel) {
+    long double footprint = 1.0L;
+    for (int neighbour = 0; neighbour < 2; ++neighbour) {
+        pt angles;
+        long double xNeighbour, yNeighbour;
+        if (referenceAngles(x + 1 - neighbour, y + neighbour, phi, tilt, &angles)) {
+            referenceTexel(angles, zoom, &xNeighbour, &yNeighbour);
+            footprint = fmaxl(footprint, texelError(xNeighbour, yNeighbour, xTexel, yTexel, zoom));
+        }
+    }
+    return footprint;
+}
+
+int checkProjection() {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    const int windows = sizeof(projectionWindows) / sizeof(projectionWindows[0]);
+    const int tilts = sizeof(projectionTilts) / sizeof(projectionTilts[0]);
+    const long double phi = 1.0L;
+    int samplesMax = (projectionWindows[windows - 1][0] / PROJECTION_STRIDE + 1) * (projectionWindows[windows - 1][1] / PROJECTION_STRIDE + 1);
+    pt* reference = malloc(samplesMax * sizeof(pt));
+    long double* footprints = malloc(samplesMax * sizeof(long double));
+    long double* result = malloc(2 * samplesMax * sizeof(long double));
+    if (reference == NULL || footprints == NULL || result == NULL) {
+        free(reference);
+        free(footprints);
+        free(result);
+        fprintf(stderr, "failed allocating required memory\n");
+        return 1;
+    }
+    double nanoseconds[PROJECTION_KERNELS][PROJECTION_ZOOMS];
+    double maxError[PROJECTION_KERNELS][PROJECTION_ZOOMS];
+    for (int zi = 0; zi < PROJECTION_ZOOMS; ++zi) {
+        long long ticks[PROJECTION_KERNELS] = { 0 };
+        long long calls[PROJECTION_KERNELS] = { 0 };
+        for (int kernel = 0; kernel < PROJECTION_KERNELS; ++kernel) {
+            maxError[kernel][zi] = 0.0;
+        }
+        for (int wi = 0; wi < windows; ++wi) {
+            for (int ti = 0; ti < tilts; ++ti) {
+                long double tilt = projectionTilts[ti];
+                setProjectionView(projectionWindows[wi][0], projectionWindows[wi][1], phi, tilt, .9L * rasterTileSize * powl(2, projectionZooms[zi]) / PIDouble, projectionZooms[zi]);
+                rebasedView view;
+                rebaseView(&view);
+                int count = 0;
+                for (int y = 0; y < HEIGHT; y += PROJECTION_STRIDE) {
+                    for (int x = 0; x < WIDTH; x += PROJECTION_STRIDE) {
+                        if (referenceAngles(x, y, phi, tilt, &(reference[count]))) {
+                            long double xReference, yReference;
+                            referenceTexel(reference[count], zoom, &xReference, &yReference);
+                            footprints[count] = referenceFootprint(x, y, phi, tilt, xReference, yReference);
                         }
-                        break;
+                        else {
+                            reference[count].t = 2.0L;
+                        }
+                        ++count;
                     }
-                    case INIT:
-                    default:
-                        break;
-                }
-                if (steps > 0)
-                {
-                    pixel p;
-                    p.sourceX = iXTile;
-                    p.sourceY = iYTile;
-                    p.targetX = x;
-                    p.targetY = y;
-                    pickPixelWithLighting(&p, (unsigned char*)result);
-                    continue;
                 }
-                else {
-                    int iXTile = (int)((xTile - tileX) * rasterTileSize);
-                    int iYTile = (int)((yTile - tileY) * rasterTileSize);
-
-                    int picked = 0;
-                    switch (dir) {
-                        case ZIN:
-                        case SIDE:
-                            if (zoom > 0) {
-                                float amount = pow(2, zoom - 1);
-                                float xTile = angles.p * amount / PIDoubleF;
-                                float yTile = (angles.t - -cutoffLatitudeF - .0001F) * amount / (2.0F * cutoffLatitudeF);
-                                int tileX = (int)xTile;
-                                int tileY = (int)yTile;
-                                char id[25];
-                                int length = sprintf_s(id, 25, idFormat, zoom - 1, tileX, tileY);
-                                if (length == 0) {
-                                    length = 5;
-                                    strcpy(id, "0/0/0");
-                                    xTile = angles.p / PIDoubleF;
-                                    if (xTile < 0.0F) {
-                                        xTile = 0.0F;
-                                    }
-                                    else if (xTile >= 1.0F) {
-                                        xTile = .9999F;
-                                    }
-                                    yTile = (angles.t - -cutoffLatitudeF - .0001F) / (2.0F * cutoffLatitudeF);
-                                    if (yTile < 0.0F) {
-                                        yTile = 0.0F;
+                for (int kernel = 0; kernel < PROJECTION_KERNELS; ++kernel) {
+                    LARGE_INTEGER started, ended;
+                    QueryPerformanceCounter(&started);
+                    int i = 0;
+                    for (int y = 0; y < HEIGHT; y += PROJECTION_STRIDE) {
+                        for (int x = 0; x < WIDTH; x += PROJECTION_STRIDE, ++i) {
+                            long double* texel = result + 2 * i;
+                            texel[0] = OFF_GLOBE;
+                            switch (kernel) {
+                                case 0: {
+                                    pt angles = at(x, y);
+                                    if (angles.t != 2.0L) {
+                                        referenceTexel(angles, zoom, texel, texel + 1);
                                     }
-                                    else if (yTile >= 1.0F) {
-                                        yTile = .9999F;
+                                    break;
+                                }
+                                case 1: {
+                                    ptD angles = atD(x, y);
+                                    if (angles.t != 2.0) {
+                                        double amount = pow(2, zoom) * rasterTileSize;
+                                        double t = stretchWebMercatorD(angles.t);
+                                        texel[0] = angles.p * amount / PIDoubleD;
+                                        texel[1] = (t - -cutoffLatitudeD - .0001) * amount / (2.0 * cutoffLatitudeD);
                                     }
-                                    tileX = 0;
-                                    tileY = 0;
+                                    break;
                                 }
-                                uintptr_t result;
-                                if (hashmap_get(imgPresent, (void*)id, length, &result) && result != (uintptr_t)NULL) {
-                                    pixel p;
-                                    p.sourceX = (int)((xTile - tileX) * rasterTileSize);
-                                    p.sourceY = (int)((yTile - tileY) * rasterTileSize);
-                                    p.targetX = x;
-                                    p.targetY = y;
-                                    pickPixelWithLighting(&p, (unsigned char*)result);
-                                    picked = 1;
+                                case 2: {
+                                    ptF angles = atF(x, y);
+                                    if (angles.t != 2.0F) {
+                                        float amount = powf(2, zoom) * rasterTileSize;
+                                        float t = fastStretch(angles.t, projectionTier);
+                                        texel[0] = angles.p * amount / PIDoubleF;
+                                        texel[1] = (t - -cutoffLatitudeF - .0001F) * amount / (2.0F * cutoffLatitudeF);
+                                    }
+                                    break;
                                 }
-                            }
-                            break;
-                        case ZOUT:
-                        case INIT:
-                        case REFRESH:
-                        default:
-                            break;
-                    }
-                    if (!picked) {
-                        unsigned char rgb[3];
-                        memcpy((void*)rgb, (void*)zero3, 3);
-                        lightPixel(x, y, rgb);
-                        memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)rgb, 3);
-                    }
-
-                    if (imgQueue != NULL) {
-                        pixel* p = malloc(sizeof(pixel));
-                        uintptr_t result;
-                        if (hashmap_get(imgQueue, (void*)id, length, &result)) {
-                            if (p != NULL) {
-                                p->sourceX = iXTile;
-                                p->sourceY = iYTile;
-                                p->targetX = x;
-                                p->targetY = y;
-                                link* l = malloc(sizeof(link));
-                                if (l != NULL) {
-                                    l->p = p;
-                                    l->l = (link*)result;
-                                    hashmap_set(imgQueue, (void*)id, length, (uintptr_t)l);
-                                    continue;
+                                case 3: {
+                                    ptF angles = atFWithoutOffsets(x, y);                   // at phiLeft and axisTilt 0
+                                    if (angles.t != 2.0F) {
+                                        pt wide;
+                                        wide.p = angles.p;
+                                        wide.t = angles.t;
+                                        referenceTexel(wide, zoom, texel, texel + 1);
+                                    }
+                                    break;
                                 }
-                                else {
-                                    free(p);
+                                case 4: {
+                                    rasterPosition position;
+                                    if (rebasedPosition(&view, x, y, &position)) {
+                                        texel[0] = ((long double)view.xOrigin + position.x) * rasterTileSize;
+                                        texel[1] = ((long double)view.yOrigin + position.y) * rasterTileSize;
+                                    }
+                                    break;
                                 }
-                            }
-                        }
-                        else {
-                            if (p != NULL) {
-                                p->sourceX = iXTile;
-                                p->sourceY = iYTile;
-                                p->targetX = x;
-                                p->targetY = y;
-                                link* l = malloc(sizeof(link));
-                                if (l != NULL) {
-                                    l->p = p;
-                                    l->l = NULL;
-                                    char* pId = malloc(length);
-                                    if (pId != NULL) {
-                                        idData* lastRequest = NULL;
-                                        idData* request = &(tData->dId);
-                                        while (request->idLength != 0) {
-                                            if (request->next != NULL) {
-                                                request = request->next;
-                                            }
-                                            else {
-                                                idData* newRequest = malloc(sizeof(idData));
-                                                if (newRequest == NULL) {
-                                                    free(pId);
-                                                    goto LIKE_LNULLFWL;
-                                                }
-                                                newRequest->next = NULL;
-                                                lastRequest = request;
-                                                request = newRequest;
-                                                break;
-                                            }
-                                        }
-                                        memcpy(request->id, id, length + 1);
-                                        request->idLength = length;
-                                        if (lastRequest != NULL) {
-                                            lastRequest->next = request;
+                                case 5: {
+                                    if (reference[i].t != 2.0L) {                               // the view dragged to show the pixel's angles there
+                                        pt offsets = getOffsetsFrom(x, y, reference[i]);
+                                        if (offsets.t != 2.0L) {
+                                            texel[0] = offsets.p;
+                                            texel[1] = offsets.t;
                                         }
-                                        memcpy(pId, id, length);
-                                        hashmap_set(imgQueue, (void*)pId, length, (uintptr_t)l);
-                                        queued = 1;
-                                        tData->imageRequestRequested = 1;
-                                        continue;
                                     }
-                                    else {
-LIKE_LNULLFWL:
-                                        free(l);
-                                        free(p);
+                                    break;
+                                }
+                                case 6: {
+                                    if (reference[i].t != 2.0L) {
+                                        texel[0] = stretchWebMercatorD(reference[i].t);
                                     }
+                                    break;
                                 }
-                                else {
-                                    free(p);
+                                default: {
+                                    if (reference[i].t != 2.0L) {
+                                        texel[0] = fastStretch(reference[i].t, projectionTier);
+                                    }
+                                    break;
+                                }
+                            }
+                        }
+                    }
+                    QueryPerformanceCounter(&ended);
+                    ticks[kernel] += ended.QuadPart - started.QuadPart;
+                    calls[kernel] += count;
+                    long double stretchToTexels = powl(2, zoom) * rasterTileSize / (2.0L * cutoffLatitude);
+                    i = 0;
+                    for (int y = 0; y < HEIGHT; y += PROJECTION_STRIDE) {
+                        for (int x = 0; x < WIDTH; x += PROJECTION_STRIDE, ++i) {
+                            long double* texel = result + 2 * i;
+                            if (reference[i].t == 2.0L || texel[0] == OFF_GLOBE) {              // on the limb, placed off the globe by the kernel
+                                continue;
+                            }
+                            long double xReference, yReference;
+                            long double footprint = footprints[i];
+                            long double error;
+                            if (kernel == 3) {
+                                pt unturned;
+                                referenceAngles(x, y, 0.0L, 0.0L, &unturned);
+                                referenceTexel(unturned, zoom, &xReference, &yReference);
+                                footprint = referenceFootprint(x, y, 0.0L, 0.0L, xReference, yReference);
+                            }
+                            else {
+                                referenceTexel(reference[i], zoom, &xReference, &yReference);
+                            }
+                            if (kernel == 5) {                                                  // the pixel's texel once dragged
+                                pt dragged;
+                                if (!referenceAngles(x, y, texel[0], texel[1], &dragged)) {
+                                    continue;
                                 }
+                                referenceTexel(dragged, zoom, texel, texel + 1);
                             }
+                            if (kernel < 6) {
+                                error = texelError(texel[0], texel[1], xReference, yReference, zoom);
+                            }
+                            else {
+                                error = fabsl(texel[0] - stretchWebMercator(reference[i].t)) * stretchToTexels;
+                            }
+                            maxError[kernel][zi] = fmax(maxError[kernel][zi], (double)(error / footprint));
                         }
                     }
                 }
             }
-            else {
-                memcpy((void*)(((unsigned char*)buffer) + (y * pitch + x * 3)), (void*)zero3, 3);
-            }
+        }
+        for (int kernel = 0; kernel < PROJECTION_KERNELS; ++kernel) {
+            nanoseconds[kernel][zi] = calls[kernel] > 0 ? ticks[kernel] * 1e9 / ((double)frequency.QuadPart * calls[kernel]) : 0.0;
         }
     }
-    //memcpy(((unsigned char*)region) + yStart * pitch, ((unsigned char*)buffer) + yStart * pitch, pitch * (yEnd - yStart));                            // copy all once in main thread appears to be faster than copy parts parallely from threads
-    if (tData->lastQueue != NULL) {
-        hashmap_iterate(tData->lastQueue, clearQueue, NULL);
-        hashmap_free(tData->lastQueue);
+    free(reference);
+    free(footprints);
+    free(result);
+    int failed = 0;
+    printf("%-18s", "ns/pixel, zoom");
+    for (int zi = 0; zi < PROJECTION_ZOOMS; ++zi) {
+        printf("%10d", projectionZooms[zi]);
     }
-    tData->lastQueue = imgQueue;
-    tData->rastering = 0;
-    return 0;
+    printf("\n");
+    for (int kernel = 0; kernel < PROJECTION_KERNELS; ++kernel) {
+        printf("%-18s", projectionKernelNames[kernel]);
+        for (int zi = 0; zi < PROJECTION_ZOOMS; ++zi) {
+            printf("%10.1f", nanoseconds[kernel][zi]);
+        }
+        printf("\n");
+    }
+    printf("\n%-18s", "error, zoom");
+    for (int zi = 0; zi < PROJECTION_ZOOMS; ++zi) {
+        printf("%10d", projectionZooms[zi]);
+    }
+    printf("\n");
+    for (int kernel = 0; kernel < PROJECTION_KERNELS; ++kernel) {
+        printf("%-18s", projectionKernelNames[kernel]);
+        for (int zi = 0; zi < PROJECTION_ZOOMS; ++zi) {
+            int exceeds = projectionZooms[zi] <= projectionKernelMaxZoom[kernel] && maxError[kernel][zi] > .5;
+            failed |= exceeds;
+            printf("%9.2g%c", maxError[kernel][zi], exceeds ? '!' : ' ');
+        }
+        printf("\n");
+    }
+    printf("%s\n", failed ? "errors exceed half a texel where marked by !" : "errors within half a texel at the zoom levels the kernels are used at");
+    return failed;
 }
 
-unsigned __stdcall rasterCompletion(void* data) {
-    threadData* tData = (threadData*)data;
-    if (tData->lastQueue != NULL) {
-        hashmap_iterate(tData->lastQueue, pickPixels, NULL);
-        hashmap_free(tData->lastQueue);
-        //int yStart = tData->yStart;
-        //int yEnd = tData->yEnd;
-        //memcpy(((unsigned char*)region) + yStart * pitch, ((unsigned char*)buffer) + yStart * pitch, pitch * (yEnd - yStart));                        // copy all once in main thread appears to be faster than copy parts parallely from threads
-        tData->lastQueue = NULL;
+// atF against at over tilts near 0, in texels within nine tenths of the globe's radius; atF takes the tilt's sine as
+// sqrtf(1 - cos^2), which turns small errors of the cosine into large ones of the latitude, unseen when checking the cosine alone
+int checkAtFAtSmallTilts() {
+    const long double tilts[] = { 1e-4L, -1e-4L, 1e-3L, -1e-3L, 1e-2L, -1e-2L, .1L, -.1L };
+    const int tiltCount = sizeof(tilts) / sizeof(tilts[0]);
+    int failed = 0;
+    printf("%-10s", "atF tilt");
+    for (int z = 0; z <= 3; ++z) {
+        printf("%10s%d", "zoom ", z);
     }
-    return 0;
+    printf("\n");
+    for (int ti = 0; ti < tiltCount; ++ti) {
+        printf("%-10.0Le", tilts[ti]);
+        for (int z = 0; z <= 3; ++z) {
+            setProjectionView(1280, 720, 1.0L, tilts[ti], .9L * rasterTileSize * powl(2, z) / PIDouble, z);
+            long double maxError = 0.0L;
+            for (int y = 0; y < HEIGHT; y += 2) {
+                for (int x = 0; x < WIDTH; x += 2) {
+                    long double u = (x - centerX) / rScale;
+                    long double v = (y - centerY) / rScale;
+                    if (u * u + v * v > .81L) {
+                        continue;
+                    }
+                    pt exact = at(x, y);
+                    ptF fast = atF(x, y);
+                    if (exact.t == 2.0L || fast.t == 2.0F) {
+                        continue;
+                    }
+                    pt approximated = { fast.p, fast.t };
+                    long double xExact, yExact, xFast, yFast;
+                    referenceTexel(exact, z, &xExact, &yExact);
+                    referenceTexel(approximated, z, &xFast, &yFast);
+                    maxError = fmaxl(maxError, texelError(xFast, yFast, xExact, yExact, z));
+                }
+            }
+            if (maxError > .5L) {
+                failed = 1;
+            }
+            printf("%11.3Lg", maxError);
+        }
+        printf("\n");
+    }
+    printf("%s\n", failed ? "atF errs by more than half a texel at small tilts" : "atF within half a texel at small tilts");
+    return failed;
 }
 
-const float maxRElevate = 0.2F;
-const float elevationExaggeration = 40.0F;
+// seeding: fills the packed cache for a region and zoom range without a window, requests pipelined over one connection
+// map parts already cached are skipped, so an interrupted seeding continues where it stopped when started again
 
-void copyPixel(int sourceX, int sourceY, int destX, int destY) {
-    memcpy((void*)(((unsigned char*)buffer) + (destY * pitch + destX * 3)), (void*)(((unsigned char*)buffer) + (sourceY * pitch + sourceX * 3)), 3);
+typedef struct SeedRequest {
+    char id[25];
+    int idLength;
+    HINTERNET hRequest;
+    unsigned char* buffer;
+    int bytesRead;
+} seedRequest;
+
+const int seedBufferSize = 512 * 512 * 3;      // uncompressed size of the larger map parts, hoping it suffices, checked
+HANDLE hSeedSlots;                              // one per request which may be in flight
+LONG seedFetched;
+LONG seedFailed;
+LONGLONG seedBytes;
+
+void finishSeedRequest(seedRequest* request, int fetched) {
+    if (fetched && packAppend(&jpegPack, request->id, request->idLength, request->buffer, request->bytesRead)) {
+        InterlockedIncrement(&seedFetched);
+        InterlockedExchangeAdd64(&seedBytes, request->bytesRead);
+    }
+    else {
+        InterlockedIncrement(&seedFailed);
+    }
+    WinHttpCloseHandle(request->hRequest);
+    free(request->buffer);
+    free(request);
+    ReleaseSemaphore(hSeedSlots, 1, NULL);
 }
 
-// sourceX, sourceY is x3, y3
-void paintTriangle(int x1, int y1, int x2, int y2, int sourceX, int sourceY) {
-    int yTop = min(min(y1, y2), sourceY);
-    int yBottom = max(max(y1, y2), sourceY);
-    int yMiddle = yTop == y1 ? (yBottom == y2 ? sourceY : y2) : (yTop == y2 ? (yBottom == y1 ? sourceY : y1) : (yBottom == y2 ? y1 : y2));
-    int yTopX = yTop == y1 ? x1 : (yTop == y2 ? x2 : sourceX);
-    int yBottomX = yBottom == y1 ? x1 : (yBottom == y2 ? x2 : sourceX);
-    int yMiddleX = yMiddle == y1 ? x1 : (yMiddle == y2 ? x2 : sourceX);
-    if (yMiddle > yTop) {
-        if(yTop >= 0 && yTop < HEIGHT && yTopX >= 0 && yTopX < WIDTH)
-            copyPixel(sourceX, sourceY, yTopX, yTop);
-        float m1 = ((float)(yMiddleX - yTopX)) / (yMiddle - yTop);
-        float m2 = ((float)(yBottomX - yTopX)) / (yBottom - yTop);
-        int start;
-        int end;
-        int* lower;
-        int* upper;
-        if (yBottomX > yTopX + m1 * (yBottom - yTop)) {
-            lower = &start;
-            upper = &end;
-        }
-        else {
-            lower = &end;
-            upper = &start;
-        }
-        int maxy = (yMiddle < HEIGHT ? yMiddle + 1 : HEIGHT) - yTop;
-        for (int y = yTop >= 0 ? 1 : -yTop; y < maxy; ++y) {
-            start = yTopX + m1 * y;
-            end = yTopX + m2 * y;
-            int maxbound = *upper < WIDTH ? *upper + 1 : WIDTH;
-            for (int l = *lower >= 0 ? (*lower < WIDTH ? *lower : (WIDTH - 1)) : 0; l < maxbound; ++l) {
-                copyPixel(sourceX, sourceY, l, yTop + y);
-            }
+void onSeedLoading(HINTERNET hInternet, DWORD_PTR dwContext, DWORD dwInternetStatus, LPVOID lpvStatusInformation, DWORD dwStatusInformationLength) {
+    seedRequest* request = (seedRequest*)dwContext;
+    if (request == NULL) {
+        return;
+    }
+    if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE) {
+        if (!WinHttpReceiveResponse(request->hRequest, NULL)) {
+            finishSeedRequest(request, 0);
         }
-        if (yBottom > yMiddle) {
-            float m3 = ((float)(yBottomX - yMiddleX)) / (yBottom - yMiddle);
-            int maxy = (yBottom < HEIGHT ? yBottom + 1 : HEIGHT) - yMiddle;
-            for (int y = yMiddle >= 0 ? 1 : -yMiddle; y < maxy; ++y) {
-                start = yMiddleX + m3 * y;
-                end = yTopX + m2 * (yMiddle - yTop + y);
-                int maxbound = *upper < WIDTH ? *upper + 1 : WIDTH;
-                for (int l = *lower >= 0 ? (*lower < WIDTH ? *lower : (WIDTH - 1)) : 0; l < maxbound; ++l) {
-                    copyPixel(sourceX, sourceY, l, yMiddle + y);
-                }
-            }
+    }
+    else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE) {
+        if (!responseOk(request->hRequest) || !WinHttpReadData(request->hRequest, request->buffer, seedBufferSize, NULL)) {
+            finishSeedRequest(request, 0);                                          // error pages are not cached
         }
     }
-    else {
-        if (yTop >= 0 && yTop < HEIGHT) {
-            int lower;
-            int upper;
-            if (yTopX > yMiddleX) {
-                lower = yMiddleX >= 0 ? (yMiddleX < WIDTH ? yMiddleX : WIDTH - 1) : 0;
-                upper = yTopX < WIDTH ? yTopX + 1 : WIDTH;
-            }
-            else {
-                lower = yTopX >= 0 ? (yTopX < WIDTH ? yTopX : WIDTH - 1) : 0;
-                upper = yMiddleX < WIDTH ? yMiddleX + 1 : WIDTH;
-            }
-            for (int l = lower; l < upper; ++l) {
-                copyPixel(sourceX, sourceY, l, yTop);
-            }
+    else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_READ_COMPLETE) {
+        if (dwStatusInformationLength == 0) {
+            finishSeedRequest(request, request->bytesRead > 0);
+            return;
         }
-        if (yBottom > yMiddle) {
-            float m2 = ((float)(yBottomX - yTopX)) / (yBottom - yTop);
-            float m3 = ((float)(yBottomX - yMiddleX)) / (yBottom - yMiddle);
-            int start;
-            int end;
-            int* lower;
-            int* upper;
-            if (yTopX > yMiddleX) {
-                lower = &start;
-                upper = &end;
-            }
-            else {
-                lower = &end;
-                upper = &start;
-            }
-            int maxy = (yBottom < HEIGHT ? yBottom + 1 : HEIGHT) - yMiddle;
-            for (int y = yMiddle >= 0 ? 1 : -yMiddle; y < maxy; ++y) {
-                start = yMiddleX + m3 * y;
-                end = yTopX + m2 * y;
-                int maxbound = *upper < WIDTH ? *upper + 1 : WIDTH;
-                for (int l = *lower >= 0 ? (*lower < WIDTH ? *lower : WIDTH - 1) : 0; l < maxbound; ++l) {
-                    copyPixel(sourceX, sourceY, l, yMiddle + y);
-                }
-            }
+        request->bytesRead += dwStatusInformationLength;
+        if (request->bytesRead == seedBufferSize || !WinHttpReadData(request->hRequest, request->buffer + request->bytesRead, seedBufferSize - request->bytesRead, NULL)) {
+            finishSeedRequest(request, 0);
         }
-        else {
-            if (yTop >= 0 && yTop < HEIGHT) {
-                int lower = 0;
-                int upper = 0;
-                if (yTopX > yMiddleX) {
-                    if (yBottomX > yTopX) {
-                        lower = (yTopX + 1) >= 0 ? (yTopX + 1) < WIDTH ? (yTopX + 1) : (WIDTH - 1) : 0;
-                        upper = yBottomX < WIDTH ? yBottomX + 1 : WIDTH;
-                    }
-                    else if (yBottomX < yMiddleX) {
-                        lower = yBottomX >= 0 ? yBottomX < WIDTH ? yBottomX : (WIDTH - 1) : 0;
-                        upper = yMiddleX < WIDTH ? yMiddleX : WIDTH;
-                    }
+    }
+    else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_REQUEST_ERROR) {
+        finishSeedRequest(request, 0);
+    }
+}
+
+void printSeedProgress(unsigned long long visited, unsigned long long total, LONG skipped, ULONGLONG started, int final) {
+    double seconds = (GetTickCount64() - started) / 1000.0;
+    if (seconds <= 0.0) {
+        seconds = .001;
+    }
+    printf("\r%llu/%llu map parts, %ld fetched, %ld already cached, %ld failed, %.1f map parts/s, %.2f MB/s%s",
+        visited, total, seedFetched, skipped, seedFailed, seedFetched / seconds, seedBytes / seconds / 1000000.0, final ? "\n" : "");
+    fflush(stdout);
+}
+
+/// <summary>
+/// fetches the map parts of a region at zoom levels into the packed cache, tiled like the rasterizers do
+/// </summary>
+/// <param name="argc">of main</param>
+/// <param name="argv">of main, --seed south west north east minZoom maxZoom [concurrency] with latitudes and longitudes in degrees</param>
+/// <returns>0 when all map parts are cached, 1 otherwise</returns>
+int seed(int argc, char* argv[]) {
+    double south, west, north, east;
+    int minZoom, maxZoom, concurrency = 8;
+    if (argc < 8 || argc > 9 || sscanf(argv[2], "%lf", &south) != 1 || sscanf(argv[3], "%lf", &west) != 1 || sscanf(argv[4], "%lf", &north) != 1 || sscanf(argv[5], "%lf", &east) != 1
+        || sscanf(argv[6], "%d", &minZoom) != 1 || sscanf(argv[7], "%d", &maxZoom) != 1 || (argc == 9 && sscanf(argv[8], "%d", &concurrency) != 1)
+        || south < -90.0 || south > north || north > 90.0 || west < -180.0 || west > east || east > 180.0 || minZoom < 0 || minZoom > maxZoom || maxZoom > 30 || concurrency < 1 || concurrency > 64) {
+        fprintf(stderr, "usage: Globe --seed south west north east minZoom maxZoom [concurrency]\n"
+            "  degrees, south <= north, west <= east, 0 <= minZoom <= maxZoom <= 30, 1 <= concurrency <= 64, default 8\n");
+        return 1;
+    }
+    if (jpegPack.index == NULL) {
+        fprintf(stderr, "packed cache not usable\n");
+        return 1;
+    }
+    char* filePath = malloc(cachePathLength + 24 + 1);
+    hSeedSlots = CreateSemaphore(NULL, concurrency, concurrency, NULL);
+    HINTERNET hSession = WinHttpOpen(L"WinHTTP Globe/1.0", WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, WINHTTP_FLAG_ASYNC);
+    HINTERNET hConnect = NULL;
+    if (hSession && WinHttpSetStatusCallback(hSession, (WINHTTP_STATUS_CALLBACK)onSeedLoading, WINHTTP_CALLBACK_FLAG_SENDREQUEST_COMPLETE | WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE | WINHTTP_CALLBACK_STATUS_READ_COMPLETE | WINHTTP_CALLBACK_STATUS_REQUEST_ERROR, (DWORD_PTR)NULL) == NULL) {
+        hConnect = WinHttpConnect(hSession, host, servicePort, 0);
+    }
+    if (filePath == NULL || hSeedSlots == NULL || hConnect == NULL) {
+        fprintf(stderr, "failed connecting to the map service\n");
+        if (hConnect) WinHttpCloseHandle(hConnect);
+        if (hSession) WinHttpCloseHandle(hSession);
+        if (hSeedSlots) CloseHandle(hSeedSlots);
+        free(filePath);
+        return 1;
+    }
+    memcpy(filePath, cachePath, cachePathLength);
+
+    int xFrom[31], xTo[31], yFrom[31], yTo[31];
+    unsigned long long total = 0;
+    for (int z = minZoom; z <= maxZoom; ++z) {
+        int last = (1 << z) - 1;
+        ptD northWest, southEast;
+        northWest.p = (west + 180.0) * PID / 180.0;
+        northWest.t = -north * PID / 180.0;                                         // tile rows count from the north
+        southEast.p = (east + 180.0) * PID / 180.0;
+        southEast.t = -south * PID / 180.0;
+        tileAt(northWest, z, &xFrom[z], &yFrom[z]);
+        tileAt(southEast, z, &xTo[z], &yTo[z]);
+        xFrom[z] = max(0, min(xFrom[z], last));
+        xTo[z] = max(0, min(xTo[z], last));
+        yFrom[z] = max(0, min(yFrom[z], last));
+        yTo[z] = max(0, min(yTo[z], last));
+        total += (unsigned long long)(xTo[z] - xFrom[z] + 1) * (yTo[z] - yFrom[z] + 1);
+    }
+
+    ULONGLONG started = GetTickCount64();
+    ULONGLONG printed = started;
+    unsigned long long visited = 0;
+    LONG skipped = 0;
+    for (int z = minZoom; z <= maxZoom; ++z) {
+        for (int y = yFrom[z]; y <= yTo[z]; ++y) {
+            for (int x = xFrom[z]; x <= xTo[z]; ++x) {
+                if (GetTickCount64() - printed >= 1000) {
+                    printSeedProgress(visited, total, skipped, started, 0);
+                    printed = GetTickCount64();
                 }
-                else {
-                    if (yBottomX > yMiddleX) {
-                        lower = (yMiddleX + 1) >= 0 ? (yMiddleX + 1) < WIDTH ? (yMiddleX + 1) : (WIDTH - 1) : 0;
-                        upper = yBottomX < WIDTH ? yBottomX + 1 : WIDTH;
-                    }
-                    else if (yBottomX < yTopX) {
-                        lower = yBottomX >= 0 ? yBottomX < WIDTH ? yBottomX : (WIDTH - 1) : 0;
-                        upper = yTopX < WIDTH ? yTopX : WIDTH;
+                ++visited;
+                char id[25];
+                int idLength = sprintf_s(id, 25, idFormat, z, x, y);
+                size_t size;
+                if (packLookup(&jpegPack, id, idLength, &size, NULL) != 0) {
+                    ++skipped;
+                    continue;
+                }
+                if (legacyCache) {
+                    unsigned char* bytes = readLegacyCache(id, idLength, filePath, &size);              // moved into the packed cache
+                    if (bytes != NULL) {
+                        free(bytes);
+                        ++skipped;
+                        continue;
                     }
                 }
-                for (int l = lower; l < upper; ++l) {
-                    copyPixel(sourceX, sourceY, l, yTop);
+                while (WaitForSingleObject(hSeedSlots, 1000) == WAIT_TIMEOUT) {
+                    printSeedProgress(visited, total, skipped, started, 0);
+                    printed = GetTickCount64();
+                }
+                seedRequest* request = malloc(sizeof(seedRequest));
+                if (request != NULL) {
+                    request->buffer = malloc(seedBufferSize);
+                    if (request->buffer != NULL) {
+                        memcpy(request->id, id, idLength);
+                        request->idLength = idLength;
+                        request->bytesRead = 0;
+                        wchar_t wId[25];
+                        mbstowcs(wId, id, 25);
+                        _swprintf(path, pathFormat, wId);
+                        request->hRequest = WinHttpOpenRequest(hConnect, L"GET", path, NULL, WINHTTP_NO_REFERER, WINHTTP_DEFAULT_ACCEPT_TYPES, requestFlags);
+                        if (request->hRequest != NULL) {
+                            if (WinHttpSendRequest(request->hRequest, WINHTTP_NO_ADDITIONAL_HEADERS, 0, WINHTTP_NO_REQUEST_DATA, 0, 0, (DWORD_PTR)request)) {
+                                continue;                                           // completed by onSeedLoading
+                            }
+                            WinHttpCloseHandle(request->hRequest);
+                        }
+                        free(request->buffer);
+                    }
+                    free(request);
                 }
+                InterlockedIncrement(&seedFailed);
+                ReleaseSemaphore(hSeedSlots, 1, NULL);
             }
         }
     }
+    for (int i = 0; i < concurrency; ++i) {
+        while (WaitForSingleObject(hSeedSlots, 1000) == WAIT_TIMEOUT) {             // all requests completed when all slots are taken
+            printSeedProgress(visited, total, skipped, started, 0);
+        }
+    }
+    printSeedProgress(visited, total, skipped, started, 1);
+
+    WinHttpCloseHandle(hConnect);
+    WinHttpSetStatusCallback(hSession, NULL, WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS, (DWORD_PTR)NULL);
+    WinHttpCloseHandle(hSession);
+    CloseHandle(hSeedSlots);
+    free(filePath);
+    EnterCriticalSection(&(jpegPack.lock));
+    FlushFileBuffers(jpegPack.hData);
+    LeaveCriticalSection(&(jpegPack.lock));
+    return seedFailed == 0 ? 0 : 1;
 }
 
-void putElevation(int xC, int yC/*, int r*/) {
-    int x = centerX + xC;
-    int y = centerY + yC;
-    ptF gAngles = atF(x, y);
-    if (gAngles.t != 2.0F) {
-        //float a = 1.0F / (1.0F - maxRElevate);                        // outcommented smooth transition to non-elevation
-        //float f = a * r / roundf(rScaleF) - maxRElevate * a;
-        int16_t h = *((int16_t*)(elevationData + (((int)((gAngles.t - -PIHalfF - .0001F) / PIF * 1080)) * 2160 + (int)(gAngles.p / PIDoubleF * 2160)) * 2));
-        float RNew = rScaleF * (1.0F + /*(pow(2, maxZoomLighting - 1 - zoom) - 1) * f **/ elevationExaggeration * h / 6378000.0F);
-        ptF sAngles = atFWithoutOffsets(x, y);                          // when gAngles on globe, so are sAngles expected to be on globe
-        float sint = sinf(sAngles.t);
-        int nX = centerX + roundf(RNew * sqrtf(1.0f - sint * sint) * cosf(sAngles.p + PIF));
-        int nY = centerY + roundf(RNew * sint);
-        int s = xC * yC > 0 ? 1 : -1;                                   // omitting xC, yC == 0
-        ptF sAngles2 = atFWithoutOffsets(x - .4F, y + s * .4F);         // .5 which is the theroretical limit creates pixel smearing for small triangles due to points being rounded to neighbouring pixel, so does .425 slightly
-        if (sAngles2.t != 2.0F) {
-            float sint = sinf(sAngles2.t);
-            int nX2 = centerX + roundf(RNew * sqrtf(1.0f - sint * sint) * cosf(sAngles2.p + PIF));
-            int nY2 = centerY + roundf(RNew * sint);
-            paintTriangle(nX, nY, nX2, nY2, x, y);
+// mock map service: generated map parts for any z/x/y over plain http on this machine, to measure and test without a map service
+// responses are delayed, throttled and failed as configured
+
+unsigned int mockLatency;                       // milliseconds before each response
+unsigned int mockBandwidth;                     // KB/s per connection, 0 for unlimited
+unsigned int mockErrorRate;                     // percent of requests answered with 500
+unsigned int mockNotFoundRate;                  // percent of requests answered with 404
+
+// a map part of the colors of its z/x/y with a grid, so misplaced ones show
+unsigned char* mockTile(tjhandle tjInstance, unsigned char* pixels, int z, int x, int y, size_t* size) {
+    unsigned int hash = fnv1a((unsigned char*)&x, sizeof(x), fnv1a((unsigned char*)&y, sizeof(y), fnv1a((unsigned char*)&z, sizeof(z), 2166136261u)));
+    for (int row = 0; row < 256; ++row) {
+        for (int column = 0; column < 256; ++column) {
+            unsigned char* pixel = pixels + (row * 256 + column) * 3;
+            int shade = ((row >> 5) + (column >> 5)) & 1 ? 0 : 32;
+            int line = row == 0 || column == 0;
+            pixel[0] = line ? 255 : (unsigned char)(((hash & 0xFF) >> 1) + shade);
+            pixel[1] = line ? 255 : (unsigned char)((((hash >> 8) & 0xFF) >> 1) + shade);
+            pixel[2] = line ? 255 : (unsigned char)((z * 8) + shade);
         }
-        ptF sAngles3 = atFWithoutOffsets(x + .4F, y - s * .4F);
-        if (sAngles3.t != 2.0F) {
-            float sint = sinf(sAngles3.t);
-            int nX3 = centerX + roundf(RNew * sqrtf(1.0f - sint * sint) * cosf(sAngles3.p + PIF));
-            int nY3 = centerY + roundf(RNew * sint);
-            paintTriangle(nX, nY, nX3, nY3, x, y);
+    }
+    unsigned char* jpeg = NULL;
+    *size = 0;
+    if (tj3Compress8(tjInstance, pixels, 256, 0, 256, TJPF_RGB, &jpeg, size) != 0) {
+        tj3Free(jpeg);
+        return NULL;
+    }
+    return jpeg;
+}
+
+// sends at most mockBandwidth, in slices of 1/20 s
+int mockSend(SOCKET s, const char* bytes, int size) {
+    int slice = mockBandwidth == 0 ? size : (int)max(1, mockBandwidth * 1000 / 20);
+    while (size > 0) {
+        ULONGLONG started = GetTickCount64();
+        int sent = send(s, bytes, min(slice, size), 0);
+        if (sent <= 0) {
+            return 0;
+        }
+        bytes += sent;
+        size -= sent;
+        if (mockBandwidth != 0) {
+            ULONGLONG due = started + sent / mockBandwidth;                                 // KB/s are bytes per millisecond
+            ULONGLONG now = GetTickCount64();
+            if (due > now) {
+                Sleep((DWORD)(due - now));
+            }
         }
     }
+    return 1;
 }
 
-void elevate() {
-    int R = roundf(rScaleF);
-    int maxR = roundf(maxRElevate * R);
-    for (int r = R; r > maxR; --r) {
-        if(centerX - r >= 0 && HEIGHT > 0)
-            putElevation(-r, 0/*, r*/);
-        int lastY = 0;
-        int maxX = 1 < (WIDTH - centerX) ? 1 : (WIDTH - centerX);
-        for (int x = (centerX - r + 1) >= 0 ? (-r + 1) : (-centerX + 1); x < maxX; ++x) {
-            int y = roundf(sqrtf(r * r - x * x));
-            if (centerY - y >= 0)
-                putElevation(x, -y/*, r*/);
-            if (centerY + y < HEIGHT)
-                putElevation(x, y/*, r*/);
-            int a = (y - lastY) / 2;                                    // integers! is equal to ceil((y - lastY - 1) / 2)
-            if (centerY + y - 1 < HEIGHT && centerY - (y - 1) >= 0) {
-                for (int c = 1; c <= a; ++c) {
-                    putElevation(x - 1, lastY + c/*, r*/);
-                    putElevation(x - 1, -(lastY + c)/*, r*/);
-                    putElevation(x, y - c/*, r*/);
-                    putElevation(x, -(y - c)/*, r*/);
+// answers the requests of one connection in order, kept alive as WinHTTP reuses connections
+unsigned __stdcall mockConnection(void* data) {
+    SOCKET s = (SOCKET)data;
+    tjhandle tjInstance = tj3Init(TJINIT_COMPRESS);
+    unsigned char* pixels = malloc(256 * 256 * 3);
+    char request[8192];
+    int received = 0;
+    unsigned int random = (unsigned int)GetTickCount64() ^ (unsigned int)s * 2654435761u;
+    if (tjInstance != NULL && pixels != NULL) {
+        tj3Set(tjInstance, TJPARAM_QUALITY, 85);
+        tj3Set(tjInstance, TJPARAM_SUBSAMP, TJSAMP_420);
+        while (true) {
+            char* end = NULL;
+            while ((end = received > 0 ? strstr(request, "\r\n\r\n") : NULL) == NULL) {
+                if (received == sizeof(request) - 1) {
+                    goto CLOSE;                                                             // headers too large
                 }
+                int read = recv(s, request + received, sizeof(request) - 1 - received, 0);
+                if (read <= 0) {
+                    goto CLOSE;
+                }
+                received += read;
+                request[received] = '\0';
             }
-            else {
-                for (int c = 1; c <= a; ++c) {
-                    if (centerY + lastY + c < HEIGHT)
-                        putElevation(x - 1, lastY + c/*, r*/);
-                    if (centerY - (lastY + c) >= 0)
-                        putElevation(x - 1, -(lastY + c)/*, r*/);
-                    if (centerY + y - c < HEIGHT)
-                        putElevation(x, y - c/*, r*/);
-                    if (centerY - (y - c) >= 0)
-                        putElevation(x, -(y - c)/*, r*/);
+            int z = -1, x = 0, y = 0;
+            char* path = strncmp(request, "GET ", 4) == 0 ? request + 4 : NULL;
+            while (path != NULL && path < end && *path != ' ') {                           // the first z/x/y of the path
+                int length = 0;
+                if (*path == '/' && sscanf(path + 1, "%d/%d/%d%n", &z, &x, &y, &length) == 3 && length > 0 && z >= 0 && z <= 30 && x >= 0 && y >= 0 && x < (1 << z) && y < (1 << z)) {
+                    break;
                 }
+                z = -1;
+                ++path;
+            }
+            received -= (int)(end + 4 - request);                                          // pipelined ones stay
+            memmove(request, end + 4, received + 1);
+            if (mockLatency > 0) {
+                Sleep(mockLatency);
+            }
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            unsigned int roll = random % 100;
+            char header[160];
+            unsigned char* jpeg = NULL;
+            size_t size = 0;
+            const char* status = "404 Not Found";
+            if (roll < mockErrorRate) {
+                status = "500 Internal Server Error";
+            }
+            else if (roll >= mockErrorRate + mockNotFoundRate && z >= 0) {
+                jpeg = mockTile(tjInstance, pixels, z, x, y, &size);
+                status = jpeg != NULL ? "200 OK" : "500 Internal Server Error";
+            }
+            int headerLength = sprintf(header, "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: keep-alive\r\n\r\n", status, jpeg != NULL ? "image/jpeg" : "text/plain", size);
+            int sent = mockSend(s, header, headerLength) && (jpeg == NULL || mockSend(s, (char*)jpeg, (int)size));
+            tj3Free(jpeg);
+            if (!sent) {
+                break;
             }
-            lastY = y;
         }
-        maxX = r < (WIDTH - centerX) ? r + 1 : (WIDTH - centerX);
-        for (int x = 1; x < maxX; ++x) {
-            int y = roundf(sqrtf(r * r - x * x));
-            if (centerY - y >= 0)
-                putElevation(x, -y/*, r*/);
-            if (centerY + y < HEIGHT)
-                putElevation(x, y/*, r*/);
-            int a = (lastY - y) / 2;                                    // integers! is equal to ceil((y - lastY - 1) / 2)
-            if (centerY + lastY - 1 < HEIGHT && centerY - (lastY - 1) >= 0) {
-                for (int c = 1; c <= a; ++c) {
-                    putElevation(x - 1, lastY - c/*, r*/);
-                    putElevation(x - 1, -(lastY - c)/*, r*/);
-                    putElevation(x, y + c/*, r*/);
-                    putElevation(x, -(y + c)/*, r*/);
-                }
+    }
+CLOSE:
+    closesocket(s);
+    free(pixels);
+    if (tjInstance != NULL) {
+        tj3Destroy(tjInstance);
+    }
+    return 0;
+}
+
+/// <summary>
+/// serves generated map parts on this machine until closed
+/// </summary>
+/// <param name="argc">of main</param>
+/// <param name="argv">of main, --serve [port [latency [bandwidth [errorRate [notFoundRate]]]]]</param>
+/// <returns>1 if it could not serve</returns>
+int serve(int argc, char* argv[]) {
+    int port = 8080;
+    if ((argc > 2 && sscanf(argv[2], "%d", &port) != 1) || (argc > 3 && sscanf(argv[3], "%u", &mockLatency) != 1) || (argc > 4 && sscanf(argv[4], "%u", &mockBandwidth) != 1)
+        || (argc > 5 && sscanf(argv[5], "%u", &mockErrorRate) != 1) || (argc > 6 && sscanf(argv[6], "%u", &mockNotFoundRate) != 1)
+        || argc > 7 || port < 1 || port > 65535 || mockErrorRate + mockNotFoundRate > 100) {
+        fprintf(stderr, "usage: Globe --serve [port [latency [bandwidth [errorRate [notFoundRate]]]]]\n"
+            "  port 8080 by default, latency in milliseconds, bandwidth in KB/s per connection, 0 for unlimited,\n"
+            "  errorRate and notFoundRate in percent of requests answered with 500 and 404\n");
+        return 1;
+    }
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        fprintf(stderr, "failed starting Winsock\n");
+        return 1;
+    }
+    SOCKET listening = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in address = { 0 };
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short)port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);                                       // not reachable from other machines
+    if (listening == INVALID_SOCKET || bind(listening, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR || listen(listening, SOMAXCONN) == SOCKET_ERROR) {
+        fprintf(stderr, "failed listening on port %d\n", port);
+        if (listening != INVALID_SOCKET) {
+            closesocket(listening);
+        }
+        WSACleanup();
+        return 1;
+    }
+    printf("serving map parts, put http://localhost:%d/^^.jpg into mapservice-url.txt\n", port);
+    fflush(stdout);
+    while (true) {
+        SOCKET s = accept(listening, NULL, NULL);
+        if (s == INVALID_SOCKET) {
+            break;
+        }
+        BOOL noDelay = TRUE;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+        HANDLE hConnection = (HANDLE)_beginthreadex(NULL, 0, mockConnection, (void*)s, 0, NULL);
+        if (hConnection == 0) {
+            closesocket(s);
+        }
+        else {
+            CloseHandle(hConnection);
+        }
+    }
+    closesocket(listening);
+    WSACleanup();
+    return 1;
+}
+
+// benchmark tour: views zooming in at places apart, each shown completely before the next
+
+typedef struct BenchmarkView {
+    long double phiLeft;
+    long double axisTilt;
+    long double scale;                          // of rScale at start
+} benchmarkView;
+
+const benchmarkView benchmarkViews[] = {
+    { 0.0L, 0.0L, 2.0L },
+    { 1.0L, .3L, 4.0L },
+    { 2.0L, -.5L, 16.0L },
+    { 3.0L, .8L, 64.0L },
+    { 4.0L, -.2L, 256.0L },
+    { 5.0L, .6L, 1024.0L },
+    { .5L, -.9L, 4096.0L },
+    { 2.5L, .1L, 16384.0L }
+};
+#define BENCHMARK_VIEWS (sizeof(benchmarkViews) / sizeof(benchmarkView))
+
+int compareLatencies(const void* a, const void* b) {
+    double first = *(const double*)a;
+    double second = *(const double*)b;
+    return (first > second) - (first < second);
+}
+
+void printBenchmark(double* viewMilliseconds, double milliseconds) {
+    for (int i = 0; i < BENCHMARK_VIEWS; ++i) {
+        printf("view %d complete after %.0f ms\n", i, viewMilliseconds[i]);
+    }
+    double seconds = milliseconds > 0.0 ? milliseconds / 1000.0 : .001;
+    LONG count = min(benchmarkFetched, BENCHMARK_LATENCIES);
+    printf("%ld map parts downloaded, %ld failed, in %.1f s: %.1f map parts/s, %.2f MB/s\n", benchmarkFetched, benchmarkFailed, seconds, benchmarkFetched / seconds, benchmarkBytes / seconds / 1000000.0);
+    if (count > 0) {
+        qsort(benchmarkLatencies, count, sizeof(double), compareLatencies);
+        printf("download latency: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+            benchmarkLatencies[(int)(.5 * (count - 1))], benchmarkLatencies[(int)(.9 * (count - 1))], benchmarkLatencies[(int)(.99 * (count - 1))], benchmarkLatencies[count - 1]);
+    }
+    if (rasterLookups + rasterForwardPixels > 0) {
+        printf("%.1f %% of the pixels on the globe rastered map part by map part, ", 100.0 * rasterForwardPixels / (rasterLookups + rasterForwardPixels));
+        printf("%lld map part lookups for the others, %.1f %% answered by the directory of the map parts shown\n", rasterLookups, 100.0 * rasterLookupHits / max(rasterLookups, 1));
+    }
+    if (rasterPixels > 0) {
+        printf("%.1f %% of the positions of rastered pixels computed, the others interpolated\n", 100.0 * rasterExactPositions / rasterPixels);
+        printf("%.1f %% of the rastered pixels shown from map parts of coarser zoom levels\n", 100.0 * rasterCoarsePixels / rasterPixels);
+    }
+    for (int i = 0; i < MEMORY_CATEGORIES; ++i) {
+        printf("%s: %.1f MiB in use, %.1f MiB at most\n", memoryCategoryNames[i], memoryAccounts[i].bytes / 1048576.0, memoryAccounts[i].highWater / 1048576.0);
+    }
+    fflush(stdout);
+}
+
+// lists the memory still accounted once everything was freed on exit
+void reportLeaks() {
+    for (int i = 0; i < MEMORY_CATEGORIES; ++i) {
+        if (memoryAccounts[i].bytes != 0) {
+            if (benchmarking) {
+                printf("leaked: %lld bytes of %s\n", memoryAccounts[i].bytes, memoryCategoryNames[i]);
             }
             else {
-                for (int c = 1; c <= a; ++c) {
-                    if (centerY + lastY - c < HEIGHT)
-                        putElevation(x - 1, lastY - c/*, r*/);
-                    if (centerY - (lastY - c) >= 0)
-                        putElevation(x - 1, -(lastY - c)/*, r*/);
-                    if (centerY + y + c < HEIGHT)
-                        putElevation(x, y + c/*, r*/);
-                    if (centerY - (y + c) >= 0)
-                        putElevation(x, -(y + c)/*, r*/);
+                LOG(("leaked: %lld bytes of %s\n", memoryAccounts[i].bytes, memoryCategoryNames[i]));
+            }
+        }
+    }
+    fflush(stdout);
+}
+
+const int prefetchGridStep = 32;                // screen pixels between sampled points of a predicted view
+const long double prefetchHorizon = 300.0L;     // milliseconds the camera movement is extrapolated
+
+void addPrefetchesAround(int xStart, int yStart, int xEnd, int yEnd, double phiLeftD, double axisTiltD, double rScaleD, int z) {
+    for (int y = yStart > 0 ? yStart : 0; y < yEnd && y < HEIGHT; y += prefetchGridStep) {
+        for (int x = xStart > 0 ? xStart : 0; x < xEnd && x < WIDTH; x += prefetchGridStep) {
+            if (prefetchCount == PREFETCH_CAPACITY) {
+                return;
+            }
+            ptD angles = atDFor(x, y, phiLeftD, axisTiltD, rScaleD);
+            if (angles.t != 2.0) {
+                idData* dId = &(prefetchIds[prefetchCount]);
+                dId->idLength = getTileId(angles, z, dId->id);
+                dId->upgrade = 0;
+                int known = 0;
+                for (int i = 0; i < prefetchCount; ++i) {
+                    if (prefetchIds[i].idLength == dId->idLength && memcmp(prefetchIds[i].id, dId->id, dId->idLength) == 0) {
+                        known = 1;
+                        break;
+                    }
+                }
+                if (!known) {
+                    ++prefetchCount;
                 }
             }
-            lastY = y;
         }
     }
 }
 
-unsigned __stdcall rasterCompletionWithLighting(void* data) {
-    threadData* tData = (threadData*)data;
-    if (tData->lastQueue != NULL) {
-        hashmap_iterate(tData->lastQueue, pickPixelsWithLighting, NULL);
-        hashmap_free(tData->lastQueue);
-        //int yStart = tData->yStart;
-        //int yEnd = tData->yEnd;
-        //memcpy(((unsigned char*)region) + yStart * pitch, ((unsigned char*)buffer) + yStart * pitch, pitch * (yEnd - yStart));                        // copy all once in main thread appears to be faster than copy parts parallely from threads
-        tData->lastQueue = NULL;
+/// <summary>
+/// hands the map parts of the view expected after prefetchHorizon to the collector, which loads them at idle priority
+/// </summary>
+/// <param name="vPhi">measured rotation rate in radians per millisecond</param>
+/// <param name="vTilt">measured tilt rate in radians per millisecond</param>
+/// <param name="vZoom">measured zoom rate in zoom levels per millisecond</param>
+/// <param name="cursorX">x coordinate of the mouse wheel zoom target, -1 if not zooming in by mouse wheel</param>
+/// <param name="cursorY">y coordinate of the mouse wheel zoom target</param>
+void prefetch(long double vPhi, long double vTilt, long double vZoom, int cursorX, int cursorY) {
+    if (vPhi == 0.0L && vTilt == 0.0L && vZoom == 0.0L && cursorX < 0) {
+        return;
+    }
+    if (prefetchPending) {
+        prefetchSuperseded = 1;
+        return;
+    }
+    prefetchCount = 0;
+    if (cursorX >= 0 && zoom < 30) {
+        addPrefetchesAround(cursorX - 4 * prefetchGridStep, cursorY - 4 * prefetchGridStep, cursorX + 4 * prefetchGridStep, cursorY + 4 * prefetchGridStep, phiLeft, axisTilt, rScale, zoom + 1);
+    }
+    long double phiPredicted = fmodl(phiLeft + vPhi * prefetchHorizon + PIDouble, PIDouble);
+    long double axisTiltPredicted = axisTilt + vTilt * prefetchHorizon;
+    if (axisTiltPredicted > PIHalf) {
+        axisTiltPredicted = PIHalf;
+    }
+    else if (axisTiltPredicted < -PIHalf) {
+        axisTiltPredicted = -PIHalf;
+    }
+    long double zoomPredicted = zoomF + vZoom * prefetchHorizon;
+    if (zoomPredicted >= 0.0L && zoomPredicted <= 30.0L) {
+        addPrefetchesAround(0, 0, WIDTH, HEIGHT, phiPredicted, axisTiltPredicted, rScale * exp2l(vZoom * prefetchHorizon), (int)ceill(zoomPredicted));
+    }
+    if (prefetchCount > 0) {
+        prefetchPending = 1;
     }
-    return 0;
 }
 
 
 void freeAsyncIdMemory(void* key, size_t ksize, uintptr_t value, void* usr) {
+    value &= ~(uintptr_t)SPECULATIVE_REQUEST;
     if (value != (uintptr_t)0) {
-        if(((asyncId*)value)->buffer != NULL)
+        if(((asyncId*)value)->buffer != NULL && !((asyncId*)value)->mapped)
             free(((asyncId*)value)->buffer);
-        free((asyncId*)value);
+        if (((asyncId*)value)->upgrade)
+            free(((asyncId*)value)->id);
+        freeAsyncId((asyncId*)value);
     }
 }
 
 void freeImgPresentMemory(void* key, size_t ksize, uintptr_t value, void* usr)
 {
-    if (value != (uintptr_t)NULL) {
-        free((unsigned char*)value);
-    }
-    free((char*)key);
+    free((char*)key);                                                   // decoded map parts are freed with the tile storage
 }
 
 typedef struct IndexBounds {
@@ -2327,6 +6035,34 @@ int main(int argc, char* argv[])
     Uint32 windowID;
     SDL_Surface* icon = NULL;
 
+    int seeding = argc > 1 && strcmp(argv[1], "--seed") == 0;
+    benchmarking = argc > 1 && strcmp(argv[1], "--benchmark") == 0;
+    int checkingMath = argc > 1 && strcmp(argv[1], "--check-math") == 0;
+    int checkingProjection = argc > 1 && strcmp(argv[1], "--check-projection") == 0;
+    if (seeding || benchmarking || checkingMath || checkingProjection || (argc > 1 && strcmp(argv[1], "--serve") == 0)) {
+        AttachConsole(ATTACH_PARENT_PROCESS);                       // reporting to the console started from
+        freopen("CONOUT$", "w", stdout);
+        freopen("CONOUT$", "w", stderr);
+    }
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+        return serve(argc, argv);
+    }
+    if (checkingMath) {
+        int failed = checkMath();
+        return checkAtFAtSmallTilts() | failed;
+    }
+    if (checkingProjection) {
+        return checkProjection();
+    }
+    QueryPerformanceFrequency(&benchmarkFrequency);
+    QueryPerformanceFrequency(&hudFrequency);
+    if (seeding) {
+        window = NULL;
+        renderer = NULL;
+        texture = NULL;
+        goto SDL_STARTED;
+    }
+
     if (SDL_Init(SDL_INIT_VIDEO) == 0) {
         SDL_SetHint(SDL_HINT_MOUSE_FOCUS_CLICKTHROUGH, "1");
         window = SDL_CreateWindow("Globe", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, SDL_WINDOW_RESIZABLE);
@@ -2414,6 +6150,14 @@ SDL_STARTED:
     url = defaultURL;
 
 URL_END: ;
+    if (wcsncmp(url, L"http://", 7) == 0) {
+        servicePort = INTERNET_DEFAULT_HTTP_PORT;                               // local map services, e.g. on networks without internet
+        requestFlags = 0;
+        wmemmove(url, url + 7, wcslen(url + 7) + 1);                            // the cache stays the same as without protocol
+    }
+    else if (wcsncmp(url, L"https://", 8) == 0) {
+        wmemmove(url, url + 8, wcslen(url + 8) + 1);
+    }
     wchar_t* urlFormat;
     if (wcschr(url, L'%') == NULL) {
         wchar_t* indexKey = wcsstr(url, L"<<");
@@ -2488,6 +6232,14 @@ KEY_END: ;
             if (host != NULL) {
                 memcpy(host, urlFormat, hostSize);
                 host[pathBegin - urlFormat] = L'\0';
+                wchar_t* portBegin = wcschr(host, L':');
+                if (portBegin != NULL) {
+                    unsigned long port = wcstoul(portBegin + 1, NULL, 10);
+                    if (port > 0 && port < 65536) {
+                        servicePort = (INTERNET_PORT)port;
+                    }
+                    *portBegin = L'\0';
+                }
                 if (wcslen(urlFormat) > hostLength + 1) {
                     pathFormat = pathBegin + 1;
                     wchar_t* indexId = wcsstr(pathFormat, L"^^");
@@ -2528,7 +6280,10 @@ EXIT_APP: ;
     int count = 0;
     do {
         if ((errorsMask >> count) & 1) {
-            SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "the following error occurred:", errors[count], window);
+            if (seeding)
+                fprintf(stderr, "%s\n", errors[count]);
+            else
+                SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "the following error occurred:", errors[count], window);
         }
     } while (++count < NUM_ERRORS);
     if (freeUrl)
@@ -2546,10 +6301,17 @@ FORMAT_END: ;
     int count2 = 0;
     do {
         if ((errorsMask >> count2) & 1) {
-            SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "the following error occurred:", errors[count2], window);
+            if (seeding)
+                fprintf(stderr, "%s\n", errors[count2]);
+            else
+                SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "the following error occurred:", errors[count2], window);
         }
     } while (++count2 < NUM_ERRORS);
 
+    if (wcsstr(url, L"@2x") != NULL) {
+        setTileSize(512);                                           // high resolution map parts of common map services
+    }
+
     size_t maxNumber = wcslen(url);
     cachePath = malloc(5 + 1 + maxNumber + 1 + 1);                  // "cache/URL/"
     if (cachePath == NULL) {
@@ -2605,6 +6367,51 @@ FORMAT_END: ;
     if (freeUrl)
         free(url);
 
+    FILE* budgetFile = fopen("memory-budget.txt", "r");
+    if (budgetFile != NULL) {
+        unsigned char budgetBuffer[32];
+        size_t sizeRead = fread(budgetBuffer, 1, sizeof(budgetBuffer) - 1, budgetFile);
+        fclose(budgetFile);
+        budgetBuffer[sizeRead] = '\0';
+        indexBounds indices = getFirstLineUTF8(budgetBuffer, sizeRead);
+        unsigned int mebibytes;
+        if (sscanf((char*)budgetBuffer + indices.start, "%u", &mebibytes) == 1 && mebibytes >= 64) {
+            tileMemoryBudget = (long long)mebibytes << 20;                     // below, not even one view would fit
+        }
+    }
+
+    InitializeCriticalSection(&(jpegPack.lock));
+    InitializeCriticalSection(&(decodedPack.lock));
+    if (benchmarking) {
+        jpegPack.hData = jpegPack.hIndex = INVALID_HANDLE_VALUE;    // measuring the map service, every map part is downloaded and not cached
+        decodedPack.hData = decodedPack.hIndex = INVALID_HANDLE_VALUE;
+    }
+    else if (!openPack(&jpegPack, cachePath, cachePathLength, "tiles", 0)) {
+        LOG(("packed cache not usable, map parts are not cached\n"));
+    }
+    decodedTierUsable = !benchmarking && lzo_init() == LZO_E_OK && openPack(&decodedPack, cachePath, cachePathLength, "decoded", decodedTierBudget);
+    sprintf(idStartInCachePath, "*-*-*");
+    WIN32_FIND_DATAA legacyFile;
+    HANDLE hLegacyFind = benchmarking ? INVALID_HANDLE_VALUE : FindFirstFileA(cachePathCollector, &legacyFile);
+    if (hLegacyFind != INVALID_HANDLE_VALUE) {
+        legacyCache = 1;                                            // moved into the packed cache as read
+        FindClose(hLegacyFind);
+    }
+
+    if (seeding) {
+        int seedResult = seed(argc, argv);
+        closePack(&jpegPack);
+        closePack(&decodedPack);
+        DeleteCriticalSection(&(jpegPack.lock));
+        DeleteCriticalSection(&(decodedPack.lock));
+        free(cachePathCollector);
+        free(cachePath);
+        free(path);
+        free(host);
+        free(urlFormat);
+        return seedResult;
+    }
+
 
     FILE* compressedElevationDataFile = fopen("data/elevation.lzo", "rb");
     if (compressedElevationDataFile != NULL) {
@@ -2663,7 +6470,16 @@ ELEVATION_DONE:
         if (imgRequested != NULL) {
             imgPresent = hashmap_create();
             if (imgPresent != NULL) {
-                goto MEMORY_DONE;
+                coldTiles = hashmap_create();
+                if (coldTiles != NULL) {
+                    failedTiles = hashmap_create();
+                    if (failedTiles != NULL) {
+                        resetServiceRegions();
+                        goto MEMORY_DONE;
+                    }
+                    free(coldTiles);
+                }
+                free(imgPresent);
             }
             free(imgRequested);
         }
@@ -2672,6 +6488,10 @@ ELEVATION_DONE:
     SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "the following error occurred:", "failed allocating required memory", window);
     if (elevationDataAvailable)
         free(elevationData);
+    closePack(&jpegPack);
+    closePack(&decodedPack);
+    DeleteCriticalSection(&(jpegPack.lock));
+    DeleteCriticalSection(&(decodedPack.lock));
     free(cachePathCollector);
     free(cachePath);
     free(path);
@@ -2687,13 +6507,19 @@ ELEVATION_DONE:
 
 
 MEMORY_DONE:
+    InitializeCriticalSection(&failedTilesLock);
+    if (!benchmarking) {
+        loadFailedTiles();                                                          // measuring the map service, every map part is requested
+    }
+    wakeEvent = SDL_RegisterEvents(1);
+    hCollectorWake = CreateEvent(NULL, FALSE, FALSE, NULL);
     allImagesRequestedPresent = 1;
     rastered = 0;
     notScheduled = 0;
     wantsCompletion = 0;
     dontWaitForCollector = 1;
 
-    notquitrequested = 1;
+    notquitrequested = wakeEvent != (Uint32)-1 && hCollectorWake != NULL;
 
     centerX = WIDTH / 2;
     centerY = HEIGHT / 2;
@@ -2708,6 +6534,7 @@ MEMORY_DONE:
     rScaleF = rScale;
 
     determineZoom();
+    determineProjectionTier();
 
     dir = INIT;
 
@@ -2717,18 +6544,53 @@ MEMORY_DONE:
         threadsData[i].dId.next = NULL;
         threadsData[i].imageRequestRequested = 0;
         threadsData[i].lastQueue = NULL;
+        threadsData[i].lastQueueBytes = 0;
         threadsData[i].hComplete = 0;
     }
 
     for (int i = 0; i < maxThreads; ++i) {
         threadsData[i].yStart = (i * HEIGHT) / maxThreads;
         threadsData[i].yEnd = ((i + 1) * HEIGHT) / maxThreads;
-        threadsData[i].hThread = (HANDLE)_beginthreadex(NULL, 0, zoomF < maxZoomLighting ? rasterFWithLighting : zoom < 16 ? rasterF : zoom < 24 ? rasterD : raster, (void*)&(threadsData[i]), 0, NULL);
+        threadsData[i].hThread = (HANDLE)_beginthreadex(NULL, 0, zoomF + zoomOffset < maxZoomLighting ? rasterFWithLighting : raster, (void*)&(threadsData[i]), 0, NULL);
         if (threadsData[i].hThread == 0) {
             notquitrequested = 0;
         }
     }
 
+    InitializeCriticalSection(&tileStorageLock);
+    initJobQueue(&decodeJobs);
+    HANDLE hDecoders[4];
+    int decoderCount = SDL_GetCPUCount() / 4;
+    if (decoderCount < 1) {
+        decoderCount = 1;
+    }
+    else if (decoderCount > 4) {
+        decoderCount = 4;
+    }
+    for (int i = 0; i < decoderCount; ++i) {
+        hDecoders[i] = (HANDLE)_beginthreadex(NULL, 0, decoder, NULL, 0, NULL);
+        if (hDecoders[i] == 0) {
+            notquitrequested = 0;
+        }
+    }
+    HANDLE hPresenceScan = (HANDLE)_beginthreadex(NULL, 0, presenceScan, NULL, 0, NULL);
+    InitializeCriticalSection(&writeLock);
+    InitializeConditionVariable(&writesAvailable);
+    HANDLE hWriter = (HANDLE)_beginthreadex(NULL, 0, writer, NULL, 0, NULL);
+    if (hWriter == 0) {
+        notquitrequested = 0;
+    }
+    initJobQueue(&readJobs);
+    const int readerCount = 4;                                      // reads in flight at once, cold caches on spinning or network disks are latency bound
+    HANDLE hReaders[4];
+    for (int i = 0; i < readerCount; ++i) {
+        hReaders[i] = (HANDLE)_beginthreadex(NULL, 0, reader, NULL, 0, NULL);
+        if (hReaders[i] == 0) {
+            notquitrequested = 0;
+        }
+    }
+
+    publishView();
     doCollecting = 1;
     checkingImageRequests = 1;
     HANDLE hCollector = (HANDLE)_beginthreadex(NULL, 0, collector, NULL, 0, NULL);
@@ -2753,13 +6615,26 @@ MEMORY_DONE:
     int windowSizeChanged = 0;
 
     int dequeueing = 0;
+    long long rasterStarted = hudTicks();                               // of the frame, for the figures drawn with H
+    long long completionStarted = 0;
+
+    Uint64 lastScheduled = 0;
+    long double vPhi = 0.0L, vTilt = 0.0L, vZoom = 0.0L;                 // camera velocity per millisecond for prefetching
+    int wheelZoomIn = 0;
+    int redetermineZoom = 0;
 
     int textureLock = 1;
     int nonRequestedExit = 1;
 
+    int benchmarkStep = -1;                                             // the initial view is shown before the tour
+    double benchmarkViewMilliseconds[BENCHMARK_VIEWS];
+    Uint64 benchmarkStarted = 0, benchmarkViewStarted = 0;
+    long double benchmarkScale = rScale;
+
     SDL_Event event;
     while (notquitrequested) {
-        while (SDL_PollEvent(&event)) {                 // poll until all events are handled!
+        int schedulable = (act || windowSizeChanged) && rastered && !dequeueing && notScheduled && dontWaitForCollector;     // set by this thread meanwhile, no wake up follows
+        for (int hasEvent = SDL_WaitEventTimeout(&event, schedulable ? 0 : idleWaitTimeout); hasEvent; hasEvent = SDL_PollEvent(&event)) {        // block until woken, then handle all events!
             switch (event.type) {
                 case SDL_QUIT:
                     notquitrequested = 0;
@@ -2843,6 +6718,36 @@ MEMORY_DONE:
                             }
                             dir = ZOUT;
                             break;
+#ifdef DEBUG
+                        case SDLK_f:
+                            if (event.key.repeat == 0) {
+                                forwardRastering = !forwardRastering;
+                            }
+                            dir = REFRESH;
+                            break;
+#endif
+#ifdef DEBUG
+                        case SDLK_g:
+                            if (event.key.repeat == 0) {
+                                gridInterpolation = !gridInterpolation;
+                            }
+                            dir = REFRESH;
+                            break;
+#endif
+#ifdef DEBUG
+                        case SDLK_l:
+                            if (event.key.repeat == 0) {
+                                levelOfDetail = !levelOfDetail;
+                            }
+                            dir = REFRESH;
+                            break;
+#endif
+                        case SDLK_h:
+                            if (event.key.repeat == 0) {
+                                hud = !hud;
+                            }
+                            dir = REFRESH;
+                            break;
                         default:
                             dir = REFRESH;
                             break;
@@ -2895,6 +6800,7 @@ MEMORY_DONE:
                         if ((event.wheel.direction == SDL_MOUSEWHEEL_NORMAL ? 1 : -1) * event.wheel.y > 0) {
                             rScaleWaiting = rScale * 1.2L;
                             dir = ZIN;
+                            wheelZoomIn = 1;
                         }
                         else {
                             rScaleWaiting = rScale / 1.2L;
@@ -2939,17 +6845,41 @@ MEMORY_DONE:
             }
         }
 
+        InterlockedExchange(&wakePending, 0);                                           // before checking the state, so changes from now on wake again
+
+        if (tileSizeChanged) {
+            tileSizeChanged = 0;
+            redetermineZoom = 1;
+            dir = REFRESH;
+            act = 1;
+        }
+
         if (act && rastered && !dequeueing && notScheduled) {
             notScheduled = 0;
             if (dontWaitForCollector) {
                 act = 0;
+                Uint64 now = SDL_GetTicks64();
+                long double elapsed = now - lastScheduled;
+                if (elapsed > 0.0L && elapsed < 2.0L * prefetchHorizon) {                     // sustained movement, otherwise the camera is assumed to have stood still
+                    long double deltaPhi = phiLeftWaiting - phiLeft;
+                    deltaPhi += deltaPhi > PI ? -PIDouble : (deltaPhi < -PI ? PIDouble : 0.0L);
+                    vPhi = deltaPhi / elapsed;
+                    vTilt = (axisTiltWaiting - axisTilt) / elapsed;
+                    vZoom = log2l(rScaleWaiting / rScale) / elapsed;
+                }
+                else {
+                    vPhi = 0.0L;
+                    vTilt = 0.0L;
+                    vZoom = 0.0L;
+                }
+                lastScheduled = now;
                 phiLeft = phiLeftWaiting;
                 axisTilt = axisTiltWaiting;
                 axisTiltF = axisTilt;
                 phiLeftF = phiLeft;
                 axisTiltD = axisTilt;
                 phiLeftD = phiLeft;
-                if (rScale != rScaleWaiting) {
+                if (rScale != rScaleWaiting || redetermineZoom) {
                     rScale = rScaleWaiting;
                     rScaleSqr = rScale * rScale;
                     rScaleSqrF = rScaleSqr;
@@ -2957,19 +6887,29 @@ MEMORY_DONE:
                     rScaleSqrD = rScaleSqr;
                     rScaleD = rScale;
                     determineZoom();
+                    determineProjectionTier();
+                    redetermineZoom = 0;
                 }
+                publishView();
+                prefetch(vPhi, vTilt, vZoom, wheelZoomIn ? mouseX : -1, mouseY);
+                wheelZoomIn = 0;
                 queued = 0;
+                ++frame;
+                rasterStarted = hudTicks();
+                unsigned char* retired = takeRetiredTiles();                                // replaced before now, so only read by the rasterizers waited for below
                 for (int i = 0; i < maxThreads; ++i) {
                     WaitForSingleObject(threadsData[i].hThread, INFINITE);
                     CloseHandle(threadsData[i].hThread);
-                    threadsData[i].hThread = (HANDLE)_beginthreadex(NULL, 0, zoomF < maxZoomLighting ? rasterFWithLighting : zoom < 16 ? rasterF : zoom < 24 ? rasterD : raster, (void*)&(threadsData[i]), 0, NULL);
+                    threadsData[i].hThread = (HANDLE)_beginthreadex(NULL, 0, zoomF + zoomOffset < maxZoomLighting ? rasterFWithLighting : raster, (void*)&(threadsData[i]), 0, NULL);
                     if (threadsData[i].hThread == 0) {
                         notquitrequested = 0;
                         goto AFTER_LOOP;
                     }
                 }
+                releaseTiles(retired);
                 if (!collecting) {
                     doCollecting = 0;
+                    wakeCollector();
                     WaitForSingleObject(hCollector, INFINITE);
                     CloseHandle(hCollector);
                     doCollecting = 1;
@@ -2983,6 +6923,7 @@ MEMORY_DONE:
             }
             else {
                 notScheduled = 1;
+                wakeCollector();
             }
         }
         if (!rastered) {
@@ -2991,19 +6932,28 @@ MEMORY_DONE:
                 countRastering += threadsData[i].rastering;
             }
             if (countRastering == 0) {
-                if (zoomF < maxZoomLighting && elevationDataAvailable) {
+                noteRastered(rasterStarted);
+                long long elevateStarted = hudTicks();
+                if (zoomF + zoomOffset < maxZoomLighting && elevationDataAvailable) {
                     elevate();
                 }
+                hudFrame.elevate = hudMilliseconds(elevateStarted);
+                long long presentStarted = hudTicks();
                 memcpy(region, buffer, pitch * HEIGHT);                             // copy all once in main thread appears to be faster than copy parts parallely from threads
+                if (hud) {
+                    drawHud();                                                      // into the texture only, the buffer stays the frame
+                }
                 SDL_UnlockTexture(texture);
                 SDL_RenderCopy(renderer, texture, NULL, NULL);
                 SDL_RenderPresent(renderer);
+                notePresent(presentStarted);
                 if (SDL_LockTexture(texture, NULL, &region, &pitch) != 0) {
                     textureLock = 0;
                     notquitrequested = 0;
                     goto AFTER_LOOP;
                 }
                 rastered = 1;
+                wakeCollector();
             }
         }
         else if (queued) {
@@ -3012,16 +6962,18 @@ MEMORY_DONE:
                 if (dontWaitForCollector) {
                     queued = 0;
                     dequeueing = 1;
+                    completionStarted = hudTicks();
                     for (int i = 0; i < maxThreads; ++i) {
                         if (threadsData[i].hComplete != 0) {
                             WaitForSingleObject(threadsData[i].hComplete, INFINITE);
                             CloseHandle(threadsData[i].hComplete);
                         }
-                        threadsData[i].hComplete = (HANDLE)_beginthreadex(NULL, 0, zoomF < maxZoomLighting ? rasterCompletionWithLighting : rasterCompletion, (void*)&(threadsData[i]), 0, NULL);
+                        threadsData[i].hComplete = (HANDLE)_beginthreadex(NULL, 0, zoomF + zoomOffset < maxZoomLighting ? rasterCompletionWithLighting : rasterCompletion, (void*)&(threadsData[i]), 0, NULL);
                     }
                 }
                 else {
                     wantsCompletion = 0;
+                    wakeCollector();
                 }
             }
         }
@@ -3033,22 +6985,52 @@ MEMORY_DONE:
                 }
             }
             if (countNotEmpties == 0) {
-                if (zoomF < maxZoomLighting && elevationDataAvailable) {
+                hudFrame.completion = hudMilliseconds(completionStarted);
+                long long elevateStarted = hudTicks();
+                if (zoomF + zoomOffset < maxZoomLighting && elevationDataAvailable) {
                     elevate();
                 }
+                hudFrame.elevate = hudMilliseconds(elevateStarted);
+                long long presentStarted = hudTicks();
                 memcpy(region, buffer, pitch * HEIGHT);                             // copy all once in main thread appears to be faster than copy parts parallely from threads
+                if (hud) {
+                    drawHud();                                                      // into the texture only, the buffer stays the frame
+                }
                 SDL_UnlockTexture(texture);
                 SDL_RenderCopy(renderer, texture, NULL, NULL);
                 SDL_RenderPresent(renderer);
+                notePresent(presentStarted);
                 if (SDL_LockTexture(texture, NULL, &region, &pitch) != 0) {
                     textureLock = 0;
                     notquitrequested = 0;
                     goto AFTER_LOOP;
                 }
                 wantsCompletion = 0;
+                wakeCollector();
                 dequeueing = 0;
             }
         }
+        else if (benchmarking && !act && notScheduled) {                         // rastered, nothing missing: the view is complete
+            Uint64 now = SDL_GetTicks64();
+            if (benchmarkStep >= 0) {
+                benchmarkViewMilliseconds[benchmarkStep] = (double)(now - benchmarkViewStarted);
+            }
+            else {
+                benchmarkStarted = now;
+            }
+            if (++benchmarkStep == BENCHMARK_VIEWS) {
+                printBenchmark(benchmarkViewMilliseconds, (double)(now - benchmarkStarted));
+                notquitrequested = 0;
+                nonRequestedExit = 0;
+                goto AFTER_LOOP;
+            }
+            phiLeftWaiting = benchmarkViews[benchmarkStep].phiLeft;
+            axisTiltWaiting = benchmarkViews[benchmarkStep].axisTilt;
+            rScaleWaiting = benchmarkScale * benchmarkViews[benchmarkStep].scale;
+            dir = ZIN;
+            act = 1;
+            benchmarkViewStarted = now;
+        }
 
         if (windowSizeChanged) {
             if (rastered && !dequeueing && notScheduled) {
@@ -3092,11 +7074,16 @@ MEMORY_DONE:
                     axisTiltD = axisTilt;
                     phiLeftD = phiLeft;
                     determineZoom();
+                    determineProjectionTier();
+                    publishView();
                     queued = 0;
+                    ++frame;
+                    rasterStarted = hudTicks();
                     for (int i = 0; i < maxThreads; ++i) {
                         WaitForSingleObject(threadsData[i].hThread, INFINITE);
                         CloseHandle(threadsData[i].hThread);
                     }
+                    releaseTiles(takeRetiredTiles());
                     if (cores > HEIGHT) {
                         maxThreads = HEIGHT;
                     }
@@ -3106,7 +7093,7 @@ MEMORY_DONE:
                     for (int i = 0; i < maxThreads; ++i) {
                         threadsData[i].yStart = (i * HEIGHT) / maxThreads;
                         threadsData[i].yEnd = ((i + 1) * HEIGHT) / maxThreads;
-                        threadsData[i].hThread = (HANDLE)_beginthreadex(NULL, 0, zoomF < maxZoomLighting ? rasterFWithLighting : zoom < 16 ? rasterF : zoom < 24 ? rasterD : raster, (void*)&(threadsData[i]), 0, NULL);
+                        threadsData[i].hThread = (HANDLE)_beginthreadex(NULL, 0, zoomF + zoomOffset < maxZoomLighting ? rasterFWithLighting : raster, (void*)&(threadsData[i]), 0, NULL);
                         if (threadsData[i].hThread == 0) {
                             notquitrequested = 0;
                             maxThreads = i;
@@ -3115,6 +7102,7 @@ MEMORY_DONE:
                     }
                     if (!collecting) {
                         doCollecting = 0;
+                        wakeCollector();
                         WaitForSingleObject(hCollector, INFINITE);
                         CloseHandle(hCollector);
                         doCollecting = 1;
@@ -3128,6 +7116,7 @@ MEMORY_DONE:
                 }
                 else {
                     notScheduled = 1;
+                    wakeCollector();
                 }
             }
         }
@@ -3143,10 +7132,41 @@ AFTER_LOOP:
 
     if (hCollector != 0) {
         doCollecting = 0;
+        wakeCollector();
         WaitForSingleObject(hCollector, INFINITE);
         CloseHandle(hCollector);
     }
 
+    wakeJobQueue(&readJobs);
+    for (int i = 0; i < readerCount; ++i) {
+        if (hReaders[i] != 0) {
+            WaitForSingleObject(hReaders[i], INFINITE);
+            CloseHandle(hReaders[i]);
+        }
+    }
+    wakeJobQueue(&decodeJobs);
+    for (int i = 0; i < decoderCount; ++i) {
+        if (hDecoders[i] != 0) {
+            WaitForSingleObject(hDecoders[i], INFINITE);
+            CloseHandle(hDecoders[i]);
+        }
+    }
+
+    if (hPresenceScan != 0) {
+        WaitForSingleObject(hPresenceScan, INFINITE);
+        CloseHandle(hPresenceScan);
+    }
+    free(legacyBloom);
+
+    writerStop = 1;                                                 // after the decoders, which queue promotions
+    EnterCriticalSection(&writeLock);
+    WakeAllConditionVariable(&writesAvailable);
+    LeaveCriticalSection(&writeLock);
+    if (hWriter != 0) {
+        WaitForSingleObject(hWriter, INFINITE);
+        CloseHandle(hWriter);
+    }
+
     for (int i = 0; i < maxThreads; ++i) {
         if (threadsData[i].hThread != 0) {
             WaitForSingleObject(threadsData[i].hThread, INFINITE);
@@ -3157,6 +7177,7 @@ AFTER_LOOP:
         if (threadsData[i].lastQueue != NULL) {
             hashmap_iterate(threadsData[i].lastQueue, clearQueue, NULL);
             hashmap_free(threadsData[i].lastQueue);
+            noteFreed(MEMORY_QUEUES, threadsData[i].lastQueueBytes);
         }
         if (threadsData[i].hComplete != 0) {
             WaitForSingleObject(threadsData[i].hComplete, INFINITE);
@@ -3166,17 +7187,37 @@ AFTER_LOOP:
         while (id != NULL) {
             idData* currentId = id;
             id = id->next;
+            noteFreed(MEMORY_REQUEST_CHAINS, sizeof(idData));
             free(currentId);
         }
     }
 
     free(threadsData);
 
+    if (!benchmarking) {
+        saveFailedTiles();
+    }
+    hashmap_iterate(failedTiles, freeFailedTile, NULL);
     hashmap_iterate(imgRequested, freeAsyncIdMemory, NULL);
     hashmap_iterate(imgPresent, freeImgPresentMemory, NULL);
+    freeColdTiles();
 
     hashmap_free(imgPresent);
     hashmap_free(imgRequested);
+    hashmap_free(coldTiles);
+    hashmap_free(failedTiles);
+    DeleteCriticalSection(&failedTilesLock);
+
+    freeTileStorage();
+    closePack(&jpegPack);                                           // after freeing the requests, mapped slices of the packs are not in use anymore
+    closePack(&decodedPack);
+    DeleteCriticalSection(&(jpegPack.lock));
+    DeleteCriticalSection(&(decodedPack.lock));
+    DeleteCriticalSection(&writeLock);
+    DeleteCriticalSection(&(readJobs.lock));
+    DeleteCriticalSection(&(decodeJobs.lock));
+    DeleteCriticalSection(&tileStorageLock);
+    CloseHandle(hCollectorWake);
 
     free(cachePathCollector);
     free(cachePath);
@@ -3195,6 +7236,7 @@ AFTER_LOOP:
     SDL_DestroyWindow(window);
     SDL_Quit();
 
+    reportLeaks();
     LOG(("app end\n"));
 
     return 0;